@@ -0,0 +1,193 @@
+/*
+ * VMnet -- proxy ARP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * To make a guest reachable from the LAN, the host has to answer ARP
+ * requests for the guest's address on its Ethernet interface.  That
+ * used to be left to the up/down script (arp -s, or the proxy_arp
+ * sysctl).  With the "proxyarp" option vmnet does it itself: it opens
+ * a packet socket on the interface and answers requests for its
+ * guest's address with the interface's own hardware address.
+ *
+ * A socket filter in the kernel passes only the requests for our
+ * guest, so the other vmnets on the host never even wake up for them.
+ * When the session starts we announce the address with a gratuitous
+ * ARP, so neighbours that still had an old entry pick up the change.
+ *
+ * The host still has to forward between the interface and sl%d
+ * (net.ipv4.ip_forward).  There is nothing to do for IPv6 neighbour
+ * discovery, as vmnet only carries IPv4.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <netpacket/packet.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include "arp.h"
+
+/* an Ethernet/IPv4 ARP packet, as a SOCK_DGRAM packet socket sees it */
+struct arppkt {
+	uint16_t hrd;
+	uint16_t pro;
+	uint8_t hln;
+	uint8_t pln;
+	uint16_t op;
+	uint8_t sha[ETH_ALEN];
+	uint8_t spa[4];
+	uint8_t tha[ETH_ALEN];
+	uint8_t tpa[4];
+} __attribute__((packed));
+
+static int ifindex;
+static uint8_t ifmac[ETH_ALEN];
+
+/* Find out the index and hardware address of the socket's interface */
+static int arp_ifinfo(int fd)
+{
+	struct sockaddr_ll sll;
+	struct ifreq ifr;
+	socklen_t len = sizeof(sll);
+
+	if (getsockname(fd, (struct sockaddr *)&sll, &len) < 0) {
+		return -1;
+	}
+	ifindex = sll.sll_ifindex;
+	memset(&ifr, 0, sizeof(ifr));
+	if (if_indextoname(ifindex, ifr.ifr_name) == NULL
+	 || ioctl(fd, SIOCGIFHWADDR, &ifr) < 0
+	 || ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+		return -1;
+	}
+	memcpy(ifmac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+	return 0;
+}
+
+static void arp_send(slipconn *sc, int op, const uint8_t *tha,
+	const uint8_t *tpa, const uint8_t *dst)
+{
+	struct arppkt a;
+	struct sockaddr_ll sll;
+
+	a.hrd = htons(ARPHRD_ETHER);
+	a.pro = htons(ETH_P_IP);
+	a.hln = ETH_ALEN;
+	a.pln = 4;
+	a.op = htons(op);
+	memcpy(a.sha, ifmac, ETH_ALEN);
+	memcpy(a.spa, &sc->remote, 4);
+	memcpy(a.tha, tha, ETH_ALEN);
+	memcpy(a.tpa, tpa, 4);
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ARP);
+	sll.sll_ifindex = ifindex;
+	sll.sll_halen = ETH_ALEN;
+	memcpy(sll.sll_addr, dst, ETH_ALEN);
+	sendto(sc->arpfd, &a, sizeof(a), MSG_DONTWAIT,
+		(struct sockaddr *)&sll, sizeof(sll));
+}
+
+int arp_open(slipconn *sc)
+{
+	static const uint8_t bcast[ETH_ALEN] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+	};
+	struct sock_filter code[] = {
+		/* an Ethernet/IPv4 request, for our guest's address */
+		BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ARPHRD_ETHER, 0, 7),
+		BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 2),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ETH_P_IP, 0, 5),
+		BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 6),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ARPOP_REQUEST, 0, 3),
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 24),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ntohl(sc->remote), 0, 1),
+		BPF_STMT(BPF_RET|BPF_K, sizeof(struct arppkt)),
+		BPF_STMT(BPF_RET|BPF_K, 0),
+	};
+	struct sock_fprog prog;
+	struct sockaddr_ll sll;
+	int fd;
+
+	sc->arpfd = -1;
+	if (*sc->arpif == '\0') {
+		return -1;
+	}
+	/* protocol 0: nothing arrives before the filter is in place */
+	if ((fd = socket(AF_PACKET, SOCK_DGRAM, 0)) < 0) {
+		perror("vmnet: proxyarp socket");
+		return -1;
+	}
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ARP);
+	sll.sll_ifindex = if_nametoindex(sc->arpif);
+	if (sll.sll_ifindex == 0
+	 || setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+		sizeof(prog)) < 0
+	 || bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0
+	 || arp_ifinfo(fd) < 0) {
+		fprintf(stderr, "vmnet: cannot do proxy ARP on %s\n",
+			sc->arpif);
+		close(fd);
+		return -1;
+	}
+	sc->arpfd = fd;
+	arp_send(sc, ARPOP_REPLY, bcast, (uint8_t *)&sc->remote, bcast);
+	return fd;
+}
+
+/* Pick up the socket the old vmnet handed over, see upgrade.c */
+int arp_resume(slipconn *sc)
+{
+	if (sc->arpfd >= 0 && arp_ifinfo(sc->arpfd) < 0) {
+		close(sc->arpfd);
+		sc->arpfd = -1;
+	}
+	return sc->arpfd;
+}
+
+void arp_close(slipconn *sc)
+{
+	if (sc->arpfd >= 0) {
+		close(sc->arpfd);
+		sc->arpfd = -1;
+	}
+}
+
+/* Answer the requests that came in */
+void arp_input(slipconn *sc)
+{
+	struct arppkt a;
+	struct sockaddr_ll sll;
+	socklen_t len;
+
+	for (;;) {
+		len = sizeof(sll);
+		if (recvfrom(sc->arpfd, &a, sizeof(a), MSG_DONTWAIT,
+		    (struct sockaddr *)&sll, &len) != sizeof(a)) {
+			return;
+		}
+		/* the filter did the rest, except for our own packets */
+		if (sll.sll_pkttype == PACKET_OUTGOING
+		 || a.hln != ETH_ALEN || a.pln != 4) {
+			continue;
+		}
+		arp_send(sc, ARPOP_REPLY, a.sha, a.spa, a.sha);
+	}
+}
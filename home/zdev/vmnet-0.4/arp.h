@@ -0,0 +1,20 @@
+/*
+ * VMnet -- proxy ARP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef ARP_H
+#define ARP_H
+
+#include "vmnet.h"
+
+int arp_open(slipconn *sc);
+int arp_resume(slipconn *sc);
+void arp_close(slipconn *sc);
+void arp_input(slipconn *sc);
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * VMnet -- relay buffers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vmnet used to keep two 16k buffers on the stack for the life of the
+ * session, whether there was any traffic or not.  With the frame
+ * decoders that became four buffers and two frames.  Now a session
+ * only holds buffer space while data is in flight: the I/O buffers
+ * come from a pool of chunks in the shared segment, and a decoder
+ * borrows a packet buffer from the shared packet pool while it is in
+ * the middle of a frame.  Both go back as soon as they are empty, so
+ * an idle session holds none, and memory scales with the number of
+ * busy sessions rather than with the number of sessions.
+ *
+ * Chunks remember their owner's session slot so the chunks of a vmnet
+ * that died can be swept up.  If the shared segment is missing or its
+ * pools are exhausted we fall back to private memory, which is kept
+ * for reuse rather than freed.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buf.h"
+#include "log.h"
+#include "shm.h"
+
+static int bufslot = -1;
+
+/* process private buffers, a stack linked through their first bytes */
+static char *privbufs = NULL;
+static unsigned char *privframes = NULL;
+
+void iopool_init(struct iopool *pool)
+{
+	int i;
+
+	for (i = 0; i < IOPOOL_SIZE; i++) {
+		pool->chunk[i].owner = -1;
+		pool->chunk[i].next = i + 2 <= IOPOOL_SIZE ? i + 2 : 0;
+	}
+	pool->head = 1;
+	pool->nofree = 0;
+}
+
+static char *iopool_get(struct iopool *pool, int slot)
+{
+	uint64_t head, new;
+	struct iochunk *c;
+
+	head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+	do {
+		if ((uint32_t)head == 0) {
+			__atomic_add_fetch(&pool->nofree, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+		c = &pool->chunk[(uint32_t)head - 1];
+		new = ((head >> 32) + 1) << 32
+			| __atomic_load_n(&c->next, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&pool->head, &head, new, 1,
+			__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	c->owner = slot;
+	return c->data;
+}
+
+static void iopool_put(struct iopool *pool, struct iochunk *c)
+{
+	uint64_t head, new;
+	uint32_t idx = c - pool->chunk;
+
+	c->owner = -1;
+	head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+	do {
+		c->next = (uint32_t)head;
+		new = ((head >> 32) + 1) << 32 | (idx + 1);
+	} while (!__atomic_compare_exchange_n(&pool->head, &head, new, 1,
+			__ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+/* Return the chunks of a session that went away */
+void iopool_sweep(struct iopool *pool, int slot)
+{
+	int i;
+
+	for (i = 0; i < IOPOOL_SIZE; i++) {
+		if (__atomic_load_n(&pool->chunk[i].owner, __ATOMIC_RELAXED)
+				== slot) {
+			iopool_put(pool, &pool->chunk[i]);
+		}
+	}
+}
+
+/* Draw buffers from the shared pools on behalf of this session slot */
+void buf_attach(int slot)
+{
+	bufslot = slot;
+}
+
+static int inpool(void *p, void *base, size_t size)
+{
+	return (char *)p >= (char *)base && (char *)p < (char *)base + size;
+}
+
+void bufinit(struct buf *buf)
+{
+	buf->len = 0;
+	buf->ptr = NULL;
+	buf->data = NULL;
+}
+
+/* Make sure buf has its data area, returns it */
+char *bufget(struct buf *buf)
+{
+	char *p = NULL;
+
+	if (buf->data != NULL) {
+		return buf->data;
+	}
+	if (shm != NULL && bufslot >= 0) {
+		p = iopool_get(&shm->iopool, bufslot);
+	}
+	if (p == NULL && (p = privbufs) != NULL) {
+		memcpy(&privbufs, p, sizeof(char *));
+	}
+	if (p == NULL && (p = malloc(BUF_SIZE)) == NULL) {
+		logmsg(LM_NOMEM, "a relay buffer", 0, 0, errno);
+		exit(1);
+	}
+	buf->data = buf->ptr = p;
+	buf->len = 0;
+	return p;
+}
+
+/* Give the data area back, whatever is in it */
+void bufdrop(struct buf *buf)
+{
+	char *p = buf->data;
+
+	if (p == NULL) {
+		return;
+	}
+	if (shm != NULL && inpool(p, shm->iopool.chunk,
+			sizeof(shm->iopool.chunk))) {
+		iopool_put(&shm->iopool, (struct iochunk *)
+			(p - offsetof(struct iochunk, data)));
+	} else {
+		memcpy(p, &privbufs, sizeof(char *));
+		privbufs = p;
+	}
+	bufinit(buf);
+}
+
+/* Give the data area back if there is nothing in it */
+void bufidle(struct buf *buf)
+{
+	if (buf->len == 0) {
+		bufdrop(buf);
+	}
+}
+
+/* Make room at the end of buf by moving pending data to the front */
+int bufroom(struct buf *buf)
+{
+	if (buf->data == NULL) {
+		return BUF_SIZE;
+	}
+	if (buf->ptr != buf->data) {
+		memmove(buf->data, buf->ptr, buf->len);
+		buf->ptr = buf->data;
+	}
+	return BUF_SIZE - buf->len;
+}
+
+/* Append a frame, SLIP encoded; the caller has checked bufroom() */
+void bufputframe(struct buf *buf, unsigned char *frame, int len)
+{
+	bufget(buf);
+	buf->len += slip_encode((unsigned char *)buf->ptr + buf->len,
+		frame, len);
+}
+
+/* A frame's worth of memory for a decoder, from the packet pool */
+unsigned char *framebuf_get(void)
+{
+	struct pkt *p;
+	unsigned char *f;
+
+	if (shm != NULL && bufslot >= 0
+	 && (p = pkt_alloc(&shm->pool, bufslot)) != NULL) {
+		return p->data;
+	}
+	if ((f = privframes) != NULL) {
+		memcpy(&privframes, f, sizeof(unsigned char *));
+		return f;
+	}
+	if ((f = malloc(SLIP_MAXFRAME)) == NULL) {
+		logmsg(LM_NOMEM, "a frame", 0, 0, errno);
+		exit(1);
+	}
+	return f;
+}
+
+void framebuf_put(unsigned char *f)
+{
+	struct pkt *p;
+
+	if (shm != NULL && inpool(f, shm->pool.pkt, sizeof(shm->pool.pkt))) {
+		p = &shm->pool.pkt[((char *)f - (char *)shm->pool.pkt)
+			/ sizeof(struct pkt)];
+		pkt_release(&shm->pool, p, bufslot);
+	} else {
+		memcpy(f, &privframes, sizeof(unsigned char *));
+		privframes = f;
+	}
+}
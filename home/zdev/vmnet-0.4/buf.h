@@ -0,0 +1,52 @@
+/*
+ * VMnet -- relay buffers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef BUF_H
+#define BUF_H
+
+#include <stdint.h>
+
+#include "config.h"
+#include "slip.h"
+
+#define BUF_SIZE	(16*1024)
+
+struct buf {
+	int len;
+	char *ptr;
+	char *data;	/* BUF_SIZE bytes while in use, NULL while idle */
+};
+
+struct iochunk {
+	uint32_t next;		/* free list link, index + 1 */
+	int32_t owner;		/* session slot holding it, -1 if free */
+	char data[BUF_SIZE];
+};
+
+struct iopool {
+	uint64_t head;		/* free list: tag << 32 | index + 1 */
+	uint32_t nofree;	/* allocations that failed */
+	struct iochunk chunk[IOPOOL_SIZE];
+};
+
+void iopool_init(struct iopool *pool);
+void iopool_sweep(struct iopool *pool, int slot);
+
+void buf_attach(int slot);
+void bufinit(struct buf *buf);
+char *bufget(struct buf *buf);
+void bufidle(struct buf *buf);
+void bufdrop(struct buf *buf);
+int bufroom(struct buf *buf);
+void bufputframe(struct buf *buf, unsigned char *frame, int len);
+
+unsigned char *framebuf_get(void);
+void framebuf_put(unsigned char *frame);
+
+#endif
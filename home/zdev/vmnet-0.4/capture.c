@@ -0,0 +1,187 @@
+/*
+ * VMnet -- packet capture
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * A SIGUSR1 starts recording the frames vmnet passes, on both sides:
+ * as they come in from the guest and go out to the host, and the other
+ * way round, each with the time it was seen there.  The records go into
+ * a ring of CAPTURE_RING bytes, as pcapng enhanced packet blocks, so
+ * that the oldest make way when it is full.  The next SIGUSR1 stops
+ * it and writes the ring out to CAPTURE_FILE, a pcapng file for
+ * wireshark or tcpdump -r.  While nothing is being captured the cost
+ * is a test of "capturing" per frame.
+ *
+ * Frames are raw IP (LINKTYPE_RAW) on both sides, SLIP on the one and
+ * the sl%d interface or the user mode sockets on the other.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "capture.h"
+#include "config.h"
+#include "log.h"
+#include "slip.h"
+
+#define LINKTYPE_RAW	101
+#define EPB_INBOUND	1		/* epb_flags direction */
+#define EPB_OUTBOUND	2
+
+int capturing = 0;
+
+static unsigned char *ring;	/* CAPTURE_RING bytes while capturing */
+static uint32_t head;		/* oldest record */
+static uint32_t used;		/* bytes of records from head on */
+static unsigned long captured, lost;
+
+static void ring_put(const void *p, uint32_t n)
+{
+	uint32_t at = (head + used) % CAPTURE_RING;
+	uint32_t part = CAPTURE_RING - at < n ? CAPTURE_RING - at : n;
+
+	memcpy(ring + at, p, part);
+	memcpy(ring, (const unsigned char *)p + part, n - part);
+	used += n;
+}
+
+/* The block_total_length of the record at head */
+static uint32_t ring_len(void)
+{
+	unsigned char b[4];
+	uint32_t i, len;
+
+	for (i = 0; i < 4; i++) {
+		b[i] = ring[(head + 4 + i) % CAPTURE_RING];
+	}
+	memcpy(&len, b, 4);
+	return len;
+}
+
+void capture_frame(int side, int out, const unsigned char *frame, int len)
+{
+	/* header 28, data, epb_flags 8, end of options 4, length 4 */
+	uint32_t blk[(28 + SLIP_MAXFRAME + 16) / 4];
+	struct timespec ts;
+	uint64_t us;
+	uint32_t n, pad, drop;
+
+	if (len < 0 || len > SLIP_MAXFRAME) {
+		return;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	pad = (4 - len % 4) % 4;
+	n = 28 + len + pad + 16;
+	blk[0] = 6;			/* enhanced packet block */
+	blk[1] = n;
+	blk[2] = side;
+	blk[3] = us >> 32;
+	blk[4] = us;
+	blk[5] = len;
+	blk[6] = len;
+	memcpy(&blk[7], frame, len);
+	memset((unsigned char *)&blk[7] + len, 0, pad);
+	blk[(28 + len + pad) / 4] = 2 | 4 << 16;	/* epb_flags */
+	blk[(28 + len + pad) / 4 + 1] = out ? EPB_OUTBOUND : EPB_INBOUND;
+	blk[(28 + len + pad) / 4 + 2] = 0;		/* opt_endofopt */
+	blk[n / 4 - 1] = n;
+
+	while (used + n > CAPTURE_RING) {
+		drop = ring_len();
+		head = (head + drop) % CAPTURE_RING;
+		used -= drop;
+		lost++;
+	}
+	ring_put(blk, n);
+	captured++;
+}
+
+/* Add an interface description block for one side to blk */
+static uint32_t idb(uint32_t *blk, const char *name)
+{
+	uint32_t len = strlen(name), pad = (4 - len % 4) % 4;
+	uint32_t n = 16 + 4 + len + pad + 4 + 4;
+
+	blk[0] = 1;			/* interface description block */
+	blk[1] = n;
+	blk[2] = LINKTYPE_RAW;		/* and 16 reserved bits */
+	blk[3] = SLIP_MAXFRAME;		/* snaplen */
+	blk[4] = 2 | len << 16;		/* if_name */
+	memset(&blk[5], 0, len + pad);
+	memcpy(&blk[5], name, len);
+	blk[(20 + len + pad) / 4] = 0;	/* opt_endofopt */
+	blk[n / 4 - 1] = n;
+	return n;
+}
+
+/* Write the ring out as a pcapng file, oldest records first */
+static int capture_write(slipconn *sc, const char *file)
+{
+	uint32_t hdr[64], n, part;
+	char host[16];
+	int fd, ok;
+
+	if ((fd = dumpopen(file)) < 0) {
+		return -1;
+	}
+	hdr[0] = 0x0a0d0d0a;		/* section header block */
+	hdr[1] = 28;
+	hdr[2] = 0x1a2b3c4d;		/* byte order magic */
+	hdr[3] = 1;			/* version 1.0 */
+	hdr[4] = hdr[5] = 0xffffffff;	/* section length unknown */
+	hdr[6] = 28;
+	n = 28;
+	n += idb(hdr + n / 4, "guest");
+	if (sc->unit >= 0) {
+		snprintf(host, sizeof(host), "sl%d", sc->unit);
+	} else {
+		strcpy(host, "host");
+	}
+	n += idb(hdr + n / 4, host);
+
+	part = CAPTURE_RING - head < used ? CAPTURE_RING - head : used;
+	ok = write(fd, hdr, n) == (ssize_t)n
+		&& write(fd, ring + head, part) == (ssize_t)part
+		&& write(fd, ring, used - part) == (ssize_t)(used - part);
+	if (close(fd) < 0 || !ok) {
+		return -1;
+	}
+	return 0;
+}
+
+/* SIGUSR1: start capturing, or stop and write out what was captured */
+void capture_toggle(slipconn *sc)
+{
+	char file[64];
+
+	if (!capturing) {
+		ring = mmap(NULL, CAPTURE_RING, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (ring == MAP_FAILED) {
+			logmsg(LM_NOCAPTURE, "memory", 0, 0, errno);
+			return;
+		}
+		head = used = 0;
+		captured = lost = 0;
+		capturing = 1;
+		return;
+	}
+	capturing = 0;
+	dumppath(file, sizeof(file), CAPTURE_FILE, (int)getpid());
+	if (capture_write(sc, file) < 0) {
+		logmsg(LM_NOCAPTURE, file, 0, 0, errno);
+	} else {
+		logmsg(LM_CAPTURE, file, captured - lost, lost, 0);
+	}
+	munmap(ring, CAPTURE_RING);
+	ring = NULL;
+}
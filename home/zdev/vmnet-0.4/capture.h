@@ -0,0 +1,29 @@
+/*
+ * VMnet -- packet capture
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "vmnet.h"
+
+/* the two sides of vmnet, pcapng interfaces 0 and 1 */
+#define CAP_GUEST	0	/* the pipe to the emulator */
+#define CAP_HOST	1	/* the pty, or the sockets in user mode */
+
+extern int capturing;
+
+/* Record a frame seen on a side, coming in or going out */
+#define CAPTURE(side, out, frame, len) \
+	do { if (__builtin_expect(capturing, 0)) \
+		capture_frame(side, out, frame, len); } while (0)
+
+void capture_frame(int side, int out, const unsigned char *frame, int len);
+void capture_toggle(slipconn *sc);
+
+#endif
@@ -1,2 +1,106 @@
 #define CONFIG_FILE "/etc/vmnet.conf"
 #define IFCONFIG "/sbin/ifconfig"
+
+/* what a SIGUSR2 upgrades to, see upgrade.c */
+#define VMNET_BINARY "/usr/local/bin/vmnet"
+
+/* segment shared by all vmnet processes, see shm.c */
+#define VMNET_SHM "/vmnet"
+#define VMNET_RUNDIR "/var/run/vmnet"
+
+/* per-process counters, VMNET_STATS.<pid>, see stats.c */
+#define VMNET_STATS "/vmnet-stats"
+#define SHM_DIR "/dev/shm"
+
+/*
+ * Clock for the latency histograms: CLOCK_MONOTONIC_COARSE, which only
+ * ticks every jiffy, or with LAT_TSC the x86 time stamp counter (it
+ * must be constant and invariant, "constant_tsc nonstop_tsc" in
+ * /proc/cpuinfo).  Frames waiting for their write, per direction.
+ */
+/* #define LAT_TSC */
+#define LAT_PENDING 256
+
+/* SIGUSR1 capture: ring size, and the file it is written to (dir, pid) */
+#define CAPTURE_RING (4*1024*1024)
+#define CAPTURE_FILE "%s/vmnet-%d.pcapng"
+
+/*
+ * Where dumps go (see dumppath()): VMNET_RUNDIR, which only root can
+ * get at, or DUMP_USERDIR for a user mode vmnet, which runs as its user
+ */
+#define DUMP_USERDIR "/var/tmp"
+
+/* flight recorder: events kept (power of two), where they go (dir, pid) */
+#define FLIGHT_EVENTS 2048
+#define FLIGHT_FILE "%s/vmnet-%d.flight"
+
+/* log records waiting for the log thread (power of two), see log.c */
+#define LOG_RING 64
+#define JOURNAL_SOCKET "/run/systemd/journal/socket"
+
+/*
+ * flow accounting: flows kept (power of two), probes, seconds between
+ * exports, and where they go if flows= does not say (dir, uid)
+ */
+#define FLOW_SIZE 1024
+#define FLOW_PROBE 16
+#define FLOW_EXPORT 60
+#define FLOW_FILE "%s/vmnet-%d.ipfix"
+
+/* a pass of the relay loop that takes this long (ms) is a stall */
+#define STALL_MS 100
+
+#define MAXSESS 256
+
+/* forwarding table: size (power of two), max probes, age in seconds */
+#define FWD_SIZE 4096
+#define FWD_PROBE 32
+#define FWD_AGE 300
+
+/*
+ * shared packet buffers, and multicast groups tracked for switching,
+ * and seconds after the last report a group may make way for another
+ */
+#define POOL_SIZE 1024
+#define MCAST_GROUPS 256
+#define MCAST_AGE 260
+
+/* shared 16k relay buffers, and interned strings (bytes, hash slots) */
+#define IOPOOL_SIZE 256
+#define STRTAB_SIZE 16384
+#define STRTAB_HASH 512
+
+/* fair queueing of frames for the guest: frames, per source, quantum */
+#define DRR_FRAMES 128
+#define DRR_CLASSLEN 32
+#define DRR_QUANTUM 1500
+#define DRR_MAXWEIGHT 100
+
+/* seconds an empty queue is kept for the next frames, see queueidle() */
+#define QUEUE_IDLE 10
+
+/* bytes let into an output buffer ahead of the queues, see prio.c */
+#define OUT_QUEUE 8192
+
+/* user mode NAT, "vmnet -u": flows, TCP buffer each way, see nat.c */
+#define NAT_FLOWS 256
+#define NAT_TCPBUF 262144
+
+/* forwarded ports, "vmnet -u -p": how many, and where the guest sees */
+/* connections from the host itself (127.0.0.0/8) come from */
+#define NAT_FORWARDS 16
+#define NAT_LOOPBACK "10.0.2.2"
+
+/* connection tracking: idle timeouts (s), see ct.c for the rest */
+#define CT_UDP_AGE 60
+#define CT_ICMP_AGE 10
+#define CT_TCP_AGE 7200
+
+/* DNS cache shared by all guests, "dns": entries (power of two), */
+/* largest answer cached, TTL caps (s) for answers and for no-such-name */
+#define RESOLV_CONF "/etc/resolv.conf"
+#define DNS_CACHE 1024
+#define DNS_MAXMSG 512
+#define DNS_MAXTTL 3600
+#define DNS_NEGTTL 60
@@ -0,0 +1,415 @@
+/*
+ * VMnet -- connection tracking
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * A table of connections, keyed by protocol, addresses and ports as
+ * the originator sent them, with a rough idea of each TCP connection's
+ * state and packet and byte counts per direction.  It is sized once,
+ * at ct_init(), and never grows: memory stays bounded however many
+ * flows come and go, at 64 bytes per entry plus 16 for the index.
+ *
+ *  - The index is open addressing with linear probing at a load of at
+ *    most one half, holding the hash next to the entry number so a
+ *    probe only touches the entry itself on a likely match.  Deleting
+ *    shifts the following slots back rather than leaving tombstones,
+ *    so lookups stay short however long the table is in use.
+ *
+ *  - Expiry is a hierarchical timer wheel of one second ticks: four
+ *    levels of 64 slots, each level's slot as long as the whole level
+ *    below, which covers 194 days.  An entry sits in the slot of the
+ *    tick it is due at; when a lower level wraps around, the next slot
+ *    of the level above is spread over the levels below.  Nothing is
+ *    ever scanned, and each entry is moved at most once per level.
+ *
+ *  - Traffic does not move an entry in the wheel: it only pushes the
+ *    expire time back.  When the entry's slot comes up and the time
+ *    has moved, it is filed again further on.  Only a shorter timeout,
+ *    e.g. when a TCP connection closes, takes it out and back in.
+ *
+ * Time is in the seconds passed to ct_expire(), and timeouts count
+ * from its last call, so callers expire first and then do lookups.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/tcp.h>
+
+#include "ct.h"
+
+#define CT_NOSLOT	0xffff	/* ctentry.wslot when not in the wheel */
+#define CT_EVICT_SCAN	64	/* entries ct_evict() looks at, at most */
+
+/* seconds an entry lasts after the last packet, per TCP state */
+static const uint32_t tcp_age[] = {
+	120,		/* picked up, nothing known yet */
+	120,		/* CT_SYN_SENT */
+	60,		/* CT_SYN_RECV */
+	CT_TCP_AGE,	/* CT_ESTABLISHED */
+	120,		/* CT_FIN_WAIT */
+	120,		/* CT_TIME_WAIT */
+	10,		/* CT_CLOSE */
+};
+
+static uint32_t ct_hash(const struct cttable *ct, const struct ctkey *k)
+{
+	uint32_t h;
+
+	h = ct->seed ^ k->saddr;
+	h = (h ^ h >> 16) * 0x85ebca6b ^ k->daddr;
+	h = (h ^ h >> 13) * 0xc2b2ae35 ^ ((uint32_t)k->sport << 16 | k->dport);
+	h = (h ^ h >> 16) * 0x85ebca6b ^ k->proto;
+	h = (h ^ h >> 13) * 0xc2b2ae35;
+	return h ^ h >> 16;
+}
+
+static uint32_t ct_age(const struct ctentry *e)
+{
+	switch (e->key.proto) {
+	case IPPROTO_TCP:
+		return tcp_age[e->state];
+	case IPPROTO_ICMP:
+		return CT_ICMP_AGE;
+	default:
+		return CT_UDP_AGE;
+	}
+}
+
+int ct_init(struct cttable *ct, uint32_t size, uint32_t now,
+	void (*expire)(struct cttable *, struct ctentry *))
+{
+	uint32_t i, n;
+
+	for (n = 2; n < 2 * size; n <<= 1)
+		;
+	ct->ent = malloc(size * sizeof(struct ctentry));
+	ct->index = malloc(n * sizeof(struct ctslot));
+	if (ct->ent == NULL || ct->index == NULL) {
+		free(ct->ent);
+		free(ct->index);
+		return -1;
+	}
+	ct->size = size;
+	ct->mask = n - 1;
+	ct->count = 0;
+	for (i = 0; i < n; i++) {
+		ct->index[i].ent = CT_NIL;
+	}
+	for (i = 0; i < size; i++) {
+		ct->ent[i].next = i + 1 < size ? i + 1 : CT_NIL;
+		ct->ent[i].wslot = CT_NOSLOT;
+	}
+	ct->free = size ? 0 : CT_NIL;
+	ct->seed = random();
+	ct->tick = now;
+	for (i = 0; i < CT_LEVELS * CT_SLOTS; i++) {
+		ct->wheel[i / CT_SLOTS][i % CT_SLOTS] = CT_NIL;
+	}
+	ct->expire = expire;
+	return 0;
+}
+
+void ct_free(struct cttable *ct)
+{
+	free(ct->ent);
+	free(ct->index);
+	ct->ent = NULL;
+	ct->index = NULL;
+	ct->size = ct->count = 0;
+}
+
+/* File e in the wheel at tick t */
+static void wheel_link(struct cttable *ct, struct ctentry *e, uint32_t t)
+{
+	uint32_t delta, i, *head;
+	int lvl, slot;
+
+	if ((int32_t)(t - ct->tick) < 0) {
+		t = ct->tick;
+	}
+	delta = t - ct->tick;
+	if (delta >= 1u << CT_BITS * CT_LEVELS) {
+		delta = (1u << CT_BITS * CT_LEVELS) - 1;
+		t = ct->tick + delta;
+	}
+	for (lvl = 0; lvl < CT_LEVELS - 1
+			&& delta >= 1u << CT_BITS * (lvl + 1); lvl++)
+		;
+	slot = (t >> CT_BITS * lvl) & (CT_SLOTS - 1);
+
+	i = e - ct->ent;
+	head = &ct->wheel[lvl][slot];
+	e->when = t;
+	e->wslot = lvl * CT_SLOTS + slot;
+	e->prev = CT_NIL;
+	e->next = *head;
+	if (*head != CT_NIL) {
+		ct->ent[*head].prev = i;
+	}
+	*head = i;
+}
+
+static void wheel_unlink(struct cttable *ct, struct ctentry *e)
+{
+	if (e->prev != CT_NIL) {
+		ct->ent[e->prev].next = e->next;
+	} else {
+		ct->wheel[e->wslot / CT_SLOTS][e->wslot % CT_SLOTS] = e->next;
+	}
+	if (e->next != CT_NIL) {
+		ct->ent[e->next].prev = e->prev;
+	}
+	e->wslot = CT_NOSLOT;
+}
+
+/* Take e out of the index, and put it on the free list */
+static void ct_release(struct cttable *ct, struct ctentry *e)
+{
+	uint32_t i, j, k, n;
+
+	n = e - ct->ent;
+	for (i = e->hash & ct->mask; ct->index[i].ent != n;
+			i = (i + 1) & ct->mask)
+		;
+	/* shift back whatever probed past the hole */
+	for (j = i;;) {
+		j = (j + 1) & ct->mask;
+		if (ct->index[j].ent == CT_NIL) {
+			break;
+		}
+		k = ct->index[j].hash & ct->mask;
+		if (((j - k) & ct->mask) >= ((j - i) & ct->mask)) {
+			ct->index[i] = ct->index[j];
+			i = j;
+		}
+	}
+	ct->index[i].ent = CT_NIL;
+
+	e->next = ct->free;
+	ct->free = n;
+	ct->count--;
+}
+
+struct ctentry *ct_lookup(struct cttable *ct, const struct ctkey *k)
+{
+	struct ctslot *s;
+	uint32_t h, i;
+
+	h = ct_hash(ct, k);
+	for (i = h & ct->mask; (s = &ct->index[i])->ent != CT_NIL;
+			i = (i + 1) & ct->mask) {
+		if (s->hash == h
+		 && !memcmp(&ct->ent[s->ent].key, k, sizeof(*k))) {
+			return &ct->ent[s->ent];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add a new entry for k, which must not be in the table yet.  If the
+ * table is full, an entry that is not an established TCP connection
+ * has to make room (see ct_evict()); NULL if there is none.
+ */
+struct ctentry *ct_insert(struct cttable *ct, const struct ctkey *k)
+{
+	struct ctentry *e;
+	uint32_t n, i;
+
+	if (ct->free == CT_NIL && !ct_evict(ct)) {
+		return NULL;
+	}
+	n = ct->free;
+	e = &ct->ent[n];
+	ct->free = e->next;
+	ct->count++;
+
+	e->key = *k;
+	memset(e->key.pad, 0, sizeof(e->key.pad));
+	e->hash = ct_hash(ct, &e->key);
+	e->state = 0;
+	e->seen = 0;
+	e->packets[0] = e->packets[1] = 0;
+	e->bytes[0] = e->bytes[1] = 0;
+	for (i = e->hash & ct->mask; ct->index[i].ent != CT_NIL;
+			i = (i + 1) & ct->mask)
+		;
+	ct->index[i].hash = e->hash;
+	ct->index[i].ent = n;
+
+	e->expire = ct->tick + ct_age(e);
+	wheel_link(ct, e, e->expire);
+	return e;
+}
+
+/* Forget e, without calling the expire function */
+void ct_delete(struct cttable *ct, struct ctentry *e)
+{
+	if (e->wslot != CT_NOSLOT) {
+		wheel_unlink(ct, e);
+	}
+	ct_release(ct, e);
+}
+
+/* Let e live for another timeout seconds from now on */
+void ct_refresh(struct cttable *ct, struct ctentry *e, uint32_t timeout)
+{
+	e->expire = ct->tick + (timeout ? timeout : 1);
+	if (e->wslot != CT_NOSLOT && (int32_t)(e->expire - e->when) < 0) {
+		wheel_unlink(ct, e);
+		wheel_link(ct, e, e->expire);
+	}
+}
+
+static void tcp_track(struct ctentry *e, int dir, int flags)
+{
+	if (flags & TH_RST) {
+		e->state = CT_CLOSE;
+		return;
+	}
+	switch (e->state) {
+	case 0:
+		/* picked up in the middle, or the start */
+		e->state = dir == CT_ORIG && (flags & TH_SYN)
+			? CT_SYN_SENT : CT_ESTABLISHED;
+		break;
+	case CT_SYN_SENT:
+		if (dir == CT_REPL
+		 && (flags & (TH_SYN|TH_ACK)) == (TH_SYN|TH_ACK)) {
+			e->state = CT_SYN_RECV;
+		}
+		break;
+	case CT_SYN_RECV:
+		if (dir == CT_ORIG && (flags & (TH_SYN|TH_ACK)) == TH_ACK) {
+			e->state = CT_ESTABLISHED;
+		}
+		break;
+	case CT_CLOSE:
+		/* the same ports used again */
+		if (dir == CT_ORIG && (flags & (TH_SYN|TH_ACK)) == TH_SYN) {
+			e->state = CT_SYN_SENT;
+			e->seen &= ~(CT_FIN0|CT_FIN1);
+		}
+		return;
+	}
+	if (flags & TH_FIN) {
+		e->seen |= dir == CT_ORIG ? CT_FIN0 : CT_FIN1;
+	}
+	if ((e->seen & (CT_FIN0|CT_FIN1)) == (CT_FIN0|CT_FIN1)) {
+		e->state = CT_TIME_WAIT;
+	} else if (e->seen & (CT_FIN0|CT_FIN1)) {
+		e->state = CT_FIN_WAIT;
+	}
+}
+
+/*
+ * A packet of len bytes for e went in direction dir (CT_ORIG or
+ * CT_REPL), with TCP flags tcpflags if it is TCP: count it, follow
+ * the TCP state, and push the expire time back.
+ */
+void ct_seen(struct cttable *ct, struct ctentry *e, int dir,
+	int tcpflags, int len)
+{
+	e->packets[dir]++;
+	e->bytes[dir] += len;
+	if (dir == CT_REPL) {
+		e->seen |= CT_REPLY;
+	}
+	if (e->key.proto == IPPROTO_TCP) {
+		tcp_track(e, dir, tcpflags);
+	}
+	ct_refresh(ct, e, ct_age(e));
+}
+
+/* Pass the expire function e, and forget it */
+static void ct_drop(struct cttable *ct, struct ctentry *e)
+{
+	wheel_unlink(ct, e);
+	if (ct->expire != NULL) {
+		ct->expire(ct, e);
+	}
+	ct_release(ct, e);
+}
+
+/* Spread a slot of the level above over the levels below */
+static void ct_cascade(struct cttable *ct, int lvl, int slot)
+{
+	struct ctentry *e;
+	uint32_t i, next;
+
+	i = ct->wheel[lvl][slot];
+	ct->wheel[lvl][slot] = CT_NIL;
+	for (; i != CT_NIL; i = next) {
+		e = &ct->ent[i];
+		next = e->next;
+		wheel_link(ct, e, e->expire);
+	}
+}
+
+/* Advance to now, dropping whatever expires; returns how many did */
+int ct_expire(struct cttable *ct, uint32_t now)
+{
+	struct ctentry *e;
+	uint32_t i, *head;
+	int lvl, slot, n = 0;
+
+	while ((int32_t)(now - ct->tick) > 0) {
+		ct->tick++;
+		for (lvl = 1; lvl < CT_LEVELS; lvl++) {
+			if ((ct->tick >> CT_BITS * (lvl - 1))
+					& (CT_SLOTS - 1)) {
+				break;
+			}
+			slot = (ct->tick >> CT_BITS * lvl) & (CT_SLOTS - 1);
+			ct_cascade(ct, lvl, slot);
+		}
+		head = &ct->wheel[0][ct->tick & (CT_SLOTS - 1)];
+		while ((i = *head) != CT_NIL) {
+			e = &ct->ent[i];
+			if ((int32_t)(e->expire - ct->tick) > 0) {
+				/* there was traffic since it was filed */
+				wheel_unlink(ct, e);
+				wheel_link(ct, e, e->expire);
+				continue;
+			}
+			ct_drop(ct, e);
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+ * Make room: drop the entry due soonest that is not an established
+ * TCP connection, looking at no more than CT_EVICT_SCAN of them.
+ * Returns 1 if one went.
+ */
+int ct_evict(struct cttable *ct)
+{
+	struct ctentry *e;
+	uint32_t i;
+	int lvl, s, n = 0;
+
+	for (lvl = 0; lvl < CT_LEVELS; lvl++) {
+		for (s = 1; s <= CT_SLOTS; s++) {
+			i = ct->wheel[lvl][((ct->tick >> CT_BITS * lvl) + s)
+				& (CT_SLOTS - 1)];
+			for (; i != CT_NIL; i = e->next) {
+				e = &ct->ent[i];
+				if (e->key.proto != IPPROTO_TCP
+				 || e->state < CT_ESTABLISHED
+				 || e->state > CT_FIN_WAIT) {
+					ct_drop(ct, e);
+					return 1;
+				}
+				if (++n == CT_EVICT_SCAN) {
+					return 0;
+				}
+			}
+		}
+	}
+	return 0;
+}
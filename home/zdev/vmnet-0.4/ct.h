@@ -0,0 +1,94 @@
+/*
+ * VMnet -- connection tracking
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef CT_H
+#define CT_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "config.h"
+
+#define CT_NIL		0xffffffffu
+#define CT_BITS		6		/* timer wheel: 64 slots per level, */
+#define CT_SLOTS	(1 << CT_BITS)
+#define CT_LEVELS	4		/* of 1 s, 64 s, 68 min and 3 days */
+
+/* ctentry.state, TCP only */
+#define CT_SYN_SENT	1	/* the originator sent a SYN */
+#define CT_SYN_RECV	2	/* and the other side answered */
+#define CT_ESTABLISHED	3
+#define CT_FIN_WAIT	4	/* one side sent a FIN */
+#define CT_TIME_WAIT	5	/* both did */
+#define CT_CLOSE	6	/* reset */
+
+/* ctentry.seen */
+#define CT_FIN0		0x01	/* FIN from the originator */
+#define CT_FIN1		0x02	/* FIN from the other side */
+#define CT_REPLY	0x04	/* the other side sent anything at all */
+
+/* directions, for ct_seen() */
+#define CT_ORIG		0
+#define CT_REPL		1
+
+struct ctkey {
+	in_addr_t saddr;	/* the originator */
+	in_addr_t daddr;
+	uint16_t sport;		/* ports, or the ICMP echo id in sport */
+	uint16_t dport;
+	uint8_t proto;
+	uint8_t pad[3];		/* zero: keys are compared as a whole */
+};
+
+struct ctentry {
+	struct ctkey key;
+	uint32_t hash;
+	uint32_t expire;	/* ct tick it is due at */
+	uint32_t when;		/* tick it is filed at in the wheel */
+	uint32_t next;		/* wheel slot list, or the free list */
+	uint32_t prev;
+	uint8_t state;
+	uint8_t seen;
+	uint16_t wslot;		/* level * CT_SLOTS + slot, in the wheel */
+	uint32_t packets[2];	/* per direction */
+	uint64_t bytes[2];
+};
+
+struct ctslot {
+	uint32_t hash;
+	uint32_t ent;		/* CT_NIL if empty */
+};
+
+struct cttable {
+	struct ctentry *ent;
+	struct ctslot *index;	/* open addressing, linear probing */
+	uint32_t size;		/* entries */
+	uint32_t mask;		/* index slots - 1 */
+	uint32_t count;		/* entries in use */
+	uint32_t free;
+	uint32_t seed;
+	uint32_t tick;		/* seconds, as of the last ct_expire() */
+	uint32_t wheel[CT_LEVELS][CT_SLOTS];
+	/* called for an entry that expires or is evicted, before it goes */
+	void (*expire)(struct cttable *ct, struct ctentry *e);
+};
+
+int ct_init(struct cttable *ct, uint32_t size, uint32_t now,
+	void (*expire)(struct cttable *, struct ctentry *));
+void ct_free(struct cttable *ct);
+struct ctentry *ct_lookup(struct cttable *ct, const struct ctkey *k);
+struct ctentry *ct_insert(struct cttable *ct, const struct ctkey *k);
+void ct_delete(struct cttable *ct, struct ctentry *e);
+void ct_seen(struct cttable *ct, struct ctentry *e, int dir,
+	int tcpflags, int len);
+void ct_refresh(struct cttable *ct, struct ctentry *e, uint32_t timeout);
+int ct_expire(struct cttable *ct, uint32_t now);
+int ct_evict(struct cttable *ct);
+
+#endif
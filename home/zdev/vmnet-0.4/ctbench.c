@@ -0,0 +1,128 @@
+/*
+ * VMnet -- connection tracking benchmark, "make bench"
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Fills a table of N entries (default 1M, "ctbench N" for another
+ * size) with random UDP and TCP flows, then times lookups that hit and
+ * that miss, packets going through ct_seen(), inserts into a full
+ * table, and the expiry of everything.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <netinet/tcp.h>
+
+#include "ct.h"
+
+static struct ctkey *keys;
+static unsigned long expired;
+
+static double seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, unsigned long n, double t)
+{
+	printf("%-24s %9lu in %6.3f s  %6.2f M/s  %6.1f ns each\n",
+		what, n, t, n / t / 1e6, t * 1e9 / n);
+}
+
+static void randkey(struct ctkey *k)
+{
+	k->saddr = random();
+	k->daddr = random();
+	k->sport = random();
+	k->dport = random();
+	k->proto = random() & 1 ? IPPROTO_TCP : IPPROTO_UDP;
+	k->pad[0] = k->pad[1] = k->pad[2] = 0;
+}
+
+static void count(struct cttable *ct, struct ctentry *e)
+{
+	expired++;
+}
+
+int main(int argc, char **argv)
+{
+	struct cttable ct;
+	struct ctentry *e;
+	struct ctkey k;
+	unsigned long i, n, found;
+	uint32_t now = 1000;
+	double t;
+
+	n = argc > 1 ? strtoul(argv[1], NULL, 0) : 1 << 20;
+	srandom(1);
+	if ((keys = malloc(n * sizeof(*keys))) == NULL
+	 || ct_init(&ct, n, now, count) < 0) {
+		perror("ctbench: malloc");
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		randkey(&keys[i]);
+	}
+	printf("%lu entries, %lu bytes of table\n", n,
+		(unsigned long)(n * sizeof(struct ctentry)
+			+ (ct.mask + 1) * sizeof(struct ctslot)));
+
+	t = seconds();
+	for (i = 0; i < n; i++) {
+		ct_insert(&ct, &keys[i]);
+	}
+	report("insert", n, seconds() - t);
+
+	found = 0;
+	t = seconds();
+	for (i = 0; i < n; i++) {
+		found += ct_lookup(&ct, &keys[(i * 7919) % n]) != NULL;
+	}
+	report("lookup, hit", n, seconds() - t);
+	if (found != n) {
+		fprintf(stderr, "ctbench: %lu of %lu found\n", found, n);
+		exit(1);
+	}
+
+	t = seconds();
+	for (i = 0; i < n; i++) {
+		randkey(&k);
+		found += ct_lookup(&ct, &k) != NULL;
+	}
+	report("lookup, miss", n, seconds() - t);
+
+	/* established TCP lives 2 hours, the rest a minute or two */
+	t = seconds();
+	for (i = 0; i < n; i++) {
+		e = ct_lookup(&ct, &keys[i]);
+		ct_seen(&ct, e, CT_ORIG, TH_ACK, 1500);
+	}
+	report("lookup + ct_seen", n, seconds() - t);
+
+	/* a full table: each insert evicts the soonest non-TCP entry */
+	t = seconds();
+	for (i = 0; i < n / 4; i++) {
+		randkey(&k);
+		k.proto = IPPROTO_UDP;
+		ct_insert(&ct, &k);
+	}
+	report("insert, evicting", n / 4, seconds() - t);
+
+	expired = 0;
+	t = seconds();
+	ct_expire(&ct, now + 2 * CT_TCP_AGE);
+	report("expire", expired, seconds() - t);
+	if (ct.count != 0) {
+		fprintf(stderr, "ctbench: %u entries left\n", ct.count);
+		exit(1);
+	}
+	ct_free(&ct);
+	return 0;
+}
@@ -0,0 +1,486 @@
+/*
+ * VMnet -- caching DNS forwarder
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * With the "dns" option, vmnet answers the DNS queries its guest sends
+ * to the host end of the link (the local address of its entry) itself:
+ * from a cache in the shared segment if it can, else by passing them
+ * on to the first nameserver in /etc/resolv.conf and caching what
+ * comes back, for as long as its TTLs allow.  All guests share the
+ * cache, so what one looked up is there for the next one.
+ *
+ * Only standard queries with one question over UDP are handled; any
+ * other DNS traffic to the host goes through to it as before.
+ *
+ * What comes back ends up in every guest's cache, so forged answers
+ * must be hard to get in: each query goes out on a socket of its own,
+ * from a port the kernel picks at random, with an id from getrandom(),
+ * and an answer only counts if it comes to that socket, from the
+ * server, with that id and the very same question.
+ *
+ * The cache is a set associative table of DNS_CACHE entries, each
+ * holding one answer of at most DNS_MAXMSG bytes, keyed by a hash of
+ * the question in lower case.  It is shared without locks: each entry
+ * has a sequence number that is odd while it is being written, and a
+ * reader copies the answer out and checks the number did not change
+ * meanwhile.  Writers claim an entry with a compare-and-swap, and just
+ * skip caching if someone else has it.
+ *
+ * Answers go to the guest through the same list as the user mode NAT's
+ * frames, see nat_send().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+
+#include "buf.h"
+#include "dns.h"
+#include "nat.h"
+#include "shm.h"
+#include "slip.h"
+
+#define DNS_WAYS	4	/* entries a question may be cached in */
+#define DNS_PENDING	64	/* queries waiting for an answer */
+#define DNS_MAXQ	260	/* longest question: name, type, class */
+#define DNS_TYPE_OPT	41	/* EDNS pseudo record, has no TTL */
+#define DNS_GUESTMAX	(1500 - 28)	/* what fits the guest's mtu */
+
+static struct {
+	int fd;			/* its own socket, -1 if the slot is free */
+	uint16_t id;		/* ours, towards the server */
+	uint16_t gid;		/* the guest's */
+	in_addr_t gaddr;
+	in_addr_t local;	/* where the guest sent it */
+	uint16_t gport;
+	uint16_t qlen;
+	unsigned char q[DNS_MAXQ];	/* the question, lower case */
+} pending[DNS_PENDING];
+static int pnext;
+static int npending;
+static struct sockaddr_in server;	/* port 0 if no dns */
+
+/* The first IPv4 nameserver in resolv.conf, 0 if none */
+static in_addr_t dns_server(void)
+{
+	char line[256], addr[64];
+	in_addr_t a = 0;
+	FILE *fp;
+
+	if ((fp = fopen(RESOLV_CONF, "r")) == NULL) {
+		return 0;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "nameserver %63s", addr) == 1
+		 && inet_pton(AF_INET, addr, &a) == 1) {
+			break;
+		}
+		a = 0;
+	}
+	fclose(fp);
+	return a;
+}
+
+int dns_open(slipconn *sc)
+{
+	unsigned int seed;
+	int i;
+
+	for (i = 0; i < DNS_PENDING; i++) {
+		pending[i].fd = -1;
+	}
+	npending = 0;
+	if (!(sc->flags & CFG_DNS)) {
+		return 0;
+	}
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	if ((server.sin_addr.s_addr = dns_server()) == 0) {
+		fprintf(stderr, "vmnet: no nameserver in %s, no dns\n",
+			RESOLV_CONF);
+		sc->flags &= ~CFG_DNS;
+		return -1;
+	}
+	server.sin_port = htons(53);
+	/* only if getrandom() fails, see dns_id() */
+	seed = getpid() ^ nowms;
+	srandom(seed);
+	return 0;
+}
+
+/* Forget the query in slot i */
+static void dns_done(int i)
+{
+	if (pending[i].fd >= 0) {
+		close(pending[i].fd);
+		pending[i].fd = -1;
+		npending--;
+	}
+}
+
+void dns_close(void)
+{
+	int i;
+
+	for (i = 0; i < DNS_PENDING; i++) {
+		dns_done(i);
+	}
+	server.sin_port = 0;
+}
+
+/* A query id nobody can guess */
+static uint16_t dns_id(void)
+{
+	uint16_t id;
+
+	if (getrandom(&id, sizeof(id), GRND_NONBLOCK) != sizeof(id)) {
+		id = random();
+	}
+	return id;
+}
+
+/* Length of the name at m + pos, -1 if it runs off the end */
+static int dns_skipname(const unsigned char *m, int len, int pos)
+{
+	int start = pos;
+
+	while (pos < len) {
+		if (m[pos] == 0) {
+			return pos + 1 - start;
+		}
+		if ((m[pos] & 0xc0) == 0xc0) {
+			return pos + 2 <= len ? pos + 2 - start : -1;
+		}
+		if (m[pos] & 0xc0) {
+			return -1;
+		}
+		pos += m[pos] + 1;
+	}
+	return -1;
+}
+
+/*
+ * Copy the question of message m into q in lower case, and hash it.
+ * Returns its length, -1 if there is no sensible question.
+ */
+static int dns_question(const unsigned char *m, int len, unsigned char *q,
+	uint32_t *hash)
+{
+	uint32_t h = 2166136261u;
+	int i, n;
+
+	if ((n = dns_skipname(m, len, 12)) < 0 || n + 4 > DNS_MAXQ
+	 || 12 + n + 4 > len) {
+		return -1;
+	}
+	for (i = 0; i < n + 4; i++) {
+		q[i] = m[12 + i];
+		if (i < n && q[i] >= 'A' && q[i] <= 'Z') {
+			q[i] += 'a' - 'A';	/* label lengths are < 64 */
+		}
+		h = (h ^ q[i]) * 16777619;
+	}
+	*hash = h ? h : 1;
+	return n + 4;
+}
+
+/*
+ * Go through the records after the question and return the lowest
+ * TTL, -1 if the message does not parse.  With age > 0, take that many
+ * seconds off each TTL on the way.
+ */
+static int dns_ttl(unsigned char *m, int len, int qlen, uint32_t age)
+{
+	uint32_t ttl, min = DNS_MAXTTL;
+	int pos, n, rr;
+
+	rr = (m[6] << 8 | m[7]) + (m[8] << 8 | m[9]) + (m[10] << 8 | m[11]);
+	for (pos = 12 + qlen; rr > 0; rr--) {
+		if ((n = dns_skipname(m, len, pos)) < 0 || pos + n + 10 > len) {
+			return -1;
+		}
+		pos += n;
+		if ((m[pos] << 8 | m[pos + 1]) != DNS_TYPE_OPT) {
+			ttl = (uint32_t)m[pos + 4] << 24 | m[pos + 5] << 16
+				| m[pos + 6] << 8 | m[pos + 7];
+			if (ttl < min) {
+				min = ttl;
+			}
+			if (age > 0) {
+				ttl = ttl > age ? ttl - age : 0;
+				m[pos + 4] = ttl >> 24;
+				m[pos + 5] = ttl >> 16;
+				m[pos + 6] = ttl >> 8;
+				m[pos + 7] = ttl;
+			}
+		}
+		pos += 10 + (m[pos + 8] << 8 | m[pos + 9]);
+		if (pos > len) {
+			return -1;
+		}
+	}
+	return min;
+}
+
+/* The cached answer to question q into out; its length, 0 if none */
+static int cache_get(const unsigned char *q, int qlen, uint32_t hash,
+	unsigned char *out, uint32_t *age)
+{
+	struct dnsent *e;
+	uint32_t seq, stamp;
+	int i, n;
+
+	e = &shm->dns.ent[hash & (DNS_CACHE - DNS_WAYS)];
+	for (i = 0; i < DNS_WAYS; i++, e++) {
+		seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) || e->hash != hash || e->qlen != qlen
+		 || (int32_t)(e->expire - now) <= 0) {
+			continue;
+		}
+		n = e->len;
+		stamp = e->stamp;
+		if (n > DNS_MAXMSG) {
+			continue;
+		}
+		memcpy(out, e->msg, n);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq
+		 || memcmp(out + 12, q, qlen)) {
+			continue;
+		}
+		*age = now - stamp;
+		return n;
+	}
+	return 0;
+}
+
+/* Cache answer m to question q for ttl seconds */
+static void cache_put(const unsigned char *m, int len,
+	const unsigned char *q, int qlen, uint32_t hash, uint32_t ttl)
+{
+	struct dnsent *set, *e = NULL;
+	uint32_t seq;
+	int i;
+
+	/* the same question, or else the entry that goes stale first */
+	set = &shm->dns.ent[hash & (DNS_CACHE - DNS_WAYS)];
+	for (i = 0; i < DNS_WAYS; i++) {
+		if (set[i].hash == hash && set[i].qlen == qlen) {
+			e = &set[i];
+			break;
+		}
+		if (e == NULL || (int32_t)(set[i].expire - e->expire) < 0) {
+			e = &set[i];
+		}
+	}
+	seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+	if ((seq & 1) || !__atomic_compare_exchange_n(&e->seq, &seq, seq + 1,
+			0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		return;		/* another vmnet is writing it */
+	}
+	e->hash = hash;
+	e->qlen = qlen;
+	e->len = len;
+	e->stamp = now;
+	e->expire = now + ttl;
+	memcpy(e->msg, m, len);
+	memcpy(e->msg + 12, q, qlen);
+	__atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Send the guest the answer of len bytes at frame + 28, from port 53
+ * of src.  If it does not fit, it gets just the question back with
+ * the truncated bit set, so it asks again over TCP.
+ */
+static void dns_send(unsigned char *frame, in_addr_t src, in_addr_t dst,
+	uint16_t dport, int len, int qlen)
+{
+	unsigned char *u = frame + 20;
+	uint16_t v;
+
+	if (len > DNS_GUESTMAX) {
+		len = 12 + qlen;
+		u[8 + 2] |= 0x02;
+		memset(u + 8 + 6, 0, 6);
+	}
+	v = htons(53);
+	memcpy(u, &v, 2);
+	memcpy(u + 2, &dport, 2);
+	v = htons(len + 8);
+	memcpy(u + 4, &v, 2);
+	u[6] = u[7] = 0;
+	v = nat_cksum(nat_pseudo(src, dst, IPPROTO_UDP, len + 8), u, len + 8);
+	if (v == 0) {
+		v = 0xffff;
+	}
+	memcpy(u + 6, &v, 2);
+	nat_send(frame, IPPROTO_UDP, src, dst, len + 8);
+}
+
+/*
+ * A frame from the guest: if it is a query to the host end of the
+ * link, answer it from the cache or pass it on, and return 1.
+ */
+int dns_input(slipconn *sc, const unsigned char *ip, int len)
+{
+	unsigned char q[DNS_MAXQ], fwd[SLIP_MAXFRAME];
+	const unsigned char *m;
+	unsigned char *frame;
+	in_addr_t src, dst;
+	uint16_t sport, dport, id;
+	uint32_t hash, age;
+	int hl, n, qlen, i, fd;
+
+	if (len < 20 || ip[9] != IPPROTO_UDP || (ip[6] & 0x3f) || ip[7]) {
+		return 0;
+	}
+	hl = (ip[0] & 0x0f) * 4;
+	memcpy(&dst, ip + 16, 4);
+	if (dst != sc->local || len < hl + 8 + 12) {
+		return 0;
+	}
+	memcpy(&dport, ip + hl + 2, 2);
+	n = (ip[hl + 4] << 8 | ip[hl + 5]) - 8;
+	m = ip + hl + 8;
+	if (dport != htons(53) || n < 12 || hl + 8 + n > len
+	 || (m[2] & 0xf8) || m[4] || m[5] != 1
+	 || (qlen = dns_question(m, n, q, &hash)) < 0) {
+		return 0;	/* not a plain query, not for us */
+	}
+	memcpy(&src, ip + 12, 4);
+	memcpy(&sport, ip + hl, 2);
+
+	if (!nat_room()) {
+		return 1;	/* the guest will ask again */
+	}
+	frame = nat_frame();
+	if ((n = cache_get(q, qlen, hash, frame + 28, &age)) > 0) {
+		__atomic_add_fetch(&shm->dns.hits, 1, __ATOMIC_RELAXED);
+		memcpy(frame + 28, m, 2);		/* its id, */
+		memcpy(frame + 28 + 12, m + 12, qlen);	/* its spelling */
+		frame[28 + 2] = (frame[28 + 2] & ~0x01) | (m[2] & 0x01);
+		if (age > 0) {
+			dns_ttl(frame + 28, n, qlen, age);
+		}
+		dns_send(frame, dst, src, sport, n, qlen);
+		return 1;
+	}
+	framebuf_put(frame);
+	__atomic_add_fetch(&shm->dns.misses, 1, __ATOMIC_RELAXED);
+
+	/* the oldest pending query gives way */
+	n = (ip[hl + 4] << 8 | ip[hl + 5]) - 8;
+	i = pnext;
+	pnext = (pnext + 1) % DNS_PENDING;
+	dns_done(i);
+	fd = socket(AF_INET, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&server,
+			sizeof(server)) < 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return 1;	/* the guest will ask again */
+	}
+	id = dns_id();
+	pending[i].fd = fd;
+	pending[i].id = id;
+	pending[i].gid = m[0] << 8 | m[1];
+	pending[i].gaddr = src;
+	pending[i].gport = sport;
+	pending[i].local = dst;
+	pending[i].qlen = qlen;
+	memcpy(pending[i].q, q, qlen);
+	npending++;
+	memcpy(fwd, m, n);
+	fwd[0] = id >> 8;
+	fwd[1] = id;
+	send(fd, fwd, n, MSG_DONTWAIT);
+	return 1;
+}
+
+int dns_fdset(fd_set *rfds, int maxfd)
+{
+	int i;
+
+	if (npending == 0 || !nat_room()) {
+		return maxfd;
+	}
+	for (i = 0; i < DNS_PENDING; i++) {
+		if (pending[i].fd >= 0) {
+			FD_SET(pending[i].fd, rfds);
+			if (pending[i].fd > maxfd) {
+				maxfd = pending[i].fd;
+			}
+		}
+	}
+	return maxfd;
+}
+
+/* The answer to the query in slot i: its length, 0 if not it, -1 if none */
+static int dns_answer(int i, unsigned char *m, unsigned char *q,
+	uint32_t *hash)
+{
+	int n, qlen;
+
+	n = recv(pending[i].fd, m, SLIP_MAXFRAME - 28,
+		MSG_DONTWAIT|MSG_TRUNC);
+	if (n < 0) {
+		return -1;
+	}
+	if (n < 12 || !(m[2] & 0x80)
+	 || pending[i].id != (m[0] << 8 | m[1])
+	 || (qlen = dns_question(m,
+			n < SLIP_MAXFRAME - 28 ? n : SLIP_MAXFRAME - 28,
+			q, hash)) != pending[i].qlen
+	 || memcmp(q, pending[i].q, qlen)) {
+		return 0;	/* forged, or garbled */
+	}
+	return n;
+}
+
+/* Answers from the server: cache them, and pass them on */
+void dns_poll(fd_set *rfds)
+{
+	unsigned char q[DNS_MAXQ];
+	unsigned char *frame, *m;
+	uint32_t hash;
+	int i, n, qlen, ttl;
+
+	for (i = 0; i < DNS_PENDING && npending > 0 && nat_room(); i++) {
+		if (pending[i].fd < 0 || !FD_ISSET(pending[i].fd, rfds)) {
+			continue;
+		}
+		frame = nat_frame();
+		m = frame + 28;
+		if ((n = dns_answer(i, m, q, &hash)) <= 0) {
+			framebuf_put(frame);
+			continue;	/* keep waiting for the real one */
+		}
+		qlen = pending[i].qlen;
+		m[0] = pending[i].gid >> 8;
+		m[1] = pending[i].gid;
+
+		/* no error, or no such name; and complete */
+		if (n <= DNS_MAXMSG && !(m[2] & 0x02)
+		 && ((m[3] & 0x0f) == 0 || (m[3] & 0x0f) == 3)
+		 && (ttl = dns_ttl(m, n, qlen, 0)) > 0) {
+			if (((m[3] & 0x0f) == 3 || (m[6] | m[7]) == 0)
+			 && ttl > DNS_NEGTTL) {
+				ttl = DNS_NEGTTL;
+			}
+			cache_put(m, n, q, qlen, hash, ttl);
+		}
+		dns_send(frame, pending[i].local, pending[i].gaddr,
+			pending[i].gport, n, qlen);
+		dns_done(i);
+	}
+}
@@ -0,0 +1,41 @@
+/*
+ * VMnet -- caching DNS forwarder
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef DNS_H
+#define DNS_H
+
+#include <stdint.h>
+#include <sys/select.h>
+
+#include "config.h"
+#include "vmnet.h"
+
+struct dnsent {
+	uint32_t seq;		/* odd while it is being written */
+	uint32_t hash;		/* of the question, 0 if unused */
+	uint32_t expire;	/* now, when it goes stale */
+	uint32_t stamp;		/* now, when it was stored */
+	uint16_t qlen;		/* question at msg + 12, lower case */
+	uint16_t len;
+	unsigned char msg[DNS_MAXMSG];
+};
+
+struct dnscache {
+	uint32_t hits;
+	uint32_t misses;
+	struct dnsent ent[DNS_CACHE];
+};
+
+int dns_open(slipconn *sc);
+void dns_close(void);
+int dns_input(slipconn *sc, const unsigned char *frame, int len);
+int dns_fdset(fd_set *rfds, int maxfd);
+void dns_poll(fd_set *rfds);
+
+#endif
@@ -0,0 +1,189 @@
+/*
+ * VMnet -- deficit round robin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Frames for a guest can come from the host and from any number of
+ * switching peers.  Rather than first come, first served, they are
+ * queued per source and sent on by deficit round robin (Shreedhar and
+ * Varghese, 1995): each round a backlogged source may send DRR_QUANTUM
+ * bytes times its weight, so a bulk sender gets its share and no more.
+ *
+ * Each source has a queue in each of the priority bands (see prio.c):
+ * band 0 is served before band 1, with DRR within each band.  Frames
+ * from the guest go through the same kind of queue, with a single
+ * source, just for the bands.
+ *
+ * A source may queue at most DRR_CLASSLEN frames per band, and all
+ * sources together DRR_FRAMES; beyond that, frames are dropped at
+ * enqueue.
+ * The frames themselves are not copied, the queue just holds on to the
+ * frame buffers it is given.
+ */
+
+#include <stdlib.h>
+
+#include "drr.h"
+
+struct drr *drr_new(void)
+{
+	struct drr *d;
+	struct drrclass *c;
+	int b, i;
+
+	if ((d = malloc(sizeof(*d))) == NULL) {
+		return NULL;
+	}
+	for (b = 0; b < DRR_BANDS; b++) {
+		d->active[b] = d->last[b] = DRR_NONE;
+		for (i = 0; i < DRR_CLASSES; i++) {
+			c = &d->cls[b][i];
+			c->head = c->tail = c->next = DRR_NONE;
+			c->count = 0;
+			c->deficit = 0;
+			c->weight = 1;
+		}
+	}
+	d->frames = 0;
+	d->bytes = 0;
+	d->run = 0;
+	for (i = 0; i < DRR_FRAMES; i++) {
+		d->ent[i].next = i + 1 < DRR_FRAMES ? i + 1 : DRR_NONE;
+	}
+	d->free = 0;
+	return d;
+}
+
+/* The queue must be empty */
+void drr_free(struct drr *d)
+{
+	free(d);
+}
+
+/*
+ * Can class cls (any class, if cls < 0) queue another frame, whatever
+ * its band?
+ */
+int drr_room(struct drr *d, int cls)
+{
+	int b;
+
+	if (d->free == DRR_NONE) {
+		return 0;
+	}
+	for (b = 0; cls >= 0 && b < DRR_BANDS; b++) {
+		if (d->cls[b][cls].count >= DRR_CLASSLEN) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Queue a frame for class cls in band band, with the time it came in.
+ * Returns 0, or -1 if there is no room; the frame is then still the
+ * caller's.
+ */
+int drr_enqueue(struct drr *d, int band, int cls, int weight,
+	unsigned char *frame, int len, uint32_t stamp)
+{
+	struct drrclass *c = &d->cls[band][cls];
+	struct drrent *e;
+	uint16_t i;
+
+	if (d->free == DRR_NONE || c->count >= DRR_CLASSLEN) {
+		return -1;
+	}
+	i = d->free;
+	e = &d->ent[i];
+	d->free = e->next;
+	e->frame = frame;
+	e->len = len;
+	e->stamp = stamp;
+	e->next = DRR_NONE;
+
+	if (c->count++ == 0) {
+		c->head = i;
+		/* becomes active at the end of the round */
+		c->deficit = 0;
+		c->weight = weight > 0 ? weight : 1;
+		c->next = DRR_NONE;
+		if (d->last[band] == DRR_NONE) {
+			d->active[band] = cls;
+		} else {
+			d->cls[band][d->last[band]].next = cls;
+		}
+		d->last[band] = cls;
+	} else {
+		d->ent[c->tail].next = i;
+	}
+	c->tail = i;
+	d->frames++;
+	d->bytes += len;
+	return 0;
+}
+
+/* Take the next frame of a band by deficit round robin */
+static unsigned char *drr_band(struct drr *d, int b, int *len,
+	uint32_t *stamp)
+{
+	struct drrclass *c;
+	struct drrent *e;
+	unsigned char *frame;
+	uint16_t cls;
+
+	while ((cls = d->active[b]) != DRR_NONE) {
+		c = &d->cls[b][cls];
+		e = &d->ent[c->head];
+		if (e->len <= c->deficit) {
+			c->deficit -= e->len;
+			frame = e->frame;
+			*len = e->len;
+			*stamp = e->stamp;
+			c->head = e->next;
+			e->next = d->free;
+			d->free = e - d->ent;
+			d->frames--;
+			d->bytes -= *len;
+			if (--c->count == 0) {
+				/* idle classes do not save up credit */
+				c->deficit = 0;
+				d->active[b] = c->next;
+				if (d->active[b] == DRR_NONE) {
+					d->last[b] = DRR_NONE;
+				}
+			}
+			return frame;
+		}
+		/* out of credit: top up and go to the back of the round */
+		c->deficit += DRR_QUANTUM * c->weight;
+		if (c->next != DRR_NONE) {
+			d->active[b] = c->next;
+			d->cls[b][d->last[b]].next = cls;
+			c->next = DRR_NONE;
+			d->last[b] = cls;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take the next frame to send, or NULL if nothing is queued.  Band 0
+ * goes first; if both are backlogged, band 1 still gets one frame
+ * after every ratio frames of band 0, unless ratio is 0 (strict).
+ * *stamp is the time it was queued with.
+ */
+unsigned char *drr_dequeue(struct drr *d, int ratio, int *len,
+	uint32_t *stamp)
+{
+	if (d->active[0] != DRR_NONE
+	 && (d->active[1] == DRR_NONE || ratio == 0 || d->run < ratio)) {
+		d->run++;
+		return drr_band(d, 0, len, stamp);
+	}
+	d->run = 0;
+	return drr_band(d, 1, len, stamp);
+}
@@ -0,0 +1,57 @@
+/*
+ * VMnet -- deficit round robin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef DRR_H
+#define DRR_H
+
+#include <stdint.h>
+
+#include "config.h"
+
+#define DRR_NONE	0xffff
+#define DRR_HOST	MAXSESS		/* class of frames from the host */
+#define DRR_CLASSES	(MAXSESS + 1)	/* one per source session, + host */
+#define DRR_BANDS	2		/* priorities, see prio.c */
+
+struct drrclass {
+	uint16_t head;		/* first queued frame, DRR_NONE if empty */
+	uint16_t tail;
+	uint16_t count;
+	uint16_t next;		/* next active class */
+	int32_t deficit;	/* bytes it may still send this round */
+	int32_t weight;
+};
+
+struct drrent {
+	unsigned char *frame;
+	uint16_t len;
+	uint16_t next;
+	uint32_t stamp;		/* lat_now() it came in, see stats.c */
+};
+
+struct drr {
+	uint16_t active[DRR_BANDS];	/* round robin lists of backlogged */
+	uint16_t last[DRR_BANDS];	/* classes, per band */
+	uint16_t free;		/* unused entries */
+	uint16_t frames;	/* frames queued */
+	uint32_t bytes;		/* bytes queued */
+	uint32_t run;		/* band 0 frames sent in a row */
+	struct drrclass cls[DRR_BANDS][DRR_CLASSES];
+	struct drrent ent[DRR_FRAMES];
+};
+
+struct drr *drr_new(void);
+void drr_free(struct drr *d);
+int drr_room(struct drr *d, int cls);
+int drr_enqueue(struct drr *d, int band, int cls, int weight,
+	unsigned char *frame, int len, uint32_t stamp);
+unsigned char *drr_dequeue(struct drr *d, int ratio, int *len,
+	uint32_t *stamp);
+
+#endif
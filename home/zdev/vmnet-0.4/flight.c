@@ -0,0 +1,153 @@
+/*
+ * VMnet -- flight recorder
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vmnet always keeps the last FLIGHT_EVENTS things that happened on
+ * its data path (select() wakeups, read() and write() results, frames,
+ * queue lengths, drops, signals) in a ring in memory, and writes them
+ * out to FLIGHT_FILE when it dies of a read or write error or of a
+ * crash; a session stopped by SIGTERM and the like leaves nothing.
+ * SIGRTMIN writes them out on demand without stopping it.
+ *
+ * Recording an event is a handful of stores, timed with the loop's
+ * millisecond clock.  The dump is written with nothing but
+ * async-signal-safe calls, as it may run in a signal handler.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flight.h"
+
+struct flightev flight[FLIGHT_EVENTS];
+unsigned int flightpos;
+
+static char file[64];
+static char who[16];		/* sl%d, or "user" */
+
+static const char *evname[] = {
+	"?", "wakeup", "read", "write", "frame", "queue", "drop", "signal",
+	"stall"
+};
+static const char *dirname[2] = { "to host", "to guest" };
+
+/* An integer, in decimal: snprintf() is not safe in a signal handler */
+static char *putnum(char *p, long n)
+{
+	char tmp[24];
+	int i = 0;
+
+	if (n < 0) {
+		*p++ = '-';
+		n = -n;
+	}
+	do {
+		tmp[i++] = '0' + n % 10;
+		n /= 10;
+	} while (n > 0);
+	while (i > 0) {
+		*p++ = tmp[--i];
+	}
+	return p;
+}
+
+static char *putstr(char *p, const char *s)
+{
+	while (*s) {
+		*p++ = *s++;
+	}
+	return p;
+}
+
+/* Write the ring out, oldest event first, times relative to now */
+void flight_dump(const char *why, int err)
+{
+	struct flightev *e;
+	unsigned int i, n, pos = flightpos;
+	char line[128], *p;
+	int fd, saved = errno;
+
+	if (file[0] == '\0' || (fd = dumpopen(file)) < 0) {
+		errno = saved;
+		return;
+	}
+	p = putstr(line, "vmnet flight recorder, ");
+	p = putstr(p, who);
+	p = putstr(p, ", pid ");
+	p = putnum(p, getpid());
+	p = putstr(p, ": ");
+	p = putstr(p, why);
+	if (err) {
+		p = putstr(p, ", errno ");
+		p = putnum(p, err);
+	}
+	p = putstr(p, "\nms ago\tevent\tdir\ta\tb\n");
+	write(fd, line, p - line);
+
+	n = pos < FLIGHT_EVENTS ? pos : FLIGHT_EVENTS;
+	for (i = pos - n; i != pos; i++) {
+		e = &flight[i & (FLIGHT_EVENTS - 1)];
+		p = putnum(line, (long)(uint32_t)(nowms - e->ms));
+		*p++ = '\t';
+		p = putstr(p, e->type < sizeof(evname) / sizeof(evname[0])
+			? evname[e->type] : "?");
+		*p++ = '\t';
+		p = putstr(p, e->type == FL_WAKEUP || e->type == FL_SIGNAL
+			|| e->type == FL_STALL ? "-" : dirname[e->dir & 1]);
+		*p++ = '\t';
+		p = putnum(p, e->a);
+		*p++ = '\t';
+		p = putnum(p, e->b);
+		*p++ = '\n';
+		write(fd, line, p - line);
+	}
+	close(fd);
+	errno = saved;
+}
+
+/* A crash: leave a record of it, then die of the signal as before */
+static void flight_fatal(int sig)
+{
+	FLIGHT(FL_SIGNAL, 0, sig, 0);
+	flight_dump("crashed", 0);
+	raise(sig);		/* SA_RESETHAND put back the default */
+}
+
+static void flight_request(int sig)
+{
+	FLIGHT(FL_SIGNAL, 0, sig, 0);
+	flight_dump("on request", 0);
+}
+
+void flight_init(slipconn *sc)
+{
+	static const int fatal[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+	struct sigaction sa;
+	unsigned int i;
+
+	dumppath(file, sizeof(file), FLIGHT_FILE, (int)getpid());
+	if (sc->unit >= 0) {
+		snprintf(who, sizeof(who), "sl%d", sc->unit);
+	} else {
+		strcpy(who, "user mode");
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = flight_fatal;
+	sa.sa_flags = SA_RESETHAND;
+	for (i = 0; i < sizeof(fatal) / sizeof(fatal[0]); i++) {
+		sigaction(fatal[i], &sa, 0);
+	}
+	sa.sa_handler = flight_request;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGRTMIN, &sa, 0);
+}
@@ -0,0 +1,54 @@
+/*
+ * VMnet -- flight recorder
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stdint.h>
+
+#include "config.h"
+#include "vmnet.h"
+
+/* event types, and what a and b of each are */
+#define FL_WAKEUP	1	/* select() returned a, errno b */
+#define FL_READ		2	/* read() returned a, errno b */
+#define FL_WRITE	3	/* write() of b bytes returned a */
+#define FL_FRAME	4	/* decoded a frame of a bytes */
+#define FL_QUEUE	5	/* queued, a frames and b bytes now */
+#define FL_DROP		6	/* dropped a frame */
+#define FL_SIGNAL	7	/* got signal a */
+#define FL_STALL	8	/* a pass took a ms, longest in phase b */
+
+struct flightev {
+	uint32_t ms;		/* nowms */
+	uint16_t type;
+	uint16_t dir;
+	int32_t a;
+	int32_t b;
+};
+
+extern struct flightev flight[FLIGHT_EVENTS];
+extern unsigned int flightpos;
+
+/* Record an event: a few stores, no locks, no system calls */
+#define FLIGHT(t, d, x, y) \
+	do { \
+		struct flightev *e_ = \
+			&flight[flightpos++ & (FLIGHT_EVENTS - 1)]; \
+		e_->ms = nowms; \
+		e_->type = t; \
+		e_->dir = d; \
+		e_->a = x; \
+		e_->b = y; \
+	} while (0)
+
+void flight_init(slipconn *sc);
+void flight_dump(const char *why, int err);
+
+#endif
@@ -0,0 +1,398 @@
+/*
+ * VMnet -- sampled flow accounting
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * With flows=N in the config entry (-F N in user mode), vmnet counts one
+ * in every N frames it relays, each way, in a cache of flows: source
+ * and destination address and port, protocol and direction, with the
+ * packets and bytes counted and when the flow was first and last seen.
+ * Every FLOW_EXPORT seconds the cache is exported in IPFIX (RFC 7011)
+ * and starts over, so each record holds what the flow did in that
+ * period.  The messages are appended to a file (RFC 5655 calls that
+ * an IPFIX file) or sent to a collector over UDP, each with the
+ * template, so a collector that starts late can read the next one.
+ * The file is only readable by its owner, who must be us: it is never
+ * opened through a symlink, nor appended to if somebody else made it.
+ *
+ * The cache has FLOW_SIZE entries, allocated when the session starts.
+ * When a new flow finds no room the cache is exported early.  A frame
+ * that is not sampled costs a decrement and a test.
+ *
+ * ICMP flows have the type and code as their destination port, as in
+ * NetFlow.  The observation domain is the sl unit, or the pid of a
+ * user mode vmnet; flowDirection 0 is from the guest, 1 to it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "flow.h"
+#include "log.h"
+
+int flowevery = 0;
+int flowskip = 0;
+
+struct flow {
+	uint32_t src;
+	uint32_t dst;
+	uint16_t sport;
+	uint16_t dport;
+	uint8_t proto;
+	uint8_t dir;		/* DIR_* */
+	uint16_t used;		/* 0 for a free entry */
+	uint32_t first;		/* nowms */
+	uint32_t last;
+	uint32_t packets;
+	uint64_t bytes;
+};
+
+static struct flow *cache = NULL;	/* FLOW_SIZE of them */
+static int nflows;
+static int fd = -1;
+static int udp;
+static const char *to;
+static uint32_t domain;		/* observation domain id */
+static uint32_t seq;		/* data records exported so far */
+static unsigned int next;	/* now, at the next export */
+
+/* IPFIX: the message header, one template, and a set of records */
+#define IPFIX_VERSION	10
+#define IPFIX_HEADER	16
+#define IPFIX_TEMPLATE	256
+#define IPFIX_RECORD	50
+#define IPFIX_MSG	1400	/* one UDP datagram on any path */
+
+static const uint16_t field[][2] = {	/* element id, length */
+	{ 8, 4 },	/* sourceIPv4Address */
+	{ 12, 4 },	/* destinationIPv4Address */
+	{ 7, 2 },	/* sourceTransportPort */
+	{ 11, 2 },	/* destinationTransportPort */
+	{ 4, 1 },	/* protocolIdentifier */
+	{ 61, 1 },	/* flowDirection */
+	{ 1, 8 },	/* octetDeltaCount */
+	{ 2, 8 },	/* packetDeltaCount */
+	{ 152, 8 },	/* flowStartMilliseconds */
+	{ 153, 8 },	/* flowEndMilliseconds */
+	{ 34, 4 },	/* samplingInterval */
+};
+#define NFIELD (sizeof(field) / sizeof(field[0]))
+
+static unsigned char msg[IPFIX_MSG];
+
+static unsigned char *put16(unsigned char *p, uint32_t v)
+{
+	*p++ = v >> 8;
+	*p++ = v;
+	return p;
+}
+
+static unsigned char *put32(unsigned char *p, uint32_t v)
+{
+	p = put16(p, v >> 16);
+	return put16(p, v);
+}
+
+static unsigned char *put64(unsigned char *p, uint64_t v)
+{
+	p = put32(p, v >> 32);
+	return put32(p, v);
+}
+
+/* "ADDR:PORT" of a collector */
+static int flow_addr(const char *s, struct sockaddr_in *sin)
+{
+	char host[64];
+	const char *colon = strrchr(s, ':');
+	int port;
+
+	if (colon == NULL || colon - s >= (int)sizeof(host)) {
+		return -1;
+	}
+	memcpy(host, s, colon - s);
+	host[colon - s] = '\0';
+	port = atoi(colon + 1);
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(port);
+	if (port <= 0 || port > 65535
+	 || inet_pton(AF_INET, host, &sin->sin_addr) != 1) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Open the file to append to, if it is ours */
+static int flow_file(const char *path)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0600);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)
+	 || st.st_uid != geteuid()) {
+		close(fd);
+		errno = EPERM;
+		return -1;
+	}
+	return fd;
+}
+
+/* "N[,/PATH|,ADDR:PORT]", for flows= */
+int flow_parse(const char *s, int *every, char *to, int tolen)
+{
+	struct sockaddr_in sin;
+	char *end;
+	long n;
+
+	n = strtol(s, &end, 10);
+	if (end == s || n < 1 || n > 65535) {
+		return -1;
+	}
+	*every = n;
+	to[0] = '\0';
+	if (*end == '\0') {
+		return 0;
+	}
+	s = end + 1;
+	if (*end != ',' || (int)strlen(s) >= tolen
+	 || (s[0] != '/' && flow_addr(s, &sin) < 0)) {
+		return -1;
+	}
+	strcpy(to, s);
+	return 0;
+}
+
+/* Start counting, if sc->flows says so */
+int flow_open(slipconn *sc)
+{
+	static char file[64];
+	struct sockaddr_in sin;
+
+	if (*sc->flowto) {
+		to = sc->flowto;
+	} else {
+		dumppath(file, sizeof(file), FLOW_FILE, (int)geteuid());
+		to = file;
+	}
+	if ((cache = calloc(FLOW_SIZE, sizeof(struct flow))) == NULL) {
+		perror("vmnet: malloc");
+		return -1;
+	}
+	udp = to[0] != '/';
+	if (!udp) {
+		fd = flow_file(to);
+	} else if (flow_addr(to, &sin) == 0
+		&& (fd = socket(AF_INET, SOCK_DGRAM|SOCK_CLOEXEC, 0)) >= 0
+		&& connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0) {
+		perror(to);
+		free(cache);
+		cache = NULL;
+		return -1;
+	}
+	domain = sc->unit >= 0 ? (uint32_t)sc->unit : (uint32_t)getpid();
+	seq = 0;
+	nflows = 0;
+	next = now + FLOW_EXPORT;
+	flowevery = flowskip = sc->flows;
+	return 0;
+}
+
+/* Message header, template set and data set header; the lengths later */
+static unsigned char *flow_start(void)
+{
+	unsigned char *p = msg;
+	unsigned int i;
+
+	p = put16(p, IPFIX_VERSION);
+	p = put16(p, 0);
+	p = put32(p, time(NULL));
+	p = put32(p, seq);
+	p = put32(p, domain);
+
+	p = put16(p, 2);			/* template set */
+	p = put16(p, 8 + 4 * NFIELD);
+	p = put16(p, IPFIX_TEMPLATE);
+	p = put16(p, NFIELD);
+	for (i = 0; i < NFIELD; i++) {
+		p = put16(p, field[i][0]);
+		p = put16(p, field[i][1]);
+	}
+
+	p = put16(p, IPFIX_TEMPLATE);		/* data set */
+	return put16(p, 0);
+}
+
+static void flow_send(unsigned char *p)
+{
+	unsigned char *set = msg + IPFIX_HEADER + 8 + 4 * NFIELD;
+	ssize_t r;
+
+	put16(set + 2, p - set);
+	put16(msg + 2, p - msg);
+	if (udp) {
+		r = send(fd, msg, p - msg, MSG_DONTWAIT);
+	} else {
+		r = write(fd, msg, p - msg);
+	}
+	if (r != p - msg) {
+		logmsg(LM_FLOWS, to, 0, 0, r < 0 ? errno : 0);
+	}
+}
+
+/* Export everything in the cache, and empty it */
+static void flow_export(void)
+{
+	struct timespec ts;
+	uint64_t ms;
+	struct flow *e;
+	unsigned char *p = NULL;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ms = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+	for (e = cache; e < cache + FLOW_SIZE; e++) {
+		if (!e->used) {
+			continue;
+		}
+		if (p == NULL) {
+			p = flow_start();
+		}
+		memcpy(p, &e->src, 4);
+		memcpy(p + 4, &e->dst, 4);
+		p = put16(p + 8, e->sport);
+		p = put16(p, e->dport);
+		*p++ = e->proto;
+		*p++ = e->dir == DIR_HOST ? 0 : 1;
+		p = put64(p, e->bytes);
+		p = put64(p, e->packets);
+		p = put64(p, ms - (uint32_t)(nowms - e->first));
+		p = put64(p, ms - (uint32_t)(nowms - e->last));
+		p = put32(p, flowevery);
+		e->used = 0;
+		seq++;
+		if (p + IPFIX_RECORD > msg + sizeof(msg)) {
+			flow_send(p);
+			p = NULL;
+		}
+	}
+	if (p != NULL) {
+		flow_send(p);
+	}
+	nflows = 0;
+	next = now + FLOW_EXPORT;
+}
+
+static int sameflow(const struct flow *a, const struct flow *b)
+{
+	return a->src == b->src && a->dst == b->dst && a->sport == b->sport
+		&& a->dport == b->dport && a->proto == b->proto
+		&& a->dir == b->dir;
+}
+
+/* Count a sampled frame of len bytes */
+void flow_count(int dir, const unsigned char *f, int len)
+{
+	struct flow k, *e;
+	uint32_t h;
+	int hl, i;
+
+	if (cache == NULL || len < 20 || (f[0] >> 4) != 4) {
+		return;
+	}
+	memset(&k, 0, sizeof(k));
+	hl = (f[0] & 0x0f) * 4;
+	memcpy(&k.src, f + 12, 4);
+	memcpy(&k.dst, f + 16, 4);
+	k.proto = f[9];
+	k.dir = dir;
+	/* only the first fragment has the ports */
+	if (!(f[6] & 0x1f) && !f[7] && len >= hl + 4) {
+		if (k.proto == IPPROTO_TCP || k.proto == IPPROTO_UDP) {
+			k.sport = f[hl] << 8 | f[hl + 1];
+			k.dport = f[hl + 2] << 8 | f[hl + 3];
+		} else if (k.proto == IPPROTO_ICMP) {
+			k.dport = f[hl] << 8 | f[hl + 1];
+		}
+	}
+
+	h = (k.src ^ k.dst * 0x9e3779b1) + (k.sport << 16 | k.dport);
+	h = (h ^ (h >> 15)) * 0x85ebca6b ^ k.proto ^ dir;
+	h ^= h >> 13;
+	for (i = 0; i < FLOW_PROBE; i++) {
+		e = &cache[(h + i) & (FLOW_SIZE - 1)];
+		if (!e->used || sameflow(e, &k)) {
+			break;
+		}
+	}
+	if (i == FLOW_PROBE) {
+		/* no room: export what we have and start over */
+		flow_export();
+		e = &cache[h & (FLOW_SIZE - 1)];
+	}
+	if (!e->used) {
+		*e = k;
+		e->used = 1;
+		e->first = nowms;
+		nflows++;
+	}
+	e->last = nowms;
+	e->packets++;
+	e->bytes += len;
+}
+
+/* Milliseconds until the next export, -1 if there is nothing to export */
+int flow_wait(void)
+{
+	if (cache == NULL || nflows == 0) {
+		return -1;
+	}
+	return (int)(next - now) > 0 ? (next - now) * 1000 : 0;
+}
+
+/* Export the cache when it is time */
+void flow_poll(void)
+{
+	if (cache == NULL || (int)(next - now) > 0) {
+		return;
+	}
+	if (nflows > 0) {
+		flow_export();
+	} else {
+		next = now + FLOW_EXPORT;
+	}
+}
+
+/* Export what is left, and stop counting */
+void flow_close(void)
+{
+	if (cache == NULL) {
+		return;
+	}
+	if (nflows > 0) {
+		flow_export();
+	}
+	close(fd);
+	fd = -1;
+	free(cache);
+	cache = NULL;
+	flowevery = 0;
+}
@@ -0,0 +1,34 @@
+/*
+ * VMnet -- sampled flow accounting
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef FLOW_H
+#define FLOW_H
+
+#include "vmnet.h"
+
+extern int flowevery;		/* count 1 in this many frames, 0 for none */
+extern int flowskip;		/* frames until the next one counted */
+
+/* Count a frame in direction dir, if it is the one in flowevery */
+#define FLOW(dir, f, len) \
+	do { \
+		if (flowevery && --flowskip <= 0) { \
+			flowskip = flowevery; \
+			flow_count(dir, f, len); \
+		} \
+	} while (0)
+
+int flow_parse(const char *s, int *every, char *to, int tolen);
+int flow_open(slipconn *sc);
+void flow_count(int dir, const unsigned char *f, int len);
+int flow_wait(void);
+void flow_poll(void);
+void flow_close(void);
+
+#endif
@@ -0,0 +1,203 @@
+/*
+ * VMnet -- forwarding table
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Maps a destination address to the vmnet session that owns it.  The
+ * table lives in the shared segment (see shm.c) and is used by every
+ * vmnet process at once, so it has to work without locks:
+ *
+ *  - open addressing with linear probing, bounded to FWD_PROBE slots so
+ *    a lookup touches at most a couple of cache lines;
+ *  - a key is claimed with a single compare-and-swap and is never
+ *    cleared, so a probe sequence is never cut short;
+ *  - value and timestamp are 32 bit atomic stores.
+ *
+ * Entries seeded from the config file are static.  Anything else is
+ * learned from guest source addresses and ages out after FWD_AGE
+ * seconds; aging is done lazily at lookup time, no sweeping needed.
+ * When an insertion finds no free slot, it takes over an aged one: it
+ * swaps the old key for FWD_TOMB, so nobody else can take it or find
+ * it, fills in the value and only then stores the new key.  A reader
+ * that found the old key checks it again after reading the value, and
+ * a learner changes the value with a compare-and-swap, so neither can
+ * mix up the old entry and the new one.
+ */
+
+#include <stddef.h>
+
+#include "fwd.h"
+
+static inline uint32_t fwd_hash(uint64_t key)
+{
+	/* Fibonacci hashing, FWD_SIZE is a power of two */
+	return (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+void fwd_init(struct fwdtab *t)
+{
+	int i;
+
+	t->used = 0;
+	t->full = 0;
+	for (i = 0; i < FWD_SIZE; i++) {
+		t->ent[i].key = 0;
+		t->ent[i].val = 0;
+		t->ent[i].seen = 0;
+	}
+}
+
+static struct fwdent *fwd_find(struct fwdtab *t, uint64_t key)
+{
+	struct fwdent *e;
+	uint64_t k;
+	uint32_t h;
+	int i;
+
+	h = fwd_hash(key);
+	for (i = 0; i < FWD_PROBE; i++) {
+		e = &t->ent[(h + i) & (FWD_SIZE - 1)];
+		k = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+		if (k == key) {
+			return e;
+		}
+		if (k == 0) {
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+/* A learned entry that has not been seen for FWD_AGE seconds */
+static int fwd_aged(struct fwdent *e, uint32_t now)
+{
+	return !(__atomic_load_n(&e->val, __ATOMIC_ACQUIRE) & FWD_STATIC)
+		&& now - __atomic_load_n(&e->seen, __ATOMIC_RELAXED) > FWD_AGE;
+}
+
+/* Swap key for oldkey in e, with val and now, through a tombstone */
+static int fwd_claim(struct fwdent *e, uint64_t oldkey, uint64_t key,
+	uint32_t val, uint32_t now)
+{
+	if (!__atomic_compare_exchange_n(&e->key, &oldkey, FWD_TOMB, 0,
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	__atomic_store_n(&e->seen, now, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->val, val, __ATOMIC_RELEASE);
+	__atomic_store_n(&e->key, key, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Find or add the entry for key.  A new entry gets val and now, an
+ * existing one is left for the caller to update.
+ */
+static struct fwdent *fwd_insert(struct fwdtab *t, uint64_t key,
+	uint32_t val, uint32_t now)
+{
+	struct fwdent *e, *old = NULL;
+	uint64_t k, oldkey = 0;
+	uint32_t h;
+	int i;
+
+	h = fwd_hash(key);
+	for (i = 0; i < FWD_PROBE; i++) {
+		e = &t->ent[(h + i) & (FWD_SIZE - 1)];
+		k = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+		if (k == 0) {
+			if (fwd_claim(e, k, key, val, now)) {
+				__atomic_add_fetch(&t->used, 1,
+					__ATOMIC_RELAXED);
+				return e;
+			}
+			/* somebody beat us to it */
+			k = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+		}
+		if (k == key) {
+			return e;
+		}
+		if (old == NULL && k != FWD_TOMB && fwd_aged(e, now)) {
+			old = e;
+			oldkey = k;
+		}
+	}
+	if (old != NULL && fwd_claim(old, oldkey, key, val, now)) {
+		return old;
+	}
+	__atomic_add_fetch(&t->full, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/*
+ * Look up a key.  Returns the entry's value, or 0 if there is none or
+ * it has aged out.  The caller still has to check that the session the
+ * value points at is alive and of the right generation.
+ */
+uint32_t fwd_lookup(struct fwdtab *t, uint64_t key, uint32_t now)
+{
+	struct fwdent *e;
+	uint32_t val;
+
+	e = fwd_find(t, key);
+	if (e == NULL) {
+		return 0;
+	}
+	val = __atomic_load_n(&e->val, __ATOMIC_ACQUIRE);
+	if (!(val & FWD_STATIC)
+	 && now - __atomic_load_n(&e->seen, __ATOMIC_RELAXED) > FWD_AGE) {
+		return 0;
+	}
+	/* taken over by another key while we looked? */
+	if (__atomic_load_n(&e->key, __ATOMIC_ACQUIRE) != key) {
+		return 0;
+	}
+	return val;
+}
+
+/*
+ * Learn that key lives behind the session in val.  Static entries are
+ * never overridden, so a guest cannot steal another guest's configured
+ * address.  The common case -- nothing changed -- does not write to
+ * the table at all, which keeps the cache lines shared between the
+ * processes.  Returns 0, or -1 if the table is full.
+ */
+int fwd_learn(struct fwdtab *t, uint64_t key, uint32_t val, uint32_t now)
+{
+	struct fwdent *e;
+	uint32_t old;
+
+	e = fwd_find(t, key);
+	if (e == NULL && (e = fwd_insert(t, key, val, now)) == NULL) {
+		return -1;
+	}
+	old = __atomic_load_n(&e->val, __ATOMIC_ACQUIRE);
+	if (old & FWD_STATIC) {
+		return 0;
+	}
+	/* if the entry was taken over meanwhile, the swap fails */
+	if (old != val && !__atomic_compare_exchange_n(&e->val, &old, val, 0,
+	    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+	if (__atomic_load_n(&e->seen, __ATOMIC_RELAXED) != now
+	 && __atomic_load_n(&e->key, __ATOMIC_ACQUIRE) == key) {
+		__atomic_store_n(&e->seen, now, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+/* Add or update a static entry.  Returns 0, or -1 if the table is full. */
+int fwd_static(struct fwdtab *t, uint64_t key, uint32_t val, uint32_t now)
+{
+	struct fwdent *e;
+
+	if ((e = fwd_insert(t, key, val | FWD_STATIC, now)) == NULL) {
+		return -1;
+	}
+	__atomic_store_n(&e->val, val | FWD_STATIC, __ATOMIC_RELEASE);
+	return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * VMnet -- forwarding table
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef FWD_H
+#define FWD_H
+
+#include <stdint.h>
+
+#include "config.h"
+
+/*
+ * Keys are 64 bits: address type in the top 4 bits, a 12 bit VLAN id,
+ * and the address itself (an IPv4 address or a 48 bit MAC) below that.
+ * Key 0 marks an empty slot, FWD_TOMB one being taken over.
+ */
+#define FWD_T_IP4	1
+#define FWD_T_MAC	2
+#define FWD_KEY(type, vlan, addr) \
+	(((uint64_t)(type) << 60) | ((uint64_t)((vlan) & 0xfff) << 48) | \
+	 ((uint64_t)(addr) & 0xffffffffffffULL))
+#define FWD_TOMB	(~0ULL)
+
+/*
+ * Values: session slot + 1 in the low 16 bits (0 means "known, but no
+ * session attached"), the slot generation in the next 15, and the
+ * static flag on top.
+ */
+#define FWD_STATIC	0x80000000
+#define FWD_SLOT(v)	((int)((v) & 0xffff) - 1)
+#define FWD_GEN(v)	(((v) >> 16) & 0x7fff)
+#define FWD_VAL(slot, gen) \
+	((uint32_t)((slot) + 1) | (((uint32_t)(gen) & 0x7fff) << 16))
+
+struct fwdent {
+	uint64_t key;		/* never cleared, see fwd_insert() */
+	uint32_t val;
+	uint32_t seen;		/* last learned, CLOCK_MONOTONIC seconds */
+};
+
+struct fwdtab {
+	uint32_t used;		/* keys in use */
+	uint32_t full;		/* insertions that found no free slot */
+	struct fwdent ent[FWD_SIZE];
+};
+
+void fwd_init(struct fwdtab *t);
+uint32_t fwd_lookup(struct fwdtab *t, uint64_t key, uint32_t now);
+int fwd_learn(struct fwdtab *t, uint64_t key, uint32_t val, uint32_t now);
+int fwd_static(struct fwdtab *t, uint64_t key, uint32_t val, uint32_t now);
+
+#endif
@@ -0,0 +1,310 @@
+/*
+ * VMnet -- logging off the data path
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * What vmnet has to say while it relays (a read or write that failed,
+ * a dropped frame, no memory for a buffer...) must not hold up the
+ * relaying, and stderr is usually the emulator's console, which can
+ * be slow.  So the data path only fills in a small binary record, the
+ * message number, an errno and its arguments, and puts it in a ring
+ * that a thread of our own takes it from, to format and write out to
+ * where log= in the config entry (-l in user mode) says:
+ *	stderr		as before, the default
+ *	syslog		facility daemon
+ *	journal		systemd's journal, with fields VMNET_SESSION,
+ *			VMNET_EVENT and ERRNO for journalctl to match on
+ *	/path		appended to a file, with date and time
+ * The data path never waits for the thread: if the ring is full the
+ * record is dropped, and the next one says how many were.  Each kind
+ * of message is also limited to a few a second; the rest are only
+ * counted, and the next one that gets through says how many there
+ * were.
+ *
+ * Until log_open() has started the thread, or if it cannot, messages
+ * are written out at once.  exit() writes out what is still queued.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "log.h"
+
+static const struct {
+	const char *event;	/* VMNET_EVENT in the journal */
+	int prio;		/* syslog priority */
+	int persec;		/* at most this many a second */
+	const char *fmt;	/* of s, a and b, in that order */
+} msg[LM_COUNT] = {
+	{ "read", LOG_ERR, 5, "read from the %s failed" },
+	{ "write", LOG_ERR, 5, "write to the %s failed" },
+	{ "drop", LOG_WARNING, 1, "frame to the %s dropped, queue full" },
+	{ "nomem", LOG_CRIT, 5, "out of memory for %s" },
+	{ "upgrade", LOG_ERR, 5, "live upgrade failed (%s), continuing" },
+	{ "capture", LOG_NOTICE, 5,
+		"%s: %ld frames captured, %ld more did not fit" },
+	{ "nocapture", LOG_ERR, 5, "cannot capture to %s" },
+	{ "flows", LOG_ERR, 1, "cannot export flows to %s" },
+	{ "stall", LOG_WARNING, 1,
+		"relay loop stalled: %s took %ld of %ld ms" },
+};
+
+struct logrec {
+	time_t when;
+	int id;			/* LM_* */
+	int err;		/* errno, 0 if none */
+	unsigned int suppressed;	/* like it, over the rate limit */
+	unsigned int lost;		/* any kind, no room in the ring */
+	long a;
+	long b;
+	char s[48];
+};
+
+/* the thread only moves head, the data path only tail */
+static struct logrec ring[LOG_RING];
+static unsigned int head, tail;
+static unsigned int lost;
+
+/* rate limit: the second, and how many went out in it, per message */
+static unsigned int sec[LM_COUNT];
+static unsigned int count[LM_COUNT];
+static unsigned int suppressed[LM_COUNT];
+
+/* where to */
+#define LT_STDERR	0
+#define LT_SYSLOG	1
+#define LT_JOURNAL	2
+#define LT_FILE		3
+
+static int target = LT_STDERR;
+static FILE *logfp = NULL;
+static int journalfd = -1;
+static char who[16];		/* sl%d, or "user mode" */
+
+static pthread_t thread;
+static sem_t wake;
+static int running, stopping;
+
+/* Format a record and write it out */
+static void emit(struct logrec *r)
+{
+	char text[256], line[512], stamp[32], ebuf[64];
+	struct tm tm;
+	int n, prio = msg[r->id].prio;
+
+	snprintf(text, sizeof(text), msg[r->id].fmt, r->s, r->a, r->b);
+	if (r->err) {
+		n = strlen(text);
+		snprintf(text + n, sizeof(text) - n, ": %s",
+			strerror_r(r->err, ebuf, sizeof(ebuf)));
+	}
+	if (r->suppressed) {
+		n = strlen(text);
+		snprintf(text + n, sizeof(text) - n,
+			" (and %u more like it)", r->suppressed);
+	}
+	if (r->lost) {
+		n = strlen(text);
+		snprintf(text + n, sizeof(text) - n, " (%u messages lost)",
+			r->lost);
+	}
+
+	switch (target) {
+	case LT_JOURNAL:
+		n = snprintf(line, sizeof(line), "MESSAGE=%s: %s\n"
+			"PRIORITY=%d\nSYSLOG_IDENTIFIER=vmnet\n"
+			"VMNET_SESSION=%s\nVMNET_EVENT=%s\n",
+			who, text, prio, who, msg[r->id].event);
+		if (r->err && n < (int)sizeof(line)) {
+			snprintf(line + n, sizeof(line) - n, "ERRNO=%d\n",
+				r->err);
+		}
+		if (send(journalfd, line, strlen(line), MSG_NOSIGNAL)
+				>= 0) {
+			break;
+		}
+		/* journald went away, try syslog */
+		/* FALLTHROUGH */
+	case LT_SYSLOG:
+		syslog(prio, "%s: %s", who, text);
+		break;
+	case LT_FILE:
+		localtime_r(&r->when, &tm);
+		strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+		fprintf(logfp, "%s vmnet[%d] %s: %s\n", stamp,
+			(int)getpid(), who, text);
+		fflush(logfp);
+		break;
+	default:
+		fprintf(stderr, "vmnet: %s%s%s\n", who, who[0] ? ": " : "",
+			text);
+	}
+}
+
+/* Write out whatever is in the ring */
+static void drain(void)
+{
+	unsigned int h = head;
+
+	while (h != __atomic_load_n(&tail, __ATOMIC_ACQUIRE)) {
+		emit(&ring[h & (LOG_RING - 1)]);
+		__atomic_store_n(&head, ++h, __ATOMIC_RELEASE);
+	}
+}
+
+static void *log_thread(void *arg)
+{
+	int done;
+
+	(void)arg;
+	do {
+		while (sem_wait(&wake) < 0 && errno == EINTR) {
+			;
+		}
+		done = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+		drain();
+	} while (!done);
+	return NULL;
+}
+
+/*
+ * Log message id (LM_*).  On the data path: no locks, no system calls
+ * but a sem_post() that never blocks.
+ */
+void logmsg(int id, const char *s, long a, long b, int err)
+{
+	struct logrec *r, one;
+	unsigned int t = tail;
+
+	if (sec[id] != now) {
+		sec[id] = now;
+		count[id] = 0;
+	}
+	if (count[id] >= (unsigned int)msg[id].persec) {
+		suppressed[id]++;
+		return;
+	}
+	count[id]++;
+	if (!running) {
+		r = &one;
+	} else if (t - __atomic_load_n(&head, __ATOMIC_ACQUIRE)
+			== LOG_RING) {
+		lost++;
+		return;
+	} else {
+		r = &ring[t & (LOG_RING - 1)];
+	}
+	r->when = time(NULL);
+	r->id = id;
+	r->err = err;
+	r->suppressed = suppressed[id];
+	r->lost = lost;
+	r->a = a;
+	r->b = b;
+	strncpy(r->s, s, sizeof(r->s) - 1);
+	r->s[sizeof(r->s) - 1] = '\0';
+	suppressed[id] = 0;
+	lost = 0;
+	if (!running) {
+		emit(r);
+		return;
+	}
+	__atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+	sem_post(&wake);
+}
+
+/* Is s something we can log to? */
+int logtarget(const char *s)
+{
+	if (!strcmp(s, "stderr") || !strcmp(s, "syslog")
+	 || !strcmp(s, "journal") || s[0] == '/') {
+		return 0;
+	}
+	return -1;
+}
+
+/* Open sc->logto and start the thread */
+void log_open(slipconn *sc)
+{
+	struct sockaddr_un sun;
+	sigset_t all, old;
+
+	if (sc->unit >= 0) {
+		snprintf(who, sizeof(who), "sl%d", sc->unit);
+	} else {
+		strcpy(who, "user mode");
+	}
+	if (!strcmp(sc->logto, "syslog")
+	 || !strcmp(sc->logto, "journal")) {
+		openlog("vmnet", LOG_PID, LOG_DAEMON);
+		target = LT_SYSLOG;
+	}
+	if (!strcmp(sc->logto, "journal")) {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, JOURNAL_SOCKET);
+		journalfd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+		if (journalfd >= 0 && connect(journalfd,
+		    (struct sockaddr *)&sun, sizeof(sun)) == 0) {
+			target = LT_JOURNAL;
+		} else if (journalfd >= 0) {
+			/* no journald: syslog will do */
+			close(journalfd);
+			journalfd = -1;
+		}
+	} else if (sc->logto[0] == '/') {
+		if ((logfp = fopen(sc->logto, "ae")) == NULL) {
+			perror(sc->logto);
+		} else {
+			target = LT_FILE;
+		}
+	}
+
+	if (sem_init(&wake, 0, 0) < 0) {
+		return;
+	}
+	/* signals are for the relaying thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	running = pthread_create(&thread, NULL, log_thread, NULL) == 0;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (running) {
+		atexit(log_close);
+	}
+}
+
+/* Write out what is still in the ring, and stop the thread */
+void log_close(void)
+{
+	if (running) {
+		__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+		sem_post(&wake);
+		pthread_join(thread, NULL);
+		running = 0;
+	}
+	if (logfp != NULL) {
+		fclose(logfp);
+		logfp = NULL;
+	}
+	if (journalfd >= 0) {
+		close(journalfd);
+		journalfd = -1;
+	}
+	if (target == LT_SYSLOG || target == LT_JOURNAL) {
+		closelog();
+	}
+	target = LT_STDERR;
+}
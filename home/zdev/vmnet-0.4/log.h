@@ -0,0 +1,32 @@
+/*
+ * VMnet -- logging off the data path
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include "vmnet.h"
+
+/* what can be logged; s, a and b of each, see msg[] in log.c */
+#define LM_READ		0	/* read from s ("guest", "host") failed */
+#define LM_WRITE	1	/* write to s failed */
+#define LM_DROP		2	/* frame to s dropped, queue full */
+#define LM_NOMEM	3	/* no memory for s */
+#define LM_UPGRADE	4	/* live upgrade failed at s */
+#define LM_CAPTURE	5	/* a frames captured to file s, b lost */
+#define LM_NOCAPTURE	6	/* cannot capture to file s */
+#define LM_FLOWS	7	/* cannot export flows to s */
+#define LM_STALL	8	/* phase s took a of the b ms of a pass */
+#define LM_COUNT	9
+
+int logtarget(const char *s);
+void log_open(slipconn *sc);
+void logmsg(int id, const char *s, long a, long b, int err);
+void log_close(void);
+
+#endif
@@ -0,0 +1,227 @@
+/*
+ * VMnet -- multicast group membership
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * To send a multicast frame only to the guests that want it, we watch
+ * the IGMP reports the guests send (all versions) and keep a set of
+ * member sessions per group in the shared segment.  Like the forwarding
+ * table, group entries are claimed with a compare-and-swap and never
+ * emptied; membership is a bit per session.
+ *
+ * vmnet does not send IGMP queries, so guests only report when they
+ * join or leave, and a membership cannot time out.  A session's
+ * memberships are dropped when it leaves or goes away.  A group entry
+ * is only taken over when a new group finds no free one: then a group
+ * without members, or else one nobody reported for MCAST_AGE seconds,
+ * makes way.  As in the forwarding table, its address is swapped for
+ * MCAST_TOMB first, so nobody finds it while its members are cleared,
+ * and a joiner or sender checks the address again afterwards.
+ */
+
+#include <string.h>
+
+#include "mcast.h"
+
+#define IGMP_V1_REPORT	0x12
+#define IGMP_V2_REPORT	0x16
+#define IGMP_V2_LEAVE	0x17
+#define IGMP_V3_REPORT	0x22
+
+void mcast_init(struct mctab *t)
+{
+	int i, w;
+
+	t->full = 0;
+	for (i = 0; i < MCAST_GROUPS; i++) {
+		t->grp[i].group = 0;
+		t->grp[i].seen = 0;
+		for (w = 0; w < SESS_WORDS; w++) {
+			t->grp[i].members[w] = 0;
+		}
+	}
+}
+
+static int mcast_empty(struct mcgroup *g)
+{
+	int w;
+
+	for (w = 0; w < SESS_WORDS; w++) {
+		if (__atomic_load_n(&g->members[w], __ATOMIC_ACQUIRE)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Swap group for old in g, with no members, through a tombstone */
+static int mcast_claim(struct mcgroup *g, in_addr_t old, in_addr_t group,
+	uint32_t now)
+{
+	int w;
+
+	if (!__atomic_compare_exchange_n(&g->group, &old, MCAST_TOMB, 0,
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	for (w = 0; w < SESS_WORDS; w++) {
+		__atomic_store_n(&g->members[w], 0, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&g->seen, now, __ATOMIC_RELAXED);
+	__atomic_store_n(&g->group, group, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static struct mcgroup *mcast_slot(struct mctab *t, in_addr_t group,
+	int create, uint32_t now)
+{
+	struct mcgroup *g, *old = NULL, *idle = NULL;
+	in_addr_t a, olda = 0, idlea = 0;
+	uint32_t h;
+	int i;
+
+	h = (ntohl(group) * 0x9e3779b9U) >> 24;
+	for (i = 0; i < MCAST_GROUPS; i++) {
+		g = &t->grp[(h + i) % MCAST_GROUPS];
+		a = __atomic_load_n(&g->group, __ATOMIC_ACQUIRE);
+		if (a == 0) {
+			if (!create) {
+				return NULL;
+			}
+			if (mcast_claim(g, a, group, now)) {
+				return g;
+			}
+			a = __atomic_load_n(&g->group, __ATOMIC_ACQUIRE);
+		}
+		if (a == group) {
+			return g;
+		}
+		if (!create || a == MCAST_TOMB) {
+			continue;
+		}
+		if (idle == NULL && mcast_empty(g)) {
+			idle = g;
+			idlea = a;
+		} else if (old == NULL && now - __atomic_load_n(&g->seen,
+		    __ATOMIC_RELAXED) > MCAST_AGE) {
+			old = g;
+			olda = a;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+	/* full: take over a group nobody is in, or nobody reported */
+	if (idle != NULL && mcast_claim(idle, idlea, group, now)) {
+		return idle;
+	}
+	if (old != NULL && mcast_claim(old, olda, group, now)) {
+		return old;
+	}
+	__atomic_add_fetch(&t->full, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+struct mcgroup *mcast_find(struct mctab *t, in_addr_t group)
+{
+	return mcast_slot(t, group, 0, 0);
+}
+
+static void mcast_join(struct mctab *t, in_addr_t group, int slot,
+	uint32_t now)
+{
+	struct mcgroup *g;
+
+	if (!MCAST(group) || MCAST_LOCAL(group)) {
+		return;
+	}
+	if ((g = mcast_slot(t, group, 1, now)) == NULL) {
+		return;
+	}
+	__atomic_fetch_or(&g->members[slot >> 5], 1U << (slot & 31),
+		__ATOMIC_RELEASE);
+	if (__atomic_load_n(&g->group, __ATOMIC_ACQUIRE) != group) {
+		/* taken over meanwhile: not ours to be in */
+		__atomic_fetch_and(&g->members[slot >> 5],
+			~(1U << (slot & 31)), __ATOMIC_RELEASE);
+		return;
+	}
+	if (__atomic_load_n(&g->seen, __ATOMIC_RELAXED) != now) {
+		__atomic_store_n(&g->seen, now, __ATOMIC_RELAXED);
+	}
+}
+
+static void mcast_leave(struct mctab *t, in_addr_t group, int slot)
+{
+	struct mcgroup *g;
+
+	if ((g = mcast_slot(t, group, 0, 0)) != NULL) {
+		__atomic_fetch_and(&g->members[slot >> 5],
+			~(1U << (slot & 31)), __ATOMIC_RELEASE);
+	}
+}
+
+void mcast_leave_all(struct mctab *t, int slot)
+{
+	int i;
+
+	for (i = 0; i < MCAST_GROUPS; i++) {
+		__atomic_fetch_and(&t->grp[i].members[slot >> 5],
+			~(1U << (slot & 31)), __ATOMIC_RELEASE);
+	}
+}
+
+/* IGMPv3 group records: join unless it is "include nothing" */
+static void mcast_v3(struct mctab *t, int slot, const unsigned char *p,
+	const unsigned char *end, uint32_t now)
+{
+	int nrec, type, nsrc;
+	in_addr_t group;
+
+	nrec = p[6] << 8 | p[7];
+	p += 8;
+	while (nrec-- > 0 && p + 8 <= end) {
+		type = p[0];
+		nsrc = p[2] << 8 | p[3];
+		memcpy(&group, p + 4, sizeof(group));
+		if (type >= 1 && type <= 6) {
+			if ((type == 1 || type == 3) && nsrc == 0) {
+				mcast_leave(t, group, slot);
+			} else if (type != 6) {
+				mcast_join(t, group, slot, now);
+			}
+		}
+		p += 8 + 4*nsrc + 4*p[1];
+	}
+}
+
+/* Look at an IPv4 packet from a guest, act on it if it is IGMP. */
+void mcast_snoop(struct mctab *t, int slot, const unsigned char *ip, int len,
+	uint32_t now)
+{
+	const unsigned char *p, *end = ip + len;
+	in_addr_t group;
+	int ihl;
+
+	ihl = (ip[0] & 0x0f) * 4;
+	if (ip[9] != IPPROTO_IGMP || len < ihl + 8) {
+		return;
+	}
+	p = ip + ihl;
+	memcpy(&group, p + 4, sizeof(group));
+	switch (p[0]) {
+	case IGMP_V1_REPORT:
+	case IGMP_V2_REPORT:
+		mcast_join(t, group, slot, now);
+		break;
+	case IGMP_V2_LEAVE:
+		mcast_leave(t, group, slot);
+		break;
+	case IGMP_V3_REPORT:
+		mcast_v3(t, slot, p, end, now);
+		break;
+	}
+}
@@ -0,0 +1,41 @@
+/*
+ * VMnet -- multicast group membership
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef MCAST_H
+#define MCAST_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "vmnet.h"
+
+struct mcgroup {
+	in_addr_t group;		/* 0 if free, MCAST_TOMB if changing */
+	uint32_t seen;			/* last report, CLOCK_MONOTONIC s */
+	uint32_t members[SESS_WORDS];
+};
+
+#define MCAST_TOMB	0xffffffff
+
+struct mctab {
+	uint32_t full;		/* joins that found no free entry */
+	struct mcgroup grp[MCAST_GROUPS];
+};
+
+/* 224.0.0.0/24 is never reported with IGMP, it goes to everybody */
+#define MCAST_LOCAL(a)	((ntohl(a) & 0xffffff00) == 0xe0000000)
+#define MCAST(a)	((ntohl(a) & 0xf0000000) == 0xe0000000)
+
+void mcast_init(struct mctab *t);
+struct mcgroup *mcast_find(struct mctab *t, in_addr_t group);
+void mcast_leave_all(struct mctab *t, int slot);
+void mcast_snoop(struct mctab *t, int slot, const unsigned char *ip, int len,
+	uint32_t now);
+
+#endif
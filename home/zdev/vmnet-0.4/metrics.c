@@ -0,0 +1,425 @@
+/*
+ * VMnet -- metrics for Prometheus
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * "vmnet -m [ADDR:]PORT" or "vmnet -m /PATH" is a process of its own
+ * that serves the counters of all running sessions over HTTP, in the
+ * Prometheus text format, on a TCP port (of localhost, unless ADDR
+ * says otherwise) or a Unix socket.  It only reads the sessions'
+ * statistics segments (stats.c) when it is scraped, so the vmnet
+ * processes doing the relaying do not notice it.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "metrics.h"
+#include "stall.h"
+#include "stats.h"
+
+extern int go;
+
+/* the per direction counters, as Prometheus metrics */
+static const struct {
+	const char *name;
+	const char *type;
+	const char *help;
+	size_t off;		/* in struct statsdir */
+	double scale;
+} dirmetric[] = {
+	{ "vmnet_bytes_total", "counter", "Bytes in the frames relayed.",
+	  offsetof(struct statsdir, bytes), 1 },
+	{ "vmnet_frames_total", "counter", "Frames relayed.",
+	  offsetof(struct statsdir, frames), 1 },
+	{ "vmnet_reads_total", "counter", "read() calls on the input side.",
+	  offsetof(struct statsdir, reads), 1 },
+	{ "vmnet_writes_total", "counter",
+	  "write() calls on the output side.",
+	  offsetof(struct statsdir, writes), 1 },
+	{ "vmnet_partial_writes_total", "counter",
+	  "Writes that did not take all that was offered.",
+	  offsetof(struct statsdir, partial), 1 },
+	{ "vmnet_drops_total", "counter",
+	  "Frames dropped for lack of queue room.",
+	  offsetof(struct statsdir, drops), 1 },
+	{ "vmnet_blocked_seconds_total", "counter",
+	  "Time the input was held back by a full queue.",
+	  offsetof(struct statsdir, blocked), 0.001 },
+	{ "vmnet_queued_bytes", "gauge", "Bytes waiting to be relayed.",
+	  offsetof(struct statsdir, queued), 1 },
+	{ "vmnet_queued_bytes_max", "gauge",
+	  "Most bytes ever waiting to be relayed.",
+	  offsetof(struct statsdir, qhigh), 1 },
+};
+#define NDIRMETRIC (sizeof(dirmetric) / sizeof(dirmetric[0]))
+
+/* the perf=on counters, where the machine has them */
+static const struct {
+	const char *name;
+	const char *help;
+	size_t off;		/* in struct statsperf */
+	uint32_t have;
+	double scale;
+} perfmetric[] = {
+	{ "vmnet_cpu_cycles_total", "CPU cycles spent relaying.",
+	  offsetof(struct statsperf, cycles), PERF_CYCLES, 1 },
+	{ "vmnet_cpu_instructions_total", "Instructions spent relaying.",
+	  offsetof(struct statsperf, instructions), PERF_INSTR, 1 },
+	{ "vmnet_cpu_cache_misses_total", "Cache misses while relaying.",
+	  offsetof(struct statsperf, cachemisses), PERF_CACHEMISS, 1 },
+	{ "vmnet_context_switches_total", "Context switches of vmnet.",
+	  offsetof(struct statsperf, ctxswitches), PERF_CTXSW, 1 },
+	{ "vmnet_cpu_seconds_total", "CPU time spent relaying.",
+	  offsetof(struct statsperf, taskclock), PERF_TASKCLOCK, 1e-9 },
+};
+#define NPERFMETRIC (sizeof(perfmetric) / sizeof(perfmetric[0]))
+
+static const char *dirname[2] = { "from_guest", "to_guest" };
+static const double quantile[] = { 0.5, 0.99, 0.999 };
+
+static void labels(FILE *f, const struct vmstats *v)
+{
+	struct in_addr a;
+	const char *c;
+
+	a.s_addr = v->remote;
+	if (v->unit >= 0) {
+		fprintf(f, "session=\"sl%d\"", v->unit);
+	} else {
+		fprintf(f, "session=\"user\"");
+	}
+	fprintf(f, ",pid=\"%d\",remote=\"%s\",user=\"", (int)v->pid,
+		inet_ntoa(a));
+	for (c = v->username; *c; c++) {
+		if (*c == '"' || *c == '\\') {
+			putc('\\', f);
+		}
+		putc(*c, f);
+	}
+	putc('"', f);
+}
+
+/* The latency histograms, as a summary: quantiles, sum and count */
+static void latency(FILE *f, const struct vmstats *v, int n)
+{
+	const struct stathist *h;
+	size_t q;
+	int i, dir;
+
+	fprintf(f, "# HELP vmnet_latency_seconds Time frames spent inside "
+		"vmnet.\n# TYPE vmnet_latency_seconds summary\n");
+	for (i = 0; i < n; i++) {
+		for (dir = 0; dir < 2; dir++) {
+			h = &v[i].lat[dir];
+			for (q = 0; q < sizeof(quantile) / sizeof(quantile[0]);
+			    q++) {
+				fprintf(f, "vmnet_latency_seconds{");
+				labels(f, &v[i]);
+				fprintf(f, ",direction=\"%s\",quantile=\"%g\"} "
+					"%.6f\n", dirname[dir], quantile[q],
+					lat_quantile(h, quantile[q]) / 1e6);
+			}
+			fprintf(f, "vmnet_latency_seconds_sum{");
+			labels(f, &v[i]);
+			fprintf(f, ",direction=\"%s\"} %.6f\n", dirname[dir],
+				h->sum / 1e6);
+			fprintf(f, "vmnet_latency_seconds_count{");
+			labels(f, &v[i]);
+			fprintf(f, ",direction=\"%s\"} %llu\n", dirname[dir],
+				(unsigned long long)h->count);
+		}
+	}
+	fprintf(f, "# HELP vmnet_latency_seconds_max Longest time a frame "
+		"spent inside vmnet.\n"
+		"# TYPE vmnet_latency_seconds_max gauge\n");
+	for (i = 0; i < n; i++) {
+		for (dir = 0; dir < 2; dir++) {
+			fprintf(f, "vmnet_latency_seconds_max{");
+			labels(f, &v[i]);
+			fprintf(f, ",direction=\"%s\"} %.6f\n", dirname[dir],
+				v[i].lat[dir].max / 1e6);
+		}
+	}
+}
+
+/* The CPU cost counters of the sessions that have them */
+static void perf(FILE *f, const struct vmstats *v, int n)
+{
+	uint64_t val;
+	size_t m;
+	int i;
+
+	for (m = 0; m < NPERFMETRIC; m++) {
+		fprintf(f, "# HELP %s %s\n# TYPE %s counter\n",
+			perfmetric[m].name, perfmetric[m].help,
+			perfmetric[m].name);
+		for (i = 0; i < n; i++) {
+			if (!(v[i].perf.have & perfmetric[m].have)) {
+				continue;
+			}
+			val = *(uint64_t *)((char *)&v[i].perf
+				+ perfmetric[m].off);
+			fprintf(f, "%s{", perfmetric[m].name);
+			labels(f, &v[i]);
+			if (perfmetric[m].scale == 1) {
+				fprintf(f, "} %llu\n", (unsigned long long)val);
+			} else {
+				fprintf(f, "} %.6f\n", val * perfmetric[m].scale);
+			}
+		}
+	}
+}
+
+/* Stalls of the relay loop, and how long the current pass has been going */
+static void loop(FILE *f, const struct vmstats *v, int n)
+{
+	static const char *phase[] = STALL_NAMES;
+	struct timespec ts;
+	uint64_t ms, busy;
+	int i;
+
+	fprintf(f, "# HELP vmnet_stalls_total Passes of the relay loop "
+		"that took %d ms or more.\n"
+		"# TYPE vmnet_stalls_total counter\n", STALL_MS);
+	for (i = 0; i < n; i++) {
+		fprintf(f, "vmnet_stalls_total{");
+		labels(f, &v[i]);
+		fprintf(f, "} %llu\n", (unsigned long long)v[i].loop.stalls);
+	}
+	fprintf(f, "# HELP vmnet_stall_seconds_max Longest stall of the "
+		"relay loop.\n# TYPE vmnet_stall_seconds_max gauge\n");
+	for (i = 0; i < n; i++) {
+		fprintf(f, "vmnet_stall_seconds_max{");
+		labels(f, &v[i]);
+		fprintf(f, "} %.3f\n", v[i].loop.stallmax / 1e3);
+	}
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	ms = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+	fprintf(f, "# HELP vmnet_busy_seconds How long the relay loop has "
+		"been in its current pass, by what it is doing.\n"
+		"# TYPE vmnet_busy_seconds gauge\n");
+	for (i = 0; i < n; i++) {
+		busy = v[i].loop.busy;
+		if (busy == 0 || v[i].loop.phase >= sizeof(phase)
+		 / sizeof(phase[0])) {
+			continue;
+		}
+		fprintf(f, "vmnet_busy_seconds{");
+		labels(f, &v[i]);
+		fprintf(f, ",phase=\"%s\"} %.3f\n", phase[v[i].loop.phase],
+			ms > busy ? (ms - busy) / 1e3 : 0.0);
+	}
+}
+
+/* The whole answer to a scrape */
+static void metrics(FILE *f)
+{
+	struct vmstats *v;
+	uint64_t val;
+	size_t m;
+	int i, n, dir;
+
+	n = stats_collect(&v);
+	fprintf(f, "# HELP vmnet_sessions Running vmnet sessions.\n"
+		"# TYPE vmnet_sessions gauge\nvmnet_sessions %d\n", n);
+	fprintf(f, "# HELP vmnet_start_time_seconds When the session "
+		"started, in seconds since the epoch.\n"
+		"# TYPE vmnet_start_time_seconds gauge\n");
+	for (i = 0; i < n; i++) {
+		fprintf(f, "vmnet_start_time_seconds{");
+		labels(f, &v[i]);
+		fprintf(f, "} %u\n", v[i].start);
+	}
+	fprintf(f, "# HELP vmnet_wakeups_total Returns from select().\n"
+		"# TYPE vmnet_wakeups_total counter\n");
+	for (i = 0; i < n; i++) {
+		fprintf(f, "vmnet_wakeups_total{");
+		labels(f, &v[i]);
+		fprintf(f, "} %llu\n", (unsigned long long)v[i].wakeups);
+	}
+	for (m = 0; m < NDIRMETRIC; m++) {
+		fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", dirmetric[m].name,
+			dirmetric[m].help, dirmetric[m].name,
+			dirmetric[m].type);
+		for (i = 0; i < n; i++) {
+			for (dir = 0; dir < 2; dir++) {
+				val = *(uint64_t *)((char *)&v[i].dir[dir]
+					+ dirmetric[m].off);
+				fprintf(f, "%s{", dirmetric[m].name);
+				labels(f, &v[i]);
+				if (dirmetric[m].scale == 1) {
+					fprintf(f, ",direction=\"%s\"} %llu\n",
+						dirname[dir],
+						(unsigned long long)val);
+				} else {
+					fprintf(f, ",direction=\"%s\"} %.3f\n",
+						dirname[dir],
+						val * dirmetric[m].scale);
+				}
+			}
+		}
+	}
+	latency(f, v, n);
+	perf(f, v, n);
+	loop(f, v, n);
+	free(v);
+}
+
+static void sendall(int fd, const char *p, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0 && (r = send(fd, p, len, MSG_NOSIGNAL)) > 0) {
+		p += r;
+		len -= r;
+	}
+}
+
+/* Answer one HTTP request: GET /metrics, anything else is not found */
+static void serve(int fd)
+{
+	struct timeval tv = { 2, 0 };
+	char req[1024], head[256], *body = NULL;
+	size_t blen = 0;
+	int n = 0, r;
+	FILE *f;
+
+	/* a scraper that stops reading must not hold us up for long */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	while (n < (int)sizeof(req) - 1
+	    && (r = recv(fd, req + n, sizeof(req) - 1 - n, 0)) > 0) {
+		n += r;
+		req[n] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) {
+			break;
+		}
+	}
+	req[n] = '\0';
+	if (strncmp(req, "GET /metrics ", 13) && strncmp(req, "GET / ", 6)) {
+		snprintf(head, sizeof(head), "HTTP/1.0 404 Not Found\r\n"
+			"Content-Type: text/plain\r\nContent-Length: 10\r\n"
+			"Connection: close\r\n\r\nnot found\n");
+		sendall(fd, head, strlen(head));
+		return;
+	}
+	if ((f = open_memstream(&body, &blen)) == NULL) {
+		return;
+	}
+	metrics(f);
+	fclose(f);
+	snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %lu\r\nConnection: close\r\n\r\n",
+		(unsigned long)blen);
+	sendall(fd, head, strlen(head));
+	sendall(fd, body, blen);
+	free(body);
+}
+
+/* Open the listening socket: /PATH, or [ADDR:]PORT */
+static int listener(const char *where)
+{
+	struct sockaddr_un un;
+	struct sockaddr_in in;
+	const char *p;
+	int fd, port, on = 1;
+
+	if (where[0] == '/') {
+		memset(&un, 0, sizeof(un));
+		un.sun_family = AF_UNIX;
+		if (strlen(where) >= sizeof(un.sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		strcpy(un.sun_path, where);
+		unlink(where);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+			return -1;
+		}
+		if (bind(fd, (struct sockaddr *)&un, sizeof(un)) < 0
+		 || listen(fd, SOMAXCONN) < 0) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+	memset(&in, 0, sizeof(in));
+	in.sin_family = AF_INET;
+	in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((p = strrchr(where, ':')) != NULL) {
+		char addr[64];
+
+		if (p - where >= (int)sizeof(addr)) {
+			errno = EINVAL;
+			return -1;
+		}
+		memcpy(addr, where, p - where);
+		addr[p - where] = '\0';
+		if (inet_pton(AF_INET, addr, &in.sin_addr) != 1) {
+			errno = EINVAL;
+			return -1;
+		}
+		where = p + 1;
+	}
+	if ((port = atoi(where)) < 1 || port > 65535) {
+		errno = EINVAL;
+		return -1;
+	}
+	in.sin_port = htons(port);
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(fd, (struct sockaddr *)&in, sizeof(in)) < 0
+	 || listen(fd, SOMAXCONN) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* "vmnet -m WHERE": serve scrapes until a signal says stop */
+void metrics_serve(const char *where)
+{
+	int lfd, fd;
+
+	/* reading the segments takes no privileges */
+	if (setgid(getgid()) < 0 || setuid(getuid()) < 0) {
+		perror("vmnet: setuid");
+		exit(1);
+	}
+	if ((lfd = listener(where)) < 0) {
+		fprintf(stderr, "vmnet: metrics on %s: %s\n", where,
+			strerror(errno));
+		exit(1);
+	}
+	while (go) {
+		if ((fd = accept(lfd, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			perror("vmnet: accept");
+			break;
+		}
+		serve(fd);
+		close(fd);
+	}
+	close(lfd);
+	if (where[0] == '/') {
+		unlink(where);
+	}
+}
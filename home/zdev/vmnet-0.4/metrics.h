@@ -0,0 +1,15 @@
+/*
+ * VMnet -- metrics for Prometheus
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+void metrics_serve(const char *where);
+
+#endif
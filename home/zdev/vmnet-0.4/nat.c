@@ -0,0 +1,689 @@
+/*
+ * VMnet -- user mode NAT
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * "vmnet -u" gives a guest networking without any privileges: instead
+ * of handing the guest's packets to a SLIP interface, which only root
+ * can set up, vmnet plays the other end of each connection itself and
+ * carries the data over ordinary sockets of the user who runs it.
+ *
+ *  - UDP: one connected socket per guest address and port pair;
+ *  - ICMP echo: an unprivileged ping socket per echo id (this needs
+ *    the user's group in net.ipv4.ping_group_range);
+ *  - TCP: terminated in vmnet, see nattcp.c.
+ *
+ * Everything else is dropped.  So is whatever the guest sends to a
+ * broadcast or multicast address, and fragments.
+ *
+ * The guest picks its own address and simply routes everything over
+ * the SLIP link; no host interface is involved, and to the rest of the
+ * world all traffic comes from the host itself.
+ *
+ * Flows are found, and expire, through a connection tracking table
+ * (ct.c) of NAT_FLOWS entries; flow i is the one of entry i.  When it
+ * is full, a new flow pushes out one that is not a TCP connection.
+ *
+ * Ports on the host can be forwarded to the guest ("-p", see
+ * nat_forward()).  A connection accepted on one becomes a flow like
+ * any other, only we send the SYN; a datagram from a new client gets
+ * a socket of its own, bound to the same port and connected to the
+ * client, so its replies are sent and further datagrams found the
+ * same way as for outgoing flows.  Accepting and receiving is done
+ * NAT_ACCEPTS at a time, so a burst of clients costs few wakeups.
+ *
+ * The frames for the guest are collected in a short list that vmnet
+ * moves into the guest's queue.  Host sockets are only read while
+ * there is room in that list, so a slow guest slows the host side down
+ * rather than losing data.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "buf.h"
+#include "nat.h"
+
+#define NAT_PENDING	64	/* frames waiting to go to the guest */
+#define NAT_ACCEPTS	16	/* connections or datagrams per wakeup */
+
+struct natflow natflow[NAT_FLOWS];
+struct cttable natct;
+
+static struct {
+	unsigned char *frame;
+	int len;
+} pending[NAT_PENDING];
+static int phead, plen;
+static uint16_t ipid;
+
+/* forwarded ports */
+static struct natfwd {
+	int fd;			/* listening on the host */
+	int proto;
+	struct sockaddr_in addr;	/* the host address and port */
+	uint16_t gport;		/* the guest's port */
+} natfwd[NAT_FORWARDS];
+static int nfwd;
+static in_addr_t guest;		/* where they go */
+static in_addr_t loopback;	/* NAT_LOOPBACK */
+
+/* Close the flow's socket; its conntrack entry is the caller's business */
+static void nat_release(struct natflow *f)
+{
+	close(f->fd);
+	f->fd = -1;
+	free(f->buf);
+	f->buf = NULL;
+	free(f->rbuf);
+	f->rbuf = NULL;
+}
+
+/* A flow timed out, or makes room for another */
+static void nat_expire(struct cttable *ct, struct ctentry *e)
+{
+	struct natflow *f = &natflow[e - ct->ent];
+
+	if (f->proto == IPPROTO_TCP) {
+		tcp_abort(f);
+	}
+	nat_release(f);
+}
+
+int nat_open(slipconn *sc)
+{
+	int i;
+
+	for (i = 0; i < NAT_FLOWS; i++) {
+		natflow[i].fd = -1;
+	}
+	srandom(getpid() ^ nowms);
+	ipid = random();
+	guest = sc->remote;
+	inet_pton(AF_INET, NAT_LOOPBACK, &loopback);
+	if (ct_init(&natct, NAT_FLOWS, now, nat_expire) < 0) {
+		perror("vmnet: malloc");
+		exit(1);
+	}
+	return 0;
+}
+
+void nat_close(void)
+{
+	int i;
+
+	for (i = 0; i < NAT_FLOWS; i++) {
+		if (natflow[i].fd >= 0) {
+			if (natflow[i].proto == IPPROTO_TCP) {
+				tcp_abort(&natflow[i]);
+			}
+			nat_freeflow(&natflow[i]);
+		}
+	}
+	ct_free(&natct);
+	for (i = 0; i < nfwd; i++) {
+		close(natfwd[i].fd);
+	}
+	nfwd = 0;
+}
+
+uint16_t nat_cksum(uint32_t sum, const void *p, int len)
+{
+	const unsigned char *b = p;
+
+	for (; len > 1; len -= 2, b += 2) {
+		sum += b[0] << 8 | b[1];
+	}
+	if (len) {
+		sum += b[0] << 8;
+	}
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return htons(~sum & 0xffff);
+}
+
+/* Start of the TCP/UDP checksum: the pseudo header */
+uint32_t nat_pseudo(in_addr_t src, in_addr_t dst, int proto, int len)
+{
+	src = ntohl(src);
+	dst = ntohl(dst);
+	return (src >> 16) + (src & 0xffff) + (dst >> 16) + (dst & 0xffff)
+		+ proto + len;
+}
+
+static void nat_key(struct ctkey *k, int proto, in_addr_t gaddr,
+	uint16_t gport, in_addr_t haddr, uint16_t hport)
+{
+	memset(k, 0, sizeof(*k));
+	k->proto = proto;
+	k->saddr = gaddr;
+	k->sport = gport;
+	k->daddr = haddr;
+	k->dport = hport;
+}
+
+struct natflow *nat_flow(int proto, in_addr_t gaddr, uint16_t gport,
+	in_addr_t haddr, uint16_t hport)
+{
+	struct ctentry *e;
+	struct ctkey k;
+
+	nat_key(&k, proto, gaddr, gport, haddr, hport);
+	if ((e = ct_lookup(&natct, &k)) == NULL) {
+		return NULL;
+	}
+	return &natflow[e - natct.ent];
+}
+
+/*
+ * Make a flow for socket fd.  If the table is full and all flows are
+ * established TCP connections, the new one does not get in (and fd is
+ * closed).
+ */
+struct natflow *nat_newflow(int proto, in_addr_t gaddr, uint16_t gport,
+	in_addr_t haddr, uint16_t hport, int fd)
+{
+	struct natflow *f;
+	struct ctentry *e;
+	struct ctkey k;
+
+	nat_key(&k, proto, gaddr, gport, haddr, hport);
+	if ((e = ct_insert(&natct, &k)) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	f = &natflow[e - natct.ent];
+	memset(f, 0, sizeof(*f));
+	f->fd = fd;
+	f->proto = proto;
+	f->gaddr = gaddr;
+	f->gport = gport;
+	f->haddr = haddr;
+	f->hport = hport;
+	f->ct = e;
+	return f;
+}
+
+void nat_freeflow(struct natflow *f)
+{
+	ct_delete(&natct, f->ct);
+	nat_release(f);
+}
+
+/* Is there room for another frame to the guest? */
+int nat_room(void)
+{
+	return plen < NAT_PENDING;
+}
+
+/* A frame to fill in, from the IP payload at frame + 20 on */
+unsigned char *nat_frame(void)
+{
+	return framebuf_get();
+}
+
+/* Add the IP header to a frame with len bytes of payload, and send it */
+void nat_send(unsigned char *frame, int proto, in_addr_t src,
+	in_addr_t dst, int len)
+{
+	uint16_t v;
+
+	if (plen == NAT_PENDING) {
+		framebuf_put(frame);
+		return;
+	}
+	len += 20;
+	frame[0] = 0x45;
+	frame[1] = 0;
+	v = htons(len);
+	memcpy(frame + 2, &v, 2);
+	v = htons(ipid++);
+	memcpy(frame + 4, &v, 2);
+	frame[6] = 0x40;	/* don't fragment */
+	frame[7] = 0;
+	frame[8] = 64;
+	frame[9] = proto;
+	frame[10] = frame[11] = 0;
+	memcpy(frame + 12, &src, 4);
+	memcpy(frame + 16, &dst, 4);
+	v = nat_cksum(0, frame, 20);
+	memcpy(frame + 10, &v, 2);
+
+	pending[(phead + plen) % NAT_PENDING].frame = frame;
+	pending[(phead + plen) % NAT_PENDING].len = len;
+	plen++;
+}
+
+/* The next frame for the guest, or NULL */
+unsigned char *nat_next(int *len)
+{
+	unsigned char *frame;
+
+	if (plen == 0) {
+		return NULL;
+	}
+	frame = pending[phead].frame;
+	*len = pending[phead].len;
+	phead = (phead + 1) % NAT_PENDING;
+	plen--;
+	return frame;
+}
+
+/* A connected, non-blocking socket towards haddr */
+int nat_socket(int type, int proto, in_addr_t haddr, uint16_t hport)
+{
+	struct sockaddr_in sin;
+	int fd;
+
+	if ((fd = socket(AF_INET, type | SOCK_NONBLOCK, proto)) < 0) {
+		return -1;
+	}
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = haddr;
+	sin.sin_port = hport;
+	if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0
+	 && errno != EINPROGRESS) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void udp_input(const unsigned char *ip, int hl, int len)
+{
+	struct natflow *f;
+	in_addr_t gaddr, haddr;
+	uint16_t gport, hport;
+	int fd;
+
+	if (len < hl + 8) {
+		return;
+	}
+	memcpy(&gaddr, ip + 12, 4);
+	memcpy(&haddr, ip + 16, 4);
+	memcpy(&gport, ip + hl, 2);
+	memcpy(&hport, ip + hl + 2, 2);
+	if ((f = nat_flow(IPPROTO_UDP, gaddr, gport, haddr, hport)) == NULL) {
+		if ((fd = nat_socket(SOCK_DGRAM, 0, haddr, hport)) < 0
+		 || (f = nat_newflow(IPPROTO_UDP, gaddr, gport, haddr, hport,
+				fd)) == NULL) {
+			return;
+		}
+	}
+	ct_seen(&natct, f->ct, CT_ORIG, 0, len);
+	send(f->fd, ip + hl + 8, len - hl - 8, MSG_DONTWAIT);
+}
+
+/* Send the guest the datagram of n bytes at frame + 28 */
+static void udp_toguest(struct natflow *f, unsigned char *frame, int n)
+{
+	uint16_t v;
+
+	ct_seen(&natct, f->ct, CT_REPL, 0, n + 28);
+	memcpy(frame + 20, &f->hport, 2);
+	memcpy(frame + 22, &f->gport, 2);
+	v = htons(n + 8);
+	memcpy(frame + 24, &v, 2);
+	frame[26] = frame[27] = 0;
+	v = nat_cksum(nat_pseudo(f->haddr, f->gaddr, IPPROTO_UDP, n + 8),
+		frame + 20, n + 8);
+	if (v == 0) {
+		v = 0xffff;
+	}
+	memcpy(frame + 26, &v, 2);
+	nat_send(frame, IPPROTO_UDP, f->haddr, f->gaddr, n + 8);
+}
+
+static void udp_poll(struct natflow *f)
+{
+	unsigned char *frame;
+	int n;
+
+	while (nat_room()) {
+		frame = nat_frame();
+		n = recv(f->fd, frame + 28, SLIP_MAXFRAME - 28,
+			MSG_DONTWAIT | MSG_TRUNC);
+		if (n < 0 || n > 1500 - 28) {
+			/* nothing more, or too big for the guest's mtu */
+			framebuf_put(frame);
+			if (n < 0) {
+				return;
+			}
+			continue;
+		}
+		udp_toguest(f, frame, n);
+	}
+}
+
+static void icmp_input(const unsigned char *ip, int hl, int len)
+{
+	struct natflow *f;
+	in_addr_t gaddr, haddr;
+	uint16_t id;
+	int fd;
+
+	/* echo requests only */
+	if (len < hl + 8 || ip[hl] != 8) {
+		return;
+	}
+	memcpy(&gaddr, ip + 12, 4);
+	memcpy(&haddr, ip + 16, 4);
+	memcpy(&id, ip + hl + 4, 2);
+	if ((f = nat_flow(IPPROTO_ICMP, gaddr, id, haddr, 0)) == NULL) {
+		if ((fd = nat_socket(SOCK_DGRAM, IPPROTO_ICMP, haddr, 0)) < 0
+		 || (f = nat_newflow(IPPROTO_ICMP, gaddr, id, haddr, 0,
+				fd)) == NULL) {
+			return;
+		}
+	}
+	ct_seen(&natct, f->ct, CT_ORIG, 0, len);
+	/* the kernel puts in its own id, and the checksum */
+	send(f->fd, ip + hl, len - hl, MSG_DONTWAIT);
+}
+
+static void icmp_poll(struct natflow *f)
+{
+	unsigned char *frame;
+	uint16_t v;
+	int n;
+
+	while (nat_room()) {
+		frame = nat_frame();
+		n = recv(f->fd, frame + 20, 1500 - 20, MSG_DONTWAIT);
+		if (n < 8 || frame[20] != 0) {
+			framebuf_put(frame);
+			if (n < 0) {
+				return;
+			}
+			continue;
+		}
+		ct_seen(&natct, f->ct, CT_REPL, 0, n + 20);
+		/* back to the guest's echo id */
+		memcpy(frame + 24, &f->gport, 2);
+		frame[22] = frame[23] = 0;
+		v = nat_cksum(0, frame + 20, n);
+		memcpy(frame + 22, &v, 2);
+		nat_send(frame, IPPROTO_ICMP, f->haddr, f->gaddr, n);
+	}
+}
+
+/* A frame from the guest */
+void nat_input(slipconn *sc, const unsigned char *ip, int len)
+{
+	in_addr_t dst;
+	int hl, tot;
+
+	if (len < 20 || (ip[0] >> 4) != 4) {
+		return;
+	}
+	hl = (ip[0] & 0x0f) * 4;
+	tot = ip[2] << 8 | ip[3];
+	if (hl < 20 || tot < hl || tot > len
+	 || (ip[6] & 0x3f) || ip[7]) {
+		return;		/* bad, or a fragment */
+	}
+	memcpy(&dst, ip + 16, 4);
+	if (dst == INADDR_BROADCAST || IN_MULTICAST(ntohl(dst))) {
+		return;
+	}
+	switch (ip[9]) {
+	case IPPROTO_TCP:
+		tcp_input(ip, hl, tot);
+		break;
+	case IPPROTO_UDP:
+		udp_input(ip, hl, tot);
+		break;
+	case IPPROTO_ICMP:
+		icmp_input(ip, hl, tot);
+		break;
+	}
+}
+
+/*
+ * Forward a port on the host to the guest.  spec is
+ * PROTO:[ADDR:]HOSTPORT:GUESTPORT, e.g. "tcp:2222:22" or
+ * "udp:127.0.0.1:5353:53"; without ADDR the port is open on all of the
+ * host's addresses.  Returns -1 if it does not parse (errno EINVAL) or
+ * the port cannot be had.
+ */
+int nat_forward(const char *spec)
+{
+	char buf[128], *field[4], *p;
+	struct natfwd *w = &natfwd[nfwd];
+	int n, port[2], on = 1;
+
+	if (nfwd == NAT_FORWARDS || strlen(spec) >= sizeof(buf)) {
+		errno = EINVAL;
+		return -1;
+	}
+	strcpy(buf, spec);
+	for (n = 0, p = buf; n < 4 && p != NULL; n++) {
+		field[n] = p;
+		if ((p = strchr(p, ':')) != NULL) {
+			*p++ = '\0';
+		}
+	}
+	memset(&w->addr, 0, sizeof(w->addr));
+	w->addr.sin_family = AF_INET;
+	if (p != NULL || n < 3
+	 || (n == 4 && inet_pton(AF_INET, field[1], &w->addr.sin_addr) != 1)
+	 || (port[0] = atoi(field[n - 2])) < 1 || port[0] > 65535
+	 || (port[1] = atoi(field[n - 1])) < 1 || port[1] > 65535) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!strcmp(field[0], "tcp")) {
+		w->proto = IPPROTO_TCP;
+	} else if (!strcmp(field[0], "udp")) {
+		w->proto = IPPROTO_UDP;
+	} else {
+		errno = EINVAL;
+		return -1;
+	}
+	w->addr.sin_port = htons(port[0]);
+	w->gport = htons(port[1]);
+
+	w->fd = socket(AF_INET, SOCK_NONBLOCK | (w->proto == IPPROTO_TCP
+		? SOCK_STREAM : SOCK_DGRAM), 0);
+	if (w->fd < 0) {
+		return -1;
+	}
+	setsockopt(w->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (w->proto == IPPROTO_UDP) {
+		/* the clients' own sockets share the port */
+		setsockopt(w->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	}
+	if (bind(w->fd, (struct sockaddr *)&w->addr, sizeof(w->addr)) < 0
+	 || (w->proto == IPPROTO_TCP && listen(w->fd, SOMAXCONN) < 0)) {
+		close(w->fd);
+		return -1;
+	}
+	nfwd++;
+	return 0;
+}
+
+/* The address the guest sees a client of a forwarded port at */
+static in_addr_t fwd_peer(in_addr_t a)
+{
+	return (ntohl(a) >> 24) == 127 ? loopback : a;
+}
+
+static void fwd_accept(struct natfwd *w)
+{
+	struct sockaddr_in sin;
+	struct natflow *f;
+	socklen_t len;
+	in_addr_t peer;
+	int i, fd;
+
+	for (i = 0; i < NAT_ACCEPTS && nat_room(); i++) {
+		len = sizeof(sin);
+		fd = accept4(w->fd, (struct sockaddr *)&sin, &len,
+			SOCK_NONBLOCK);
+		if (fd < 0) {
+			return;
+		}
+		peer = fwd_peer(sin.sin_addr.s_addr);
+		if (nat_flow(IPPROTO_TCP, guest, w->gport, peer, sin.sin_port)
+				!= NULL) {
+			close(fd);
+			continue;
+		}
+		if ((f = nat_newflow(IPPROTO_TCP, guest, w->gport, peer,
+				sin.sin_port, fd)) != NULL) {
+			tcp_open(f);
+		}
+	}
+}
+
+/* A socket for a new client of a forwarded UDP port */
+static int fwd_socket(struct natfwd *w, struct sockaddr_in *sin)
+{
+	int fd, on = 1;
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0) {
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	if (bind(fd, (struct sockaddr *)&w->addr, sizeof(w->addr)) < 0
+	 || connect(fd, (struct sockaddr *)sin, sizeof(*sin)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void fwd_recv(struct natfwd *w)
+{
+	struct sockaddr_in sin;
+	struct natflow *f;
+	unsigned char *frame;
+	socklen_t len;
+	in_addr_t peer;
+	int i, n, fd;
+
+	for (i = 0; i < NAT_ACCEPTS && nat_room(); i++) {
+		frame = nat_frame();
+		len = sizeof(sin);
+		n = recvfrom(w->fd, frame + 28, SLIP_MAXFRAME - 28,
+			MSG_DONTWAIT | MSG_TRUNC, (struct sockaddr *)&sin,
+			&len);
+		if (n < 0 || n > 1500 - 28) {
+			framebuf_put(frame);
+			if (n < 0) {
+				return;
+			}
+			continue;
+		}
+		peer = fwd_peer(sin.sin_addr.s_addr);
+		f = nat_flow(IPPROTO_UDP, guest, w->gport, peer, sin.sin_port);
+		if (f == NULL && ((fd = fwd_socket(w, &sin)) < 0
+		    || (f = nat_newflow(IPPROTO_UDP, guest, w->gport, peer,
+				sin.sin_port, fd)) == NULL)) {
+			framebuf_put(frame);
+			continue;
+		}
+		udp_toguest(f, frame, n);
+	}
+}
+
+/* Which sockets to wait for; returns the new maxfd */
+int nat_fdset(fd_set *rfds, fd_set *wfds, int maxfd)
+{
+	struct natflow *f;
+	int i;
+
+	for (i = 0; i < nfwd && nat_room(); i++) {
+		FD_SET(natfwd[i].fd, rfds);
+		if (natfwd[i].fd > maxfd) {
+			maxfd = natfwd[i].fd;
+		}
+	}
+	for (f = natflow; f < natflow + NAT_FLOWS; f++) {
+		if (f->fd < 0) {
+			continue;
+		}
+		if (f->proto == IPPROTO_TCP) {
+			tcp_fdset(f, rfds, wfds);
+		} else if (nat_room()) {
+			FD_SET(f->fd, rfds);
+		}
+		if (f->fd > maxfd) {
+			maxfd = f->fd;
+		}
+	}
+	return maxfd;
+}
+
+/* Serve the sockets that are ready, and expire what is idle */
+void nat_poll(fd_set *rfds, fd_set *wfds)
+{
+	struct natflow *f;
+	int i, rd, wr;
+
+	ct_expire(&natct, now);
+	for (i = 0; i < nfwd; i++) {
+		if (!FD_ISSET(natfwd[i].fd, rfds)) {
+			continue;
+		}
+		if (natfwd[i].proto == IPPROTO_TCP) {
+			fwd_accept(&natfwd[i]);
+		} else {
+			fwd_recv(&natfwd[i]);
+		}
+	}
+	for (f = natflow; f < natflow + NAT_FLOWS; f++) {
+		if (f->fd < 0) {
+			continue;
+		}
+		rd = FD_ISSET(f->fd, rfds);
+		wr = FD_ISSET(f->fd, wfds);
+		switch (f->proto) {
+		case IPPROTO_TCP:
+			tcp_poll(f, rd, wr);
+			break;
+		case IPPROTO_UDP:
+			if (rd) {
+				udp_poll(f);
+			}
+			break;
+		case IPPROTO_ICMP:
+			if (rd) {
+				icmp_poll(f);
+			}
+			break;
+		}
+	}
+}
+
+/* Milliseconds until a TCP flow needs attention, -1 for none */
+int nat_wait(void)
+{
+	struct natflow *f;
+	int ms = -1, w;
+
+	for (f = natflow; f < natflow + NAT_FLOWS; f++) {
+		if (f->fd >= 0 && f->proto == IPPROTO_TCP && f->rto) {
+			w = (int)(f->rto - nowms) > 0 ? f->rto - nowms : 0;
+			if (ms < 0 || w < ms) {
+				ms = w;
+			}
+		}
+	}
+	/* and once a second for expiry, if anything is open */
+	if (ms < 0 && natct.count > 0) {
+		ms = 1000;
+	}
+	return ms;
+}
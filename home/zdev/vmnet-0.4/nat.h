@@ -0,0 +1,96 @@
+/*
+ * VMnet -- user mode NAT
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef NAT_H
+#define NAT_H
+
+#include <stdint.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+
+#include "ct.h"
+#include "vmnet.h"
+
+/* natflow.state, TCP only */
+#define NT_CONNECT	1	/* guest sent a SYN, connect() in progress */
+#define NT_SYNACK	2	/* connected, SYN-ACK sent to the guest */
+#define NT_OPEN		3	/* established */
+#define NT_SYNSENT	4	/* forwarded port: we sent the guest a SYN */
+
+/* natflow.flags */
+#define NF_GUESTFIN	0x01	/* the guest sent a FIN */
+#define NF_HOSTEOF	0x02	/* the host side has no more to send */
+#define NF_FINSENT	0x04	/* our FIN is out, at snd_nxt - 1 */
+#define NF_FINACKED	0x08	/* and the guest acked it */
+#define NF_WSCALE	0x10	/* window scaling agreed with the guest */
+
+struct natflow {
+	int fd;			/* host socket, -1 if the slot is free */
+	uint8_t proto;
+	uint8_t state;
+	uint8_t flags;
+	uint8_t retries;
+	in_addr_t gaddr;	/* guest side */
+	in_addr_t haddr;	/* host side, where the guest sent it */
+	uint16_t gport;		/* ports, or the guest's ICMP echo id */
+	uint16_t hport;
+	struct ctentry *ct;	/* its entry in natct, the same number */
+
+	/* TCP only, sequence numbers as the guest sees them */
+	uint32_t snd_una;	/* first byte in buf */
+	uint32_t snd_nxt;
+	uint32_t snd_wnd;	/* the guest's window */
+	uint32_t rcv_nxt;	/* next byte expected from the guest */
+	uint32_t rto;		/* nowms to resend at, 0 if nothing is out */
+	uint32_t rcv_wnd;	/* window we last offered, in bytes */
+	uint16_t mss;		/* the guest's */
+	uint8_t snd_shift;	/* window scale, the guest's */
+	uint8_t rcv_shift;	/* and ours */
+	unsigned char *buf;	/* ring of NAT_TCPBUF bytes from the host */
+	uint32_t head;
+	uint32_t len;
+	unsigned char *rbuf;	/* and from the guest, if the host socket */
+	uint32_t rhead;		/* did not take it all at once */
+	uint32_t rlen;
+};
+
+/* nat.c */
+int nat_open(slipconn *sc);
+int nat_forward(const char *spec);
+void nat_close(void);
+void nat_input(slipconn *sc, const unsigned char *frame, int len);
+int nat_fdset(fd_set *rfds, fd_set *wfds, int maxfd);
+void nat_poll(fd_set *rfds, fd_set *wfds);
+int nat_wait(void);
+unsigned char *nat_next(int *len);
+
+/* between nat.c and nattcp.c */
+extern struct natflow natflow[NAT_FLOWS];
+extern struct cttable natct;
+struct natflow *nat_flow(int proto, in_addr_t gaddr, uint16_t gport,
+	in_addr_t haddr, uint16_t hport);
+struct natflow *nat_newflow(int proto, in_addr_t gaddr, uint16_t gport,
+	in_addr_t haddr, uint16_t hport, int fd);
+void nat_freeflow(struct natflow *f);
+int nat_socket(int type, int proto, in_addr_t haddr, uint16_t hport);
+int nat_room(void);
+unsigned char *nat_frame(void);
+void nat_send(unsigned char *frame, int proto, in_addr_t src,
+	in_addr_t dst, int len);
+uint16_t nat_cksum(uint32_t sum, const void *p, int len);
+uint32_t nat_pseudo(in_addr_t src, in_addr_t dst, int proto, int len);
+
+/* nattcp.c */
+void tcp_input(const unsigned char *ip, int hl, int len);
+void tcp_open(struct natflow *f);
+void tcp_poll(struct natflow *f, int rd, int wr);
+void tcp_fdset(struct natflow *f, fd_set *rfds, fd_set *wfds);
+void tcp_abort(struct natflow *f);
+
+#endif
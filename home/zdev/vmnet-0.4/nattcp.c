@@ -0,0 +1,636 @@
+/*
+ * VMnet -- user mode NAT, TCP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * The guest's TCP connections end in vmnet: when the guest sends a SYN
+ * we connect() a host socket to where it was going, and only answer
+ * with a SYN-ACK once that worked (or with a RST if it did not).  From
+ * then on we are the guest's peer.  What the guest sends goes straight
+ * into the host socket; whatever the socket does not take at once is
+ * kept in a ring buffer until it does, and the window we offer the
+ * guest is the room left in that ring, so nothing sent within it is
+ * lost.  What the host sends is read into another ring and sent on as
+ * the guest's window allows, and kept until the guest has acked it.
+ *
+ * Both rings are NAT_TCPBUF bytes, and if the guest does window scaling
+ * we offer it all.  So an old guest stack with a small window only has
+ * to cover the short hop to vmnet, while the host's TCP, with its own
+ * large and self-tuning buffers, deals with the long haul.  The data
+ * cannot be spliced from socket to socket: towards the guest it is
+ * checksummed and SLIP framed, so it goes through our memory anyway.
+ *
+ * For a connection accepted on a forwarded port it is the other way
+ * around: the host socket is there already, we send the guest a SYN,
+ * and once its SYN-ACK is in, everything goes as above.
+ *
+ * This is as little TCP as we can get away with.  The link to the
+ * guest is a pipe to the emulator, which does not lose or reorder
+ * anything, so there is no congestion control, and out of order
+ * segments are just dropped (the duplicate ack makes the guest resend).
+ * Anything that is not acked in time is resent, from the first
+ * unacked byte on.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "buf.h"
+#include "nat.h"
+
+#define NAT_MSS		1460	/* what fits in the SLIP mtu of 1500 */
+#define NAT_RTO		500	/* ms before the first resend */
+#define NAT_RETRIES	8	/* resends before giving up on the guest */
+
+static uint32_t get32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return ntohl(v);
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(p, &v, 4);
+}
+
+/*
+ * Send the guest a segment.  The frame has hlen - 20 bytes of options
+ * and dlen bytes of data in place, after the IP and TCP headers.
+ */
+static void tcp_send(struct natflow *f, unsigned char *frame, int flags,
+	uint32_t seq, int hlen, int dlen)
+{
+	unsigned char *t = frame + 20;
+	uint32_t win;
+	uint16_t v;
+	int shift;
+
+	memcpy(t, &f->hport, 2);
+	memcpy(t + 2, &f->gport, 2);
+	put32(t + 4, seq);
+	put32(t + 8, f->rcv_nxt);
+	t[12] = hlen / 4 << 4;
+	t[13] = flags;
+	/* the room we have for the guest's data; a SYN is never scaled */
+	shift = flags & TH_SYN ? 0 : f->rcv_shift;
+	win = NAT_TCPBUF - f->rlen;
+	if (win >> shift > 65535) {
+		win = 65535 << shift;
+	}
+	f->rcv_wnd = win >> shift << shift;
+	v = htons(win >> shift);
+	memcpy(t + 14, &v, 2);
+	t[16] = t[17] = t[18] = t[19] = 0;
+	v = nat_cksum(nat_pseudo(f->haddr, f->gaddr, IPPROTO_TCP,
+		hlen + dlen), t, hlen + dlen);
+	memcpy(t + 16, &v, 2);
+	if (f->ct != NULL) {
+		ct_seen(&natct, f->ct, CT_REPL, flags, 20 + hlen + dlen);
+	}
+	nat_send(frame, IPPROTO_TCP, f->haddr, f->gaddr, hlen + dlen);
+}
+
+static void tcp_ack(struct natflow *f)
+{
+	if (nat_room()) {
+		tcp_send(f, nat_frame(), TH_ACK, f->snd_nxt, 20, 0);
+	}
+}
+
+/* Window scale that lets us offer all of NAT_TCPBUF */
+static int tcp_wshift(void)
+{
+	int shift;
+
+	for (shift = 0; NAT_TCPBUF >> shift > 65535; shift++)
+		;
+	return shift;
+}
+
+/* Our SYN, to the guest, for a forwarded port */
+static void tcp_syn(struct natflow *f)
+{
+	unsigned char *frame;
+
+	if (!nat_room()) {
+		return;
+	}
+	frame = nat_frame();
+	frame[40] = TCPOPT_MAXSEG;
+	frame[41] = TCPOLEN_MAXSEG;
+	frame[42] = NAT_MSS >> 8;
+	frame[43] = NAT_MSS & 0xff;
+	frame[44] = TCPOPT_NOP;
+	frame[45] = TCPOPT_WINDOW;
+	frame[46] = TCPOLEN_WINDOW;
+	frame[47] = tcp_wshift();
+	tcp_send(f, frame, TH_SYN, f->snd_una, 28, 0);
+}
+
+static void tcp_synack(struct natflow *f)
+{
+	unsigned char *frame;
+	int hlen = 24;
+
+	if (!nat_room()) {
+		return;
+	}
+	frame = nat_frame();
+	frame[40] = TCPOPT_MAXSEG;
+	frame[41] = TCPOLEN_MAXSEG;
+	frame[42] = NAT_MSS >> 8;
+	frame[43] = NAT_MSS & 0xff;
+	if (f->flags & NF_WSCALE) {
+		frame[44] = TCPOPT_NOP;
+		frame[45] = TCPOPT_WINDOW;
+		frame[46] = TCPOLEN_WINDOW;
+		frame[47] = f->rcv_shift;
+		hlen = 28;
+	}
+	tcp_send(f, frame, TH_SYN|TH_ACK, f->snd_una, hlen, 0);
+}
+
+/* Have the host side reset rather than closed when we close it */
+static void tcp_linger0(struct natflow *f)
+{
+	struct linger l;
+
+	l.l_onoff = 1;
+	l.l_linger = 0;
+	setsockopt(f->fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+}
+
+/* Reset both sides of the connection; the caller frees the flow */
+void tcp_abort(struct natflow *f)
+{
+	if (nat_room()) {
+		tcp_send(f, nat_frame(), TH_RST|TH_ACK, f->snd_nxt, 20, 0);
+	}
+	tcp_linger0(f);
+}
+
+/*
+ * Answer a segment that belongs to no connection with a RST.  There is
+ * no entry in natct for it (or no room for one), so the flow made up
+ * here has no ct, and the reply is not counted.
+ */
+static void tcp_refuse(in_addr_t gaddr, uint16_t gport, in_addr_t haddr,
+	uint16_t hport, uint32_t seq, uint32_t ack, int acked)
+{
+	struct natflow f;
+
+	if (!nat_room()) {
+		return;
+	}
+	memset(&f, 0, sizeof(f));
+	f.gaddr = gaddr;
+	f.gport = gport;
+	f.haddr = haddr;
+	f.hport = hport;
+	f.rcv_nxt = seq;
+	tcp_send(&f, nat_frame(), acked ? TH_RST : TH_RST|TH_ACK,
+		acked ? ack : 0, 20, 0);
+}
+
+/* The guest's MSS and window scale options, from its SYN */
+static void tcp_options(struct natflow *f, const unsigned char *t, int doff)
+{
+	int i, mss = 536;
+
+	for (i = 20; i < doff && t[i] != TCPOPT_EOL; ) {
+		if (t[i] == TCPOPT_NOP) {
+			i++;
+			continue;
+		}
+		if (i + 1 >= doff || t[i + 1] < 2) {
+			break;
+		}
+		if (t[i] == TCPOPT_MAXSEG && t[i + 1] == TCPOLEN_MAXSEG
+		 && i + 4 <= doff) {
+			mss = t[i + 2] << 8 | t[i + 3];
+		}
+		if (t[i] == TCPOPT_WINDOW && t[i + 1] == TCPOLEN_WINDOW
+		 && i + 3 <= doff) {
+			f->flags |= NF_WSCALE;
+			f->snd_shift = t[i + 2] > 14 ? 14 : t[i + 2];
+		}
+		i += t[i + 1];
+	}
+	f->mss = mss < 64 ? 64 : mss > NAT_MSS ? NAT_MSS : mss;
+	f->rcv_shift = f->flags & NF_WSCALE ? tcp_wshift() : 0;
+}
+
+/*
+ * Send what the guest's window allows of what we have from the host,
+ * and our FIN once the host is done.  Returns the number of segments.
+ */
+static int tcp_push(struct natflow *f)
+{
+	unsigned char *frame;
+	uint32_t off, n, pos;
+	int sent = 0;
+
+	if (f->state != NT_OPEN) {
+		return 0;
+	}
+	while (nat_room() && !(f->flags & NF_FINSENT)) {
+		off = f->snd_nxt - f->snd_una;
+		if (off == f->len) {
+			if (f->flags & NF_HOSTEOF) {
+				tcp_send(f, nat_frame(), TH_FIN|TH_ACK,
+					f->snd_nxt++, 20, 0);
+				f->flags |= NF_FINSENT;
+				sent++;
+			}
+			break;
+		}
+		if (off >= f->snd_wnd) {
+			break;
+		}
+		n = f->len - off;
+		if (n > f->mss) {
+			n = f->mss;
+		}
+		if (n > f->snd_wnd - off) {
+			n = f->snd_wnd - off;
+		}
+		frame = nat_frame();
+		pos = (f->head + off) % NAT_TCPBUF;
+		if (pos + n <= NAT_TCPBUF) {
+			memcpy(frame + 40, f->buf + pos, n);
+		} else {
+			memcpy(frame + 40, f->buf + pos, NAT_TCPBUF - pos);
+			memcpy(frame + 40 + NAT_TCPBUF - pos, f->buf,
+				n - (NAT_TCPBUF - pos));
+		}
+		tcp_send(f, frame, off + n == f->len ? TH_ACK|TH_PUSH : TH_ACK,
+			f->snd_nxt, 20, n);
+		f->snd_nxt += n;
+		sent++;
+	}
+	if (f->rto == 0 && (f->snd_nxt != f->snd_una
+	    || (f->len > 0 && f->snd_wnd == 0))) {
+		/* something to resend, or a zero window to probe */
+		f->rto = nowms + NAT_RTO;
+	}
+	return sent;
+}
+
+/* Process the guest's ack and window */
+static void tcp_acked(struct natflow *f, uint32_t ack, uint32_t win)
+{
+	uint32_t acked;
+
+	if (f->state == NT_SYNACK) {
+		if (ack != f->snd_una + 1) {
+			return;
+		}
+		f->state = NT_OPEN;
+		f->snd_una = ack;
+		f->rto = 0;
+		f->retries = 0;
+	}
+	f->snd_wnd = win << f->snd_shift;
+	acked = ack - f->snd_una;
+	if (acked == 0 || acked > f->snd_nxt - f->snd_una) {
+		return;
+	}
+	if ((f->flags & NF_FINSENT) && ack == f->snd_nxt) {
+		f->flags |= NF_FINACKED;
+		acked--;
+	}
+	f->head = (f->head + acked) % NAT_TCPBUF;
+	f->len -= acked;
+	f->snd_una = ack;
+	f->retries = 0;
+	f->rto = f->snd_una != f->snd_nxt ? nowms + NAT_RTO : 0;
+}
+
+/*
+ * Pass data from the guest on to the host socket, keeping what it does
+ * not take in rbuf.  Returns how much of it we took, -1 on errors.
+ */
+static int tcp_take(struct natflow *f, const unsigned char *p, int len)
+{
+	uint32_t tail, n;
+	int w = 0;
+
+	if (f->rlen == 0) {
+		/* the usual case: nothing waiting, straight through */
+		if ((w = write(f->fd, p, len)) < 0) {
+			if (errno != EAGAIN) {
+				return -1;
+			}
+			w = 0;
+		}
+		if (w == len) {
+			return w;
+		}
+		p += w;
+		len -= w;
+	}
+	if (f->rbuf == NULL && (f->rbuf = malloc(NAT_TCPBUF)) == NULL) {
+		return w;	/* the guest will send the rest again */
+	}
+	if (len > NAT_TCPBUF - f->rlen) {
+		len = NAT_TCPBUF - f->rlen;
+	}
+	tail = (f->rhead + f->rlen) % NAT_TCPBUF;
+	n = NAT_TCPBUF - tail;
+	if (n >= len) {
+		memcpy(f->rbuf + tail, p, len);
+	} else {
+		memcpy(f->rbuf + tail, p, n);
+		memcpy(f->rbuf, p + n, len - n);
+	}
+	f->rlen += len;
+	return w + len;
+}
+
+/* The host socket has room again: write what we kept for it */
+static int tcp_flush(struct natflow *f)
+{
+	uint32_t n;
+	int w;
+
+	while (f->rlen > 0) {
+		n = NAT_TCPBUF - f->rhead;
+		if (n > f->rlen) {
+			n = f->rlen;
+		}
+		if ((w = write(f->fd, f->rbuf + f->rhead, n)) < 0) {
+			if (errno != EAGAIN) {
+				return -1;
+			}
+			break;
+		}
+		f->rhead = (f->rhead + w) % NAT_TCPBUF;
+		f->rlen -= w;
+		if (w < n) {
+			break;
+		}
+	}
+	if (f->rlen == 0 && (f->flags & NF_GUESTFIN)) {
+		shutdown(f->fd, SHUT_WR);
+	}
+	/* a guest short of window may be waiting to hear of the room */
+	if (NAT_TCPBUF - f->rlen >= f->rcv_wnd + NAT_TCPBUF / 4) {
+		tcp_ack(f);
+	}
+	return 0;
+}
+
+/* Both sides are done: forget the connection */
+static int tcp_done(struct natflow *f)
+{
+	if ((f->flags & (NF_GUESTFIN|NF_FINACKED))
+			== (NF_GUESTFIN|NF_FINACKED) && f->rlen == 0) {
+		nat_freeflow(f);
+		return 1;
+	}
+	return 0;
+}
+
+/* A segment from the guest */
+void tcp_input(const unsigned char *ip, int hl, int len)
+{
+	const unsigned char *t = ip + hl;
+	struct natflow *f;
+	in_addr_t gaddr, haddr;
+	uint16_t gport, hport;
+	uint32_t seq, ack;
+	int flags, doff, dlen, fd, n;
+
+	if (len < hl + 20) {
+		return;
+	}
+	doff = (t[12] >> 4) * 4;
+	if (doff < 20 || hl + doff > len) {
+		return;
+	}
+	memcpy(&gaddr, ip + 12, 4);
+	memcpy(&haddr, ip + 16, 4);
+	memcpy(&gport, t, 2);
+	memcpy(&hport, t + 2, 2);
+	seq = get32(t + 4);
+	ack = get32(t + 8);
+	flags = t[13];
+	dlen = len - hl - doff;
+
+	if ((f = nat_flow(IPPROTO_TCP, gaddr, gport, haddr, hport)) == NULL) {
+		if ((flags & (TH_SYN|TH_ACK|TH_RST)) != TH_SYN) {
+			if (!(flags & TH_RST)) {
+				tcp_refuse(gaddr, gport, haddr, hport,
+					seq + dlen + !!(flags & TH_SYN)
+					+ !!(flags & TH_FIN),
+					ack, flags & TH_ACK);
+			}
+			return;
+		}
+		if ((fd = nat_socket(SOCK_STREAM, 0, haddr, hport)) < 0
+		 || (f = nat_newflow(IPPROTO_TCP, gaddr, gport, haddr, hport,
+				fd)) == NULL) {
+			tcp_refuse(gaddr, gport, haddr, hport, seq + 1, 0, 0);
+			return;
+		}
+		ct_seen(&natct, f->ct, CT_ORIG, flags, len);
+		f->state = NT_CONNECT;
+		f->rcv_nxt = seq + 1;
+		tcp_options(f, t, doff);
+		return;
+	}
+
+	ct_seen(&natct, f->ct, CT_ORIG, flags, len);
+	if (flags & TH_RST) {
+		tcp_linger0(f);
+		nat_freeflow(f);
+		return;
+	}
+	if (f->state == NT_SYNSENT) {
+		/* the guest's answer to our SYN */
+		if ((flags & (TH_SYN|TH_ACK)) != (TH_SYN|TH_ACK)
+		 || ack != f->snd_una + 1) {
+			return;
+		}
+		tcp_options(f, t, doff);
+		f->state = NT_OPEN;
+		f->snd_una = ack;
+		f->snd_wnd = t[14] << 8 | t[15];	/* not scaled */
+		f->rcv_nxt = seq + 1;
+		f->rto = 0;
+		f->retries = 0;
+		if (tcp_push(f) == 0) {
+			tcp_ack(f);
+		}
+		return;
+	}
+	if (flags & TH_SYN) {
+		/* the guest did not get our SYN-ACK */
+		if (f->state == NT_SYNACK) {
+			tcp_synack(f);
+		}
+		return;
+	}
+	if (!(flags & TH_ACK) || f->state == NT_CONNECT) {
+		return;
+	}
+	tcp_acked(f, ack, t[14] << 8 | t[15]);
+	if (f->state != NT_OPEN) {
+		return;
+	}
+
+	if (dlen > 0 && seq == f->rcv_nxt && !(f->flags & NF_GUESTFIN)) {
+		if ((n = tcp_take(f, t + doff, dlen)) < 0) {
+			tcp_abort(f);
+			nat_freeflow(f);
+			return;
+		}
+		f->rcv_nxt += n;
+	}
+	if ((flags & TH_FIN) && seq + dlen == f->rcv_nxt
+	 && !(f->flags & NF_GUESTFIN)) {
+		f->rcv_nxt++;
+		f->flags |= NF_GUESTFIN;
+		if (f->rlen == 0) {
+			shutdown(f->fd, SHUT_WR);
+		}
+	}
+	if (tcp_push(f) == 0 && (dlen > 0 || (flags & TH_FIN))) {
+		tcp_ack(f);
+	}
+	tcp_done(f);
+}
+
+/* The connect() finished, one way or the other */
+static void tcp_connected(struct natflow *f)
+{
+	socklen_t len = sizeof(int);
+	int err;
+
+	if (getsockopt(f->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err
+	 || (f->buf = malloc(NAT_TCPBUF)) == NULL) {
+		tcp_abort(f);
+		nat_freeflow(f);
+		return;
+	}
+	f->state = NT_SYNACK;
+	f->snd_una = random();
+	f->snd_nxt = f->snd_una + 1;
+	tcp_synack(f);
+	f->rto = nowms + NAT_RTO;
+}
+
+/* Connect to the guest, for a connection to a forwarded port */
+void tcp_open(struct natflow *f)
+{
+	if ((f->buf = malloc(NAT_TCPBUF)) == NULL) {
+		tcp_linger0(f);
+		nat_freeflow(f);
+		return;
+	}
+	f->state = NT_SYNSENT;
+	f->mss = 536;
+	f->snd_una = random();
+	f->snd_nxt = f->snd_una + 1;
+	tcp_syn(f);
+	f->rto = nowms + NAT_RTO;
+}
+
+/* Nothing was acked in time: go back to the first unacked byte */
+static void tcp_timer(struct natflow *f)
+{
+	if (f->rto == 0 || (int)(nowms - f->rto) < 0) {
+		return;
+	}
+	if (++f->retries > NAT_RETRIES) {
+		tcp_abort(f);
+		nat_freeflow(f);
+		return;
+	}
+	f->rto = nowms + (NAT_RTO << (f->retries < 4 ? f->retries : 4));
+	if (f->state == NT_SYNACK) {
+		tcp_synack(f);
+		return;
+	}
+	if (f->state == NT_SYNSENT) {
+		tcp_syn(f);
+		return;
+	}
+	f->snd_nxt = f->snd_una;
+	f->flags &= ~NF_FINSENT;
+	if (f->snd_wnd == 0) {
+		f->snd_wnd = 1;		/* probe the zero window */
+	}
+	tcp_push(f);
+}
+
+void tcp_fdset(struct natflow *f, fd_set *rfds, fd_set *wfds)
+{
+	if (f->state == NT_CONNECT) {
+		FD_SET(f->fd, wfds);
+		return;
+	}
+	if (f->state == NT_SYNSENT) {
+		return;		/* the guest first */
+	}
+	if (f->rlen > 0) {
+		FD_SET(f->fd, wfds);
+	}
+	if (!(f->flags & NF_HOSTEOF) && f->len < NAT_TCPBUF && nat_room()) {
+		FD_SET(f->fd, rfds);
+	}
+}
+
+void tcp_poll(struct natflow *f, int rd, int wr)
+{
+	uint32_t tail, space;
+	int n;
+
+	if (f->state == NT_CONNECT) {
+		if (wr) {
+			tcp_connected(f);
+		}
+		return;
+	}
+	if (f->state == NT_SYNSENT) {
+		tcp_timer(f);
+		return;
+	}
+	if (wr && f->rlen > 0 && tcp_flush(f) < 0) {
+		tcp_abort(f);
+		nat_freeflow(f);
+		return;
+	}
+	if (rd) {
+		tail = (f->head + f->len) % NAT_TCPBUF;
+		space = NAT_TCPBUF - f->len;
+		if (space > NAT_TCPBUF - tail) {
+			space = NAT_TCPBUF - tail;
+		}
+		n = read(f->fd, f->buf + tail, space);
+		if (n == 0) {
+			f->flags |= NF_HOSTEOF;
+		} else if (n < 0 && errno != EAGAIN) {
+			tcp_abort(f);
+			nat_freeflow(f);
+			return;
+		} else if (n > 0) {
+			f->len += n;
+		}
+	}
+	tcp_timer(f);
+	if (f->fd >= 0) {
+		tcp_push(f);
+		tcp_done(f);
+	}
+}
@@ -0,0 +1,179 @@
+/*
+ * VMnet -- CPU cost of relaying
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * With perf=on in the config entry (-P in user mode), vmnet counts the
+ * CPU cycles, instructions, cache misses, context switches and CPU
+ * time of its relaying thread with perf_event_open(), and keeps the
+ * totals in its statistics segment, next to the frames and bytes they
+ * were spent on.  When the session ends it reports them per frame and
+ * per byte on stderr.
+ *
+ * The counters are read once a second, not per frame.  They include
+ * the time spent in the kernel on vmnet's behalf if we may count that
+ * (kernel.perf_event_paranoid < 2, or root), else only user time.  A
+ * virtual machine often has no hardware counters at all; then only
+ * the software ones, context switches and CPU time, are there.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+#include "perf.h"
+#include "stats.h"
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+	uint32_t have;		/* PERF_* */
+} event[] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, PERF_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, PERF_INSTR },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, PERF_CACHEMISS },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, PERF_CTXSW },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, PERF_TASKCLOCK },
+};
+#define NEVENT (sizeof(event) / sizeof(event[0]))
+
+static int fd[NEVENT] = { -1, -1, -1, -1, -1 };
+static uint64_t base[NEVENT];	/* what an upgraded vmnet counted */
+static unsigned int last;	/* now, when last read */
+
+static uint64_t *total(int i)
+{
+	switch (event[i].have) {
+	case PERF_CYCLES:
+		return &stats->perf.cycles;
+	case PERF_INSTR:
+		return &stats->perf.instructions;
+	case PERF_CACHEMISS:
+		return &stats->perf.cachemisses;
+	case PERF_CTXSW:
+		return &stats->perf.ctxswitches;
+	}
+	return &stats->perf.taskclock;
+}
+
+static int perf_event(int i, int user)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = event[i].type;
+	attr.config = event[i].config;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+		| PERF_FORMAT_TOTAL_TIME_RUNNING;
+	attr.exclude_kernel = user;
+	attr.exclude_hv = 1;
+	/* this thread, on any CPU */
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+		PERF_FLAG_FD_CLOEXEC);
+}
+
+/* Open what counters there are; -1 if none */
+int perf_open(slipconn *sc)
+{
+	unsigned int i;
+	int user = 0;
+
+	stats->perf.have = 0;
+	for (i = 0; i < NEVENT; i++) {
+		if ((fd[i] = perf_event(i, user)) < 0 && errno == EACCES
+		 && !user) {
+			/* not allowed to count the kernel's part */
+			user = 1;
+			fd[i] = perf_event(i, user);
+		}
+		if (fd[i] >= 0) {
+			base[i] = *total(i);
+			stats->perf.have |= event[i].have;
+		}
+	}
+	if (stats->perf.have == 0) {
+		perror("vmnet: perf_event_open");
+		sc->flags &= ~CFG_PERF;
+		return -1;
+	}
+	if (!user) {
+		stats->perf.have |= PERF_KERNEL;
+	}
+	last = now;
+	return 0;
+}
+
+static void perf_read(void)
+{
+	uint64_t v[3];		/* value, time enabled, time running */
+	unsigned int i;
+
+	for (i = 0; i < NEVENT; i++) {
+		if (fd[i] < 0 || read(fd[i], v, sizeof(v)) != sizeof(v)) {
+			continue;
+		}
+		if (v[2] > 0 && v[2] < v[1]) {
+			/* shared the PMU with others: scale up */
+			v[0] = (double)v[0] * v[1] / v[2];
+		}
+		__atomic_store_n(total(i), base[i] + v[0], __ATOMIC_RELAXED);
+	}
+}
+
+/* Bring the totals up to date, at most once a second */
+void perf_update(void)
+{
+	if (now != last) {
+		last = now;
+		perf_read();
+	}
+}
+
+/* Report the cost per frame and per byte */
+void perf_close(slipconn *sc)
+{
+	struct statsperf *p = &stats->perf;
+	double frames, bytes;
+	unsigned int i;
+
+	perf_read();
+	for (i = 0; i < NEVENT; i++) {
+		if (fd[i] >= 0) {
+			close(fd[i]);
+			fd[i] = -1;
+		}
+	}
+	frames = stats->dir[0].frames + stats->dir[1].frames;
+	bytes = stats->dir[0].bytes + stats->dir[1].bytes;
+	if (frames == 0) {
+		return;
+	}
+	fprintf(stderr, "vmnet: %s%d: %.0f frames, %.0f bytes; per frame",
+		sc->unit >= 0 ? "sl" : "pid ",
+		sc->unit >= 0 ? sc->unit : (int)getpid(), frames, bytes);
+	if (p->have & PERF_CYCLES) {
+		fprintf(stderr, " %.0f cycles (%.1f per byte)",
+			p->cycles / frames, p->cycles / bytes);
+	}
+	if (p->have & PERF_INSTR) {
+		fprintf(stderr, " %.0f instructions", p->instructions / frames);
+	}
+	if (p->have & PERF_CACHEMISS) {
+		fprintf(stderr, " %.2f cache misses", p->cachemisses / frames);
+	}
+	if (p->have & PERF_CTXSW) {
+		fprintf(stderr, " %.3f context switches",
+			p->ctxswitches / frames);
+	}
+	if (p->have & PERF_TASKCLOCK) {
+		fprintf(stderr, " %.0f ns CPU", p->taskclock / frames);
+	}
+	fprintf(stderr, "%s\n", p->have & PERF_KERNEL ? "" : " (user only)");
+}
@@ -0,0 +1,19 @@
+/*
+ * VMnet -- CPU cost of relaying
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+#include "vmnet.h"
+
+int perf_open(slipconn *sc);
+void perf_update(void);
+void perf_close(slipconn *sc);
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ * VMnet -- shared packet buffers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * A pool of frame buffers in the shared segment.  A frame that goes to
+ * several sessions (broadcast, multicast) is copied into the pool once,
+ * and only its index is passed to each receiver.
+ *
+ * A buffer is reference counted, and additionally remembers which
+ * sessions hold the references.  That way the references of a vmnet
+ * that died can be dropped by whoever takes over its session slot,
+ * instead of leaking the buffers.  A session holds a buffer at most
+ * once.
+ *
+ * The free list is a lock-free stack; the head carries a tag that
+ * changes on every update to keep the ABA problem away.
+ */
+
+#include <stddef.h>
+
+#include "pkt.h"
+
+void pkt_init(struct pktpool *pool)
+{
+	int i, w;
+
+	for (i = 0; i < POOL_SIZE; i++) {
+		pool->pkt[i].refs = 0;
+		pool->pkt[i].next = i + 2 <= POOL_SIZE ? i + 2 : 0;
+		for (w = 0; w < SESS_WORDS; w++) {
+			pool->pkt[i].holders[w] = 0;
+		}
+	}
+	pool->head = 1;
+	pool->nofree = 0;
+}
+
+static void pkt_free(struct pktpool *pool, struct pkt *p)
+{
+	uint64_t head, new;
+
+	head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+	do {
+		p->next = (uint32_t)head;
+		new = ((head >> 32) + 1) << 32 | (PKT_INDEX(pool, p) + 1);
+	} while (!__atomic_compare_exchange_n(&pool->head, &head, new, 1,
+			__ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+/* Get a buffer, held by slot.  Returns NULL if the pool is empty. */
+struct pkt *pkt_alloc(struct pktpool *pool, int slot)
+{
+	uint64_t head, new;
+	struct pkt *p;
+
+	head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+	do {
+		if ((uint32_t)head == 0) {
+			__atomic_add_fetch(&pool->nofree, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+		p = &pool->pkt[(uint32_t)head - 1];
+		new = ((head >> 32) + 1) << 32
+			| __atomic_load_n(&p->next, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&pool->head, &head, new, 1,
+			__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+	p->refs = 0;
+	pkt_hold(p, slot);
+	return p;
+}
+
+/* Add a reference for slot.  Returns 0 if it already held one. */
+int pkt_hold(struct pkt *p, int slot)
+{
+	uint32_t bit = 1U << (slot & 31);
+
+	if (__atomic_fetch_or(&p->holders[slot >> 5], bit, __ATOMIC_RELAXED)
+			& bit) {
+		return 0;
+	}
+	__atomic_add_fetch(&p->refs, 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+int pkt_held(struct pkt *p, int slot)
+{
+	return (__atomic_load_n(&p->holders[slot >> 5], __ATOMIC_ACQUIRE)
+		>> (slot & 31)) & 1;
+}
+
+/* Drop slot's reference, freeing the buffer with the last one. */
+void pkt_release(struct pktpool *pool, struct pkt *p, int slot)
+{
+	uint32_t bit = 1U << (slot & 31);
+
+	if (!(__atomic_fetch_and(&p->holders[slot >> 5], ~bit,
+			__ATOMIC_RELAXED) & bit)) {
+		return;
+	}
+	if (__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		pkt_free(pool, p);
+	}
+}
+
+/* Drop every reference held by slot, for a session that went away. */
+void pkt_sweep(struct pktpool *pool, int slot)
+{
+	int i;
+
+	for (i = 0; i < POOL_SIZE; i++) {
+		if (pkt_held(&pool->pkt[i], slot)) {
+			pkt_release(pool, &pool->pkt[i], slot);
+		}
+	}
+}
@@ -0,0 +1,42 @@
+/*
+ * VMnet -- shared packet buffers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef PKT_H
+#define PKT_H
+
+#include <stdint.h>
+
+#include "slip.h"
+#include "vmnet.h"
+
+struct pkt {
+	uint32_t refs;			/* number of holders */
+	uint32_t next;			/* free list link, index + 1 */
+	uint32_t holders[SESS_WORDS];	/* which sessions hold a reference */
+	int src;			/* slot of the session that sent it */
+	int len;
+	unsigned char data[SLIP_MAXFRAME];
+};
+
+struct pktpool {
+	uint64_t head;		/* free list: tag << 32 | index + 1 */
+	uint32_t nofree;	/* allocations that failed */
+	struct pkt pkt[POOL_SIZE];
+};
+
+void pkt_init(struct pktpool *pool);
+struct pkt *pkt_alloc(struct pktpool *pool, int slot);
+int pkt_hold(struct pkt *p, int slot);
+int pkt_held(struct pkt *p, int slot);
+void pkt_release(struct pktpool *pool, struct pkt *p, int slot);
+void pkt_sweep(struct pktpool *pool, int slot);
+
+#define PKT_INDEX(pool, p)	((uint32_t)((p) - (pool)->pkt))
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * VMnet -- priority classification
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Someone typing at a guest's console over telnet or tn3270 should not
+ * have to wait behind a file transfer.  Every frame is put in one of
+ * two bands: 0 for what looks interactive or small (the "prio" rules of
+ * the config entry), 1 for the rest.  The queues in each direction
+ * serve band 0 first (see drr.c), and vmnet lets only a little data
+ * into its output buffers ahead of them, so band 0 frames really do
+ * get ahead.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#include "prio.h"
+
+#define PRIO_DEFAULT	"lowdelay,icmp,ack,small,tcp/22,tcp/23,tcp/513,udp/53"
+#define PRIO_RATIO	8
+
+void prio_default(struct prio *p)
+{
+	prio_parse(p, PRIO_DEFAULT);
+	p->ratio = PRIO_RATIO;
+}
+
+/*
+ * Parse a comma separated list of rules; "none" for no rules at all.
+ * Returns 0, or -1 if a rule is not understood (p is then unchanged).
+ */
+int prio_parse(struct prio *p, const char *s)
+{
+	struct prio new;
+	const char *r, *end;
+	char rule[16];
+	long n;
+	int len;
+
+	memset(&new, 0, sizeof(new));
+	new.ratio = p->ratio;
+	for (r = s; *r; r = *end ? end + 1 : end) {
+		if ((end = strchr(r, ',')) == NULL) {
+			end = r + strlen(r);
+		}
+		len = end - r;
+		if (len == 0 || len >= (int)sizeof(rule)) {
+			return -1;
+		}
+		memcpy(rule, r, len);
+		rule[len] = '\0';
+
+		if (!strcmp(rule, "none")) {
+			continue;
+		} else if (!strcmp(rule, "icmp")) {
+			new.flags |= PRIO_ICMP;
+		} else if (!strcmp(rule, "ack")) {
+			new.flags |= PRIO_ACK;
+		} else if (!strcmp(rule, "lowdelay")) {
+			new.flags |= PRIO_LOWDELAY;
+		} else if (!strcmp(rule, "small")) {
+			new.small = 128;
+		} else if (!strncmp(rule, "small/", 6)) {
+			n = atol(rule + 6);
+			if (n <= 0 || n > 0xffff) {
+				return -1;
+			}
+			new.small = n;
+		} else if (!strncmp(rule, "tcp/", 4)
+			|| !strncmp(rule, "udp/", 4)) {
+			n = atol(rule + 4);
+			if (n <= 0 || n > 0xffff || new.nports == PRIO_PORTS) {
+				return -1;
+			}
+			new.port[new.nports++] = (rule[0] == 't'
+				? IPPROTO_TCP : IPPROTO_UDP) << 16 | n;
+		} else {
+			return -1;
+		}
+	}
+	*p = new;
+	return 0;
+}
+
+/* Which band does the frame f belong in? */
+int prio_band(const struct prio *p, const unsigned char *f, int len)
+{
+	uint32_t sport, dport;
+	int hl, proto, data, i;
+
+	if (len <= p->small) {
+		return 0;
+	}
+	if (len < 20 || (f[0] >> 4) != 4) {
+		return 1;
+	}
+	hl = (f[0] & 0x0f) * 4;
+	proto = f[9];
+	if ((p->flags & PRIO_LOWDELAY)
+	 && ((f[1] & IPTOS_LOWDELAY) || (f[1] >> 2) == 46)) {
+		return 0;
+	}
+	if (proto == IPPROTO_ICMP && (p->flags & PRIO_ICMP)) {
+		return 0;
+	}
+	/* only the first fragment has the ports */
+	if ((proto != IPPROTO_TCP && proto != IPPROTO_UDP)
+	 || (f[6] & 0x1f) || f[7] || len < hl + 4) {
+		return 1;
+	}
+	if (proto == IPPROTO_TCP && (p->flags & PRIO_ACK) && len >= hl + 20) {
+		data = (f[2] << 8 | f[3]) - hl - (f[hl + 12] >> 4) * 4;
+		if (data <= 0) {
+			return 0;
+		}
+	}
+	sport = proto << 16 | f[hl] << 8 | f[hl + 1];
+	dport = proto << 16 | f[hl + 2] << 8 | f[hl + 3];
+	for (i = 0; i < p->nports; i++) {
+		if (p->port[i] == sport || p->port[i] == dport) {
+			return 0;
+		}
+	}
+	return 1;
+}
@@ -0,0 +1,35 @@
+/*
+ * VMnet -- priority classification
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef PRIO_H
+#define PRIO_H
+
+#include <stdint.h>
+
+#define PRIO_PORTS	8
+
+/* prio.flags */
+#define PRIO_ICMP	0x01	/* all of ICMP */
+#define PRIO_ACK	0x02	/* TCP segments without data */
+#define PRIO_LOWDELAY	0x04	/* IP TOS low delay, or DSCP EF */
+
+struct prio {
+	uint8_t flags;
+	uint8_t ratio;		/* band 0 frames per band 1 frame, 0: strict */
+	uint16_t small;		/* frames up to this size, 0 for none */
+	uint16_t nports;
+	uint16_t pad;
+	uint32_t port[PRIO_PORTS];	/* protocol << 16 | port */
+};
+
+void prio_default(struct prio *p);
+int prio_parse(struct prio *p, const char *s);
+int prio_band(const struct prio *p, const unsigned char *f, int len);
+
+#endif
@@ -0,0 +1,52 @@
+/*
+ * VMnet -- static tracepoints
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * USDT probes of provider "vmnet", for bpftrace, perf or SystemTap to
+ * attach to in a running vmnet; see bpf/ for examples.  Each is a nop
+ * in the code until something attaches to it.  They are built in when
+ * <sys/sdt.h> is there (systemtap-sdt-dev, systemtap-sdt-devel), unless
+ * NO_SDT is defined; "readelf -n vmnet" lists them.
+ *
+ *	session_start(unit, remote)	slip_start(), or user mode login
+ *	session_stop(unit, remote)	slip_stop()
+ *	read_entry(dir, fd)		bufread(), dir as in DIR_*: the
+ *	read_return(dir, fd, len)	data goes to the host or guest
+ *	write_entry(dir, fd, len)	bufwrite()
+ *	write_return(dir, fd, written)
+ *	frame(dir, len)			a frame decoded from the input
+ *	queue(dir, band, len, frames)	queued for output, frames queued
+ *					in that direction after it
+ *	drop(dir)			no room in the queue
+ *
+ * remote is the guest's address, in network order.
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#if !defined(NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_SDT
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(vmnet, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(vmnet, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(vmnet, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(vmnet, name, a, b, c, d)
+#else
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#define PROBE4(name, a, b, c, d)
+#endif
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ * VMnet -- rate limiting
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * A token bucket per direction keeps a guest to its configured rate.
+ * The bucket is refilled from the clock the main loop reads anyway, so
+ * there is no timer: while the bucket is empty vmnet simply stops
+ * relaying in that direction, leaving the data where it is (which in
+ * turn stops reading it), and has select() wake up when there will be
+ * tokens again.  A frame is sent as long as there is any token left
+ * and then paid for in full, so a bucket may go into debt by one frame
+ * rather than having to know the frame's size in advance.
+ */
+
+#include <stdlib.h>
+
+#include "rate.h"
+#include "slip.h"
+#include "vmnet.h"
+
+void bucket_init(struct bucket *b, uint32_t rate, uint32_t burst)
+{
+	b->rate = rate;
+	b->burst = burst;
+	b->tokens = burst;
+	b->stamp = nowms;
+}
+
+/* May a frame be sent now? */
+int bucket_ok(struct bucket *b)
+{
+	int64_t t;
+
+	if (b->rate == 0) {
+		return 1;
+	}
+	if (b->stamp != nowms) {
+		t = (uint64_t)(nowms - b->stamp) * b->rate / 1000;
+		if (t > 0) {
+			/* only move on once it adds up to a byte */
+			b->stamp = nowms;
+			t += b->tokens;
+			b->tokens = t > b->burst ? b->burst : t;
+		}
+	}
+	return b->tokens > 0;
+}
+
+/* Pay for a frame that was sent */
+void bucket_take(struct bucket *b, int len)
+{
+	if (b->rate != 0) {
+		b->tokens -= len;
+	}
+}
+
+/* Milliseconds until bucket_ok(), for a select() timeout */
+int bucket_wait(struct bucket *b)
+{
+	if (bucket_ok(b)) {
+		return 0;
+	}
+	return (uint64_t)(1 - b->tokens) * 1000 / b->rate + 1;
+}
+
+static uint32_t scale(const char *s, char **end)
+{
+	uint64_t n = strtoul(s, end, 10);
+
+	switch (**end) {
+	case 'k':
+		n *= 1000;
+		(*end)++;
+		break;
+	case 'M':
+		n *= 1000000;
+		(*end)++;
+		break;
+	case 'G':
+		n *= 1000000000;
+		(*end)++;
+		break;
+	}
+	return n > 0xffffffffULL ? 0xffffffff : n;
+}
+
+/*
+ * Parse "RATE[,BURST]", the rate in bits per second and the burst in
+ * bytes, both with an optional k, M or G.  The rate is returned in
+ * bytes per second; the burst defaults to 100 ms worth of traffic, and
+ * is never less than two frames.  Returns 0, or -1 if malformed.
+ */
+int rate_parse(const char *s, uint32_t *rate, uint32_t *burst)
+{
+	char *end;
+
+	*rate = scale(s, &end) / 8;
+	*burst = *rate / 10;
+	if (end == s || *rate == 0) {
+		return -1;
+	}
+	if (*end == ',') {
+		s = end + 1;
+		*burst = scale(s, &end);
+		if (end == s) {
+			return -1;
+		}
+	}
+	if (*end != '\0') {
+		return -1;
+	}
+	if (*burst < 2 * SLIP_MAXFRAME) {
+		*burst = 2 * SLIP_MAXFRAME;
+	}
+	if (*burst > 0x7fffffff) {
+		*burst = 0x7fffffff;
+	}
+	return 0;
+}
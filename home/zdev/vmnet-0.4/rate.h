@@ -0,0 +1,28 @@
+/*
+ * VMnet -- rate limiting
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef RATE_H
+#define RATE_H
+
+#include <stdint.h>
+
+struct bucket {
+	uint32_t rate;		/* bytes per second, 0 for no limit */
+	uint32_t burst;		/* bytes */
+	int32_t tokens;		/* may go below 0 by up to one frame */
+	uint32_t stamp;		/* nowms of the last refill */
+};
+
+void bucket_init(struct bucket *b, uint32_t rate, uint32_t burst);
+int bucket_ok(struct bucket *b);
+void bucket_take(struct bucket *b, int len);
+int bucket_wait(struct bucket *b);
+int rate_parse(const char *s, uint32_t *rate, uint32_t *burst);
+
+#endif
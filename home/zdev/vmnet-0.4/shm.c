@@ -0,0 +1,331 @@
+/*
+ * VMnet -- segment shared between vmnet processes
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Every vmnet process serves exactly one virtual machine, so anything
+ * that needs to know about the other sessions (switching between
+ * guests, mostly) goes through a POSIX shared memory segment.  The first
+ * vmnet to start creates and initializes it, the rest just map it.
+ * Nobody ever removes it; a stale segment is harmless.
+ *
+ * The segment is created by (effective) root and is only writable by
+ * root, but world readable so monitoring tools can look at it.
+ *
+ * Everything in here is optional: if the segment cannot be set up,
+ * vmnet carries on as a plain SLIP relay.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "flight.h"
+#include "log.h"
+#include "probes.h"
+#include "shm.h"
+#include "stats.h"
+
+struct vmshm *shm = NULL;
+
+/* Enter the remote-ip of every config entry as a static address. */
+static void shm_seed(void)
+{
+	cfgentry cfg;
+	struct in_addr a;
+
+	while (getcfgentry(&cfg) != NULL) {
+		if (inet_aton(cfg.remoteip, &a)
+		 && fwd_static(&shm->fwd, FWD_KEY(FWD_T_IP4, cfg.vlan,
+				a.s_addr), 0, now) < 0) {
+			fprintf(stderr, "vmnet: forwarding table full\n");
+		}
+	}
+}
+
+int shm_attach(void)
+{
+	struct stat st;
+	struct vmshm *p;
+	int fd, i, creator = 0;
+
+	fd = shm_open(VMNET_SHM, O_RDWR|O_CREAT|O_EXCL, 0644);
+	if (fd >= 0) {
+		creator = 1;
+		if (ftruncate(fd, sizeof(struct vmshm)) < 0) {
+			perror("vmnet: ftruncate shm");
+			close(fd);
+			shm_unlink(VMNET_SHM);
+			return -1;
+		}
+	} else if (errno == EEXIST) {
+		fd = shm_open(VMNET_SHM, O_RDWR, 0);
+	}
+	if (fd < 0) {
+		perror("vmnet: shm_open");
+		return -1;
+	}
+
+	/* the creator may not have sized it yet */
+	for (i = 0; ; i++) {
+		if (fstat(fd, &st) < 0) {
+			perror("vmnet: fstat shm");
+			close(fd);
+			return -1;
+		}
+		if (st.st_size >= (off_t)sizeof(struct vmshm)) {
+			break;
+		}
+		if (i == 100) {
+			fprintf(stderr, "vmnet: shared segment too small\n");
+			close(fd);
+			return -1;
+		}
+		usleep(10000);
+	}
+
+	p = mmap(NULL, sizeof(struct vmshm), PROT_READ|PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		perror("vmnet: mmap shm");
+		return -1;
+	}
+	shm = p;
+
+	if (creator) {
+		shm->magic = SHM_MAGIC;
+		shm->version = SHM_VERSION;
+		fwd_init(&shm->fwd);
+		mcast_init(&shm->mcast);
+		pkt_init(&shm->pool);
+		iopool_init(&shm->iopool);
+		__atomic_store_n(&shm->ready, 1, __ATOMIC_RELEASE);
+		shm_seed();
+		return 0;
+	}
+
+	for (i = 0; !__atomic_load_n(&shm->ready, __ATOMIC_ACQUIRE); i++) {
+		if (i == 100) {
+			fprintf(stderr, "vmnet: shared segment not ready\n");
+			goto fail;
+		}
+		usleep(10000);
+	}
+	if (shm->magic != SHM_MAGIC || shm->version != SHM_VERSION) {
+		fprintf(stderr, "vmnet: shared segment %s has wrong version\n",
+			VMNET_SHM);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	munmap(shm, sizeof(struct vmshm));
+	shm = NULL;
+	return -1;
+}
+
+/*
+ * Claim a session slot: a free one, or one whose owner died without
+ * cleaning up.  Publishes our own address in the forwarding table.
+ */
+int sess_attach(slipconn *sc)
+{
+	struct vmsess *s;
+	pid_t pid, me = getpid();
+	int i;
+
+	sc->slot = -1;
+	if (shm == NULL) {
+		return -1;
+	}
+	for (i = 0; i < MAXSESS; i++) {
+		s = &shm->sess[i];
+		pid = __atomic_load_n(&s->pid, __ATOMIC_ACQUIRE);
+		if (pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH)) {
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&s->pid, &pid, me, 0,
+		    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+	if (i == MAXSESS) {
+		fprintf(stderr, "vmnet: no free session slot\n");
+		return -1;
+	}
+
+	/* whatever the previous owner left behind */
+	pkt_sweep(&shm->pool, i);
+	iopool_sweep(&shm->iopool, i);
+	mcast_leave_all(&shm->mcast, i);
+
+	s->remote = sc->remote;
+	s->local = sc->local;
+	s->unit = sc->unit;
+	s->flags = sc->flags;
+	s->vlan = sc->vlan;
+	s->weight = sc->weight;
+	memset(s->qbytes, 0, sizeof(s->qbytes));
+	memset(s->qdrops, 0, sizeof(s->qdrops));
+	__atomic_add_fetch(&s->gen, 1, __ATOMIC_RELEASE);
+	sc->slot = i;
+
+	if (fwd_static(&shm->fwd, FWD_KEY(FWD_T_IP4, sc->vlan, sc->remote),
+			FWD_VAL(i, s->gen), now) < 0) {
+		fprintf(stderr, "vmnet: forwarding table full\n");
+	}
+	return i;
+}
+
+/*
+ * Give the slot back.  Entries pointing at it go stale by themselves
+ * because the next owner bumps the generation.
+ */
+void sess_detach(slipconn *sc)
+{
+	if (shm == NULL || sc->slot < 0) {
+		return;
+	}
+	fwd_static(&shm->fwd, FWD_KEY(FWD_T_IP4, sc->vlan, sc->remote), 0,
+		now);
+	mcast_leave_all(&shm->mcast, sc->slot);
+	pkt_sweep(&shm->pool, sc->slot);
+	iopool_sweep(&shm->iopool, sc->slot);
+	__atomic_store_n(&shm->sess[sc->slot].pid, 0, __ATOMIC_RELEASE);
+	sc->slot = -1;
+}
+
+/* Take over the slot of the vmnet we are upgrading from, see upgrade.c */
+void sess_resume(slipconn *sc, pid_t old)
+{
+	if (shm == NULL || sc->slot < 0 || sc->slot >= MAXSESS
+	 || !__atomic_compare_exchange_n(&shm->sess[sc->slot].pid, &old,
+		getpid(), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		sc->slot = -1;
+	}
+}
+
+/* Hand the slot from process "from" to "to", if "from" still has it */
+void sess_handback(slipconn *sc, pid_t from, pid_t to)
+{
+	if (shm != NULL && sc->slot >= 0 && sc->slot < MAXSESS) {
+		__atomic_compare_exchange_n(&shm->sess[sc->slot].pid, &from,
+			to, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+	}
+}
+
+/* Turn a forwarding table value into a live session slot, or -1. */
+int sess_byval(uint32_t val)
+{
+	struct vmsess *s;
+	int slot = FWD_SLOT(val);
+
+	if (slot < 0 || slot >= MAXSESS) {
+		return -1;
+	}
+	s = &shm->sess[slot];
+	if (__atomic_load_n(&s->pid, __ATOMIC_ACQUIRE) == 0
+	 || (__atomic_load_n(&s->gen, __ATOMIC_ACQUIRE) & 0x7fff)
+			!= FWD_GEN(val)) {
+		return -1;
+	}
+	return slot;
+}
+
+/* Publish how much data the session has waiting, for monitoring */
+void sess_queued(slipconn *sc, uint32_t tohost, uint32_t toguest)
+{
+	__atomic_store_n(&stats->dir[DIR_HOST].queued, tohost,
+		__ATOMIC_RELAXED);
+	__atomic_store_n(&stats->dir[DIR_GUEST].queued, toguest,
+		__ATOMIC_RELAXED);
+	STAT_MAX(stats->dir[DIR_HOST].qhigh, tohost);
+	STAT_MAX(stats->dir[DIR_GUEST].qhigh, toguest);
+	if (shm == NULL || sc->slot < 0) {
+		return;
+	}
+	__atomic_store_n(&shm->sess[sc->slot].qbytes[DIR_HOST], tohost,
+		__ATOMIC_RELAXED);
+	__atomic_store_n(&shm->sess[sc->slot].qbytes[DIR_GUEST], toguest,
+		__ATOMIC_RELAXED);
+}
+
+/* Count a frame dropped because its queue was full */
+void sess_drop(slipconn *sc, int dir)
+{
+	PROBE1(drop, dir);
+	FLIGHT(FL_DROP, dir, 0, 0);
+	STAT_ADD(stats->dir[dir].drops, 1);
+	logmsg(LM_DROP, dir == DIR_HOST ? "host" : "guest", 0, 0, 0);
+	if (shm == NULL || sc->slot < 0) {
+		return;
+	}
+	__atomic_add_fetch(&shm->sess[sc->slot].qdrops[dir], 1,
+		__ATOMIC_RELAXED);
+}
+
+/*
+ * Return a copy of s that lives as long as we do.  The user names and
+ * scripts of all sessions come from the same few config lines, so they
+ * are kept once, in the shared segment, and never removed.  Without the
+ * segment, or when it is full, we fall back to strdup().
+ */
+const char *intern(const char *s)
+{
+	struct strtab *t;
+	uint32_t h, off, idx, expect;
+	int i, len = strlen(s) + 1;
+	const char *p;
+	char *copy;
+
+	if (shm == NULL) {
+		goto priv;
+	}
+	t = &shm->strtab;
+	for (h = 5381, p = s; *p; p++) {
+		h = h * 33 + (unsigned char)*p;
+	}
+	for (i = 0; i < STRTAB_HASH; i++) {
+		idx = (h + i) % STRTAB_HASH;
+		off = __atomic_load_n(&t->index[idx], __ATOMIC_ACQUIRE);
+		if (off == 0) {
+			off = __atomic_fetch_add(&t->used, len,
+				__ATOMIC_RELAXED);
+			if (off + len > STRTAB_SIZE) {
+				break;
+			}
+			memcpy(t->data + off, s, len);
+			off++;
+			expect = 0;
+			if (__atomic_compare_exchange_n(&t->index[idx],
+			    &expect, off, 0, __ATOMIC_RELEASE,
+			    __ATOMIC_RELAXED)) {
+				return t->data + off - 1;
+			}
+			/* lost the race; our copy is wasted, look again */
+			off = __atomic_load_n(&t->index[idx],
+				__ATOMIC_ACQUIRE);
+		}
+		if (!strcmp(t->data + off - 1, s)) {
+			return t->data + off - 1;
+		}
+	}
+	__atomic_add_fetch(&t->full, 1, __ATOMIC_RELAXED);
+priv:
+	if ((copy = strdup(s)) == NULL) {
+		perror("vmnet: strdup");
+		exit(1);
+	}
+	return copy;
+}
@@ -0,0 +1,72 @@
+/*
+ * VMnet -- segment shared between vmnet processes
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef SHM_H
+#define SHM_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "buf.h"
+#include "config.h"
+#include "dns.h"
+#include "fwd.h"
+#include "mcast.h"
+#include "pkt.h"
+#include "vmnet.h"
+
+#define SHM_MAGIC	0x766d6e74	/* "vmnt" */
+#define SHM_VERSION	8
+
+struct vmsess {
+	pid_t pid;		/* owning vmnet process, 0 if free */
+	uint32_t gen;		/* bumped on every attach */
+	in_addr_t remote;
+	in_addr_t local;
+	int unit;		/* sl%d */
+	int flags;		/* CFG_* of the config entry */
+	int vlan;		/* switching domain */
+	int weight;		/* fair queueing weight */
+	uint32_t qbytes[2];	/* bytes waiting, by DIR_* */
+	uint32_t qdrops[2];	/* frames dropped for lack of room, by DIR_* */
+};
+
+struct strtab {
+	uint32_t used;			/* bytes of data handed out */
+	uint32_t full;			/* strings that did not fit */
+	uint32_t index[STRTAB_HASH];	/* offset + 1 of a string, by hash */
+	char data[STRTAB_SIZE];
+};
+
+struct vmshm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t ready;		/* set by the creator when initialized */
+	struct vmsess sess[MAXSESS];
+	struct fwdtab fwd;
+	struct mctab mcast;
+	struct pktpool pool;
+	struct iopool iopool;
+	struct strtab strtab;
+	struct dnscache dns;
+};
+
+extern struct vmshm *shm;
+
+int shm_attach(void);
+int sess_attach(slipconn *sc);
+void sess_detach(slipconn *sc);
+void sess_resume(slipconn *sc, pid_t old);
+void sess_handback(slipconn *sc, pid_t from, pid_t to);
+int sess_byval(uint32_t val);
+void sess_queued(slipconn *sc, uint32_t tohost, uint32_t toguest);
+void sess_drop(slipconn *sc, int dir);
+const char *intern(const char *s);
+
+#endif
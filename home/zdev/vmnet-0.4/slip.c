@@ -0,0 +1,103 @@
+/*
+ * VMnet -- SLIP framing (RFC 1055)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * vmnet used to copy the byte streams blindly.  To look at the packets
+ * (for switching between guests and the like) we have to find the frame
+ * boundaries, so here is the usual SLIP state machine.
+ */
+
+#include <stddef.h>
+
+#include "slip.h"
+
+void slip_init(struct slipdec *d)
+{
+	d->len = 0;
+	d->esc = 0;
+	d->toolong = 0;
+	d->frame = NULL;
+}
+
+/*
+ * Feed n bytes to the decoder.  Returns the number of bytes consumed.
+ * When a complete frame has been collected, decoding stops right after
+ * its END byte and *flen is set to its length (the frame is in d->frame
+ * until the next call); otherwise *flen is 0.
+ */
+int slip_decode(struct slipdec *d, const unsigned char *p, int n, int *flen)
+{
+	int i;
+	unsigned char c;
+
+	*flen = 0;
+	if (d->len < 0) {
+		/* previous call returned a frame */
+		d->len = 0;
+	}
+	for (i = 0; i < n; i++) {
+		c = p[i];
+		if (c == SLIP_END) {
+			if (d->len > 0 && !d->toolong) {
+				*flen = d->len;
+				d->len = -1;
+				d->esc = 0;
+				return i + 1;
+			}
+			d->len = 0;
+			d->esc = 0;
+			d->toolong = 0;
+			continue;
+		}
+		if (d->esc) {
+			d->esc = 0;
+			if (c == SLIP_ESC_END) {
+				c = SLIP_END;
+			} else if (c == SLIP_ESC_ESC) {
+				c = SLIP_ESC;
+			}
+		} else if (c == SLIP_ESC) {
+			d->esc = 1;
+			continue;
+		}
+		if (d->len >= SLIP_MAXFRAME) {
+			d->toolong = 1;
+			continue;
+		}
+		d->frame[d->len++] = c;
+	}
+	return n;
+}
+
+/*
+ * Encode a frame into dst, which must have room for SLIP_ENCMAX(len)
+ * bytes.  Like the kernel driver we start with an END to flush any
+ * line noise.  Returns the encoded length.
+ */
+int slip_encode(unsigned char *dst, const unsigned char *frame, int len)
+{
+	unsigned char *d = dst;
+	int i;
+
+	*d++ = SLIP_END;
+	for (i = 0; i < len; i++) {
+		switch (frame[i]) {
+		case SLIP_END:
+			*d++ = SLIP_ESC;
+			*d++ = SLIP_ESC_END;
+			break;
+		case SLIP_ESC:
+			*d++ = SLIP_ESC;
+			*d++ = SLIP_ESC_ESC;
+			break;
+		default:
+			*d++ = frame[i];
+		}
+	}
+	*d++ = SLIP_END;
+	return d - dst;
+}
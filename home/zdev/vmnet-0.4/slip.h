@@ -0,0 +1,35 @@
+/*
+ * VMnet -- SLIP framing (RFC 1055)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef SLIP_H
+#define SLIP_H
+
+#define SLIP_END	0300
+#define SLIP_ESC	0333
+#define SLIP_ESC_END	0334
+#define SLIP_ESC_ESC	0335
+
+/* the interface mtu is 1500, leave some slack for sloppy guests */
+#define SLIP_MAXFRAME	2048
+
+/* worst case size of an encoded frame: every byte escaped, plus two ENDs */
+#define SLIP_ENCMAX(len)	(2*(len) + 2)
+
+struct slipdec {
+	int len;		/* bytes of the current frame so far */
+	int esc;		/* last byte was an ESC */
+	int toolong;		/* frame overflowed, skip to the next END */
+	unsigned char *frame;	/* SLIP_MAXFRAME bytes, up to the caller */
+};
+
+void slip_init(struct slipdec *d);
+int slip_decode(struct slipdec *d, const unsigned char *p, int n, int *flen);
+int slip_encode(unsigned char *dst, const unsigned char *frame, int len);
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * VMnet -- stalls of the relay loop
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Everything a session does happens in one loop, so anything in it that
+ * takes long, like a write() to the emulator that blocks because its
+ * pipe is full, holds up everything else: the pty is not read in the
+ * meantime either.  The loop marks each phase of a pass (reading from
+ * the guest, writing to the host...), and when a pass took STALL_MS or
+ * more, we log it, with the phase that took longest, count it in the
+ * statistics segment and leave an event in the flight recorder.
+ *
+ * That only says something once the pass is over.  For a loop that is
+ * stuck right now, the segment also shows when the current pass
+ * started and in which phase it is: "vmnet -m" and vmnettop show that.
+ *
+ * The phases are timed with CLOCK_MONOTONIC_COARSE, which is cheap to
+ * read but only ticks every jiffy, plenty for stalls.  The ifconfig
+ * and up/down script calls are timed too, in the loop or not.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "flight.h"
+#include "log.h"
+#include "stall.h"
+#include "stats.h"
+
+static uint32_t start;		/* ms, of this pass */
+static uint32_t since;		/* ms, of this phase */
+static uint32_t longest;	/* ms, the longest phase so far */
+static int phase = ST_WAIT;
+static int longphase;
+
+static uint64_t stall_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* select() returned */
+void stall_begin(void)
+{
+	uint64_t t = stall_ms();
+
+	start = since = t;
+	longest = 0;
+	longphase = phase = ST_LOOP;
+	__atomic_store_n(&stats->loop.phase, ST_LOOP, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->loop.busy, t, __ATOMIC_RELAXED);
+}
+
+/* The loop goes on to the next phase */
+void stall_phase(int p)
+{
+	uint32_t t = stall_ms();
+
+	if (t - since > longest) {
+		longest = t - since;
+		longphase = phase;
+	}
+	since = t;
+	phase = p;
+	__atomic_store_n(&stats->loop.phase, p, __ATOMIC_RELAXED);
+}
+
+/* About to select() again: was that a stall? */
+void stall_end(void)
+{
+	static const char *name[] = STALL_NAMES;
+	uint32_t ms;
+
+	if (phase == ST_WAIT) {
+		return;		/* before the first pass */
+	}
+	stall_phase(ST_WAIT);
+	__atomic_store_n(&stats->loop.busy, 0, __ATOMIC_RELAXED);
+	ms = since - start;
+	if (ms < STALL_MS) {
+		return;
+	}
+	STAT_ADD(stats->loop.stalls, 1);
+	STAT_MAX(stats->loop.stallmax, ms);
+	FLIGHT(FL_STALL, 0, ms, longphase);
+	logmsg(LM_STALL, name[longphase], longest, ms, 0);
+}
+
+/* system(), timed as a phase of its own */
+int stall_system(const char *cmd)
+{
+	static const char *name[] = STALL_NAMES;
+	int was = phase, r;
+	uint32_t t = stall_ms(), ms;
+
+	if (was != ST_WAIT) {
+		stall_phase(ST_SCRIPT);
+	}
+	r = system(cmd);
+	ms = stall_ms() - t;
+	if (was != ST_WAIT) {
+		stall_phase(was);
+	} else if (ms >= STALL_MS) {
+		/* not in the loop, but the guest waits all the same */
+		logmsg(LM_STALL, name[ST_SCRIPT], ms, ms, 0);
+	}
+	return r;
+}
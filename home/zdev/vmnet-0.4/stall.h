@@ -0,0 +1,42 @@
+/*
+ * VMnet -- stalls of the relay loop
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef STALL_H
+#define STALL_H
+
+/* what the loop is doing: the phases of one pass */
+#define ST_WAIT		0	/* in select() */
+#define ST_LOOP		1	/* counters, timers and such */
+#define ST_UPGRADE	2
+#define ST_CAPTURE	3
+#define ST_READGUEST	4
+#define ST_READHOST	5
+#define ST_NAT		6
+#define ST_DNS		7
+#define ST_SWITCH	8
+#define ST_ARP		9
+#define ST_RELAY	10	/* decoding and queueing frames */
+#define ST_WRITEHOST	11
+#define ST_WRITEGUEST	12
+#define ST_OUTPUT	13	/* moving frames from the queues */
+#define ST_SCRIPT	14	/* ifconfig and the up/down script */
+
+/* for those who report them, by ST_* */
+#define STALL_NAMES { \
+	"waiting", "housekeeping", "upgrade", "capture", \
+	"read from guest", "read from host", "nat", "dns", "switch", \
+	"proxy arp", "relay", "write to host", "write to guest", \
+	"output", "up/down script" }
+
+void stall_begin(void);
+void stall_phase(int phase);
+void stall_end(void);
+int stall_system(const char *cmd);
+
+#endif
@@ -0,0 +1,367 @@
+/*
+ * VMnet -- session statistics
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Every vmnet keeps its counters in a small shared memory segment of
+ * its own, VMNET_STATS.<pid> (/dev/shm/vmnet-stats.<pid> on Linux), so
+ * monitoring tools can read them at any time without asking vmnet:
+ * see struct vmstats.  A segment per process rather than a part of
+ * the "/vmnet" segment, because a user mode vmnet has no access to
+ * that one.
+ *
+ * vmnet is the only writer, and updates them with plain stores; a
+ * reader may see one counter a little ahead of another, but never a
+ * torn value.  The two directions have cache lines of their own.
+ *
+ * The segment goes when the session ends normally; one left behind by
+ * a vmnet that was killed is recognized by its pid no longer running.
+ * A live upgrade carries the counters over to the new pid.
+ *
+ * The latency histograms are fed from the output side: output() tells
+ * lat_queue() how many bytes of the output buffer each frame took and
+ * when it came in, and bufwrite() tells lat_written() how many were
+ * written, which completes the frames before that point.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "config.h"
+#include "stats.h"
+
+#ifdef LAT_TSC
+#include <x86intrin.h>
+#endif
+
+static struct vmstats nostats;	/* if there is no segment */
+struct vmstats *stats = &nostats;
+static char name[64];
+
+/* frames in an output buffer that are not all written yet */
+static struct latpend {
+	uint32_t in;		/* bytes put in the buffer, ever */
+	uint32_t out;		/* bytes written from it, ever */
+	unsigned int head;
+	unsigned int n;
+	struct {
+		uint32_t end;	/* value of in after the frame */
+		uint32_t stamp;
+	} ent[LAT_PENDING];
+} pend[2];
+static uint32_t arrived[2];
+
+#ifdef LAT_TSC
+static uint64_t tsc0;
+static uint64_t tscmul;		/* us per tick, << 32 */
+#endif
+
+int stats_open(slipconn *sc)
+{
+	struct vmstats *p;
+	int fd;
+
+	snprintf(name, sizeof(name), "%s.%d", VMNET_STATS, (int)getpid());
+	/* never write into a segment somebody else made for us */
+	fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0644);
+	if (fd < 0 && errno == EEXIST) {
+		shm_unlink(name);	/* left by a vmnet with our pid */
+		fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0644);
+	}
+	if (fd < 0 || ftruncate(fd, sizeof(struct vmstats)) < 0) {
+		perror("vmnet: stats segment");
+		if (fd >= 0) {
+			close(fd);
+			shm_unlink(name);
+		}
+		name[0] = '\0';
+		return -1;
+	}
+	p = mmap(NULL, sizeof(struct vmstats), PROT_READ|PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		perror("vmnet: mmap stats");
+		shm_unlink(name);
+		name[0] = '\0';
+		return -1;
+	}
+	p->pid = getpid();
+	p->unit = sc->unit;
+	p->remote = sc->remote;
+	p->local = sc->local;
+	p->flags = sc->flags;
+	p->start = time(NULL);
+	strncpy(p->username, sc->username, sizeof(p->username) - 1);
+	p->version = STATS_VERSION;
+	__atomic_store_n(&p->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+	stats = p;
+	return 0;
+}
+
+/* Carry on counting where the vmnet we take over from left off */
+void stats_resume(pid_t old)
+{
+	char oldname[64];
+	struct vmstats *p;
+	int fd;
+
+	snprintf(oldname, sizeof(oldname), "%s.%d", VMNET_STATS, (int)old);
+	if ((fd = shm_open(oldname, O_RDONLY, 0)) < 0) {
+		return;
+	}
+	p = mmap(NULL, sizeof(struct vmstats), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p != MAP_FAILED) {
+		if (p->magic == STATS_MAGIC && p->version == STATS_VERSION) {
+			stats->start = p->start;
+			stats->wakeups = p->wakeups;
+			memcpy(stats->dir, p->dir, sizeof(stats->dir));
+			memcpy(stats->lat, p->lat, sizeof(stats->lat));
+			memcpy(&stats->perf, &p->perf, sizeof(stats->perf));
+			stats->loop.stalls = p->loop.stalls;
+			stats->loop.stallmax = p->loop.stallmax;
+		}
+		munmap(p, sizeof(struct vmstats));
+	}
+	shm_unlink(oldname);	/* the old vmnet just exits */
+}
+
+void stats_close(void)
+{
+	if (name[0]) {
+		shm_unlink(name);
+		name[0] = '\0';
+	}
+}
+
+/* Copy the counters of one session, a word at a time */
+static void snapshot(struct vmstats *to, const struct vmstats *from)
+{
+	const uint64_t *src;
+	uint64_t *dst;
+	size_t i, n = (sizeof(struct vmstats) - offsetof(struct vmstats, dir))
+		/ sizeof(uint64_t);
+
+	memcpy(to, from, offsetof(struct vmstats, wakeups));
+	to->username[sizeof(to->username) - 1] = '\0';
+	to->wakeups = __atomic_load_n(&from->wakeups, __ATOMIC_RELAXED);
+	src = (const uint64_t *)from->dir;
+	dst = (uint64_t *)to->dir;
+	for (i = 0; i < n; i++) {
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * For monitoring tools: read the segments of all running sessions into
+ * a malloc()ed array, return how many.  Those left behind by a vmnet
+ * that died are skipped.
+ */
+int stats_collect(struct vmstats **out)
+{
+	struct vmstats *v = NULL, *p, *nv;
+	char prefix[64], name[NAME_MAX + 2];
+	struct dirent *d;
+	int n = 0, max = 0, fd;
+	DIR *dir;
+
+	if ((dir = opendir(SHM_DIR)) == NULL) {
+		*out = NULL;
+		return 0;
+	}
+	/* shm_open("/x") is SHM_DIR/x */
+	snprintf(prefix, sizeof(prefix), "%s.", VMNET_STATS + 1);
+	while ((d = readdir(dir)) != NULL) {
+		if (strncmp(d->d_name, prefix, strlen(prefix))) {
+			continue;
+		}
+		snprintf(name, sizeof(name), "/%s", d->d_name);
+		if ((fd = shm_open(name, O_RDONLY, 0)) < 0) {
+			continue;
+		}
+		p = mmap(NULL, sizeof(struct vmstats), PROT_READ, MAP_SHARED,
+			fd, 0);
+		close(fd);
+		if (p == MAP_FAILED) {
+			continue;
+		}
+		if (__atomic_load_n(&p->magic, __ATOMIC_ACQUIRE) == STATS_MAGIC
+		 && p->version == STATS_VERSION
+		 && (kill(p->pid, 0) == 0 || errno == EPERM)) {
+			if (n == max) {
+				max = max ? 2 * max : 16;
+				if ((nv = realloc(v, max * sizeof(*v))) == NULL) {
+					munmap(p, sizeof(struct vmstats));
+					break;
+				}
+				v = nv;
+			}
+			snapshot(&v[n++], p);
+		}
+		munmap(p, sizeof(struct vmstats));
+	}
+	closedir(dir);
+	*out = v;
+	return n;
+}
+
+/*
+ * Called once per wakeup: was the input in direction dir held back
+ * (data left over that there was no room for) since the last call?
+ */
+void stats_blocked(int dir, int blocked)
+{
+	static unsigned int since[2];
+	static int was[2];
+
+	if (was[dir]) {
+		STAT_ADD(stats->dir[dir].blocked, nowms - since[dir]);
+	}
+	since[dir] = nowms;
+	was[dir] = blocked;
+}
+
+#ifdef LAT_TSC
+/* Find out how fast the TSC runs, against CLOCK_MONOTONIC */
+void lat_init(void)
+{
+	struct timespec t0, t1, nap = { 0, 10000000 };
+	uint64_t c0, c1;
+	int64_t ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	c0 = __rdtsc();
+	nanosleep(&nap, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	c1 = __rdtsc();
+	ns = (t1.tv_sec - t0.tv_sec) * 1000000000LL
+		+ t1.tv_nsec - t0.tv_nsec;
+	tsc0 = c0;
+	tscmul = c1 > c0 ? ((uint64_t)ns << 32) / 1000 / (c1 - c0) : 0;
+}
+
+/* Microseconds, wrapping every 71 minutes */
+uint32_t lat_now(void)
+{
+	return ((unsigned __int128)(__rdtsc() - tsc0) * tscmul) >> 32;
+}
+#else
+void lat_init(void)
+{
+}
+
+uint32_t lat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+#endif
+
+/* Data just came in, from the guest (DIR_HOST) or the host */
+void lat_arrive(int dir)
+{
+	arrived[dir] = lat_now();
+}
+
+/* When the data now being decoded in direction dir came in */
+uint32_t lat_arrived(int dir)
+{
+	return arrived[dir];
+}
+
+static int lat_bucket(uint32_t us)
+{
+	int e;
+
+	if (us < LAT_SUB) {
+		return us;
+	}
+	e = 31 - __builtin_clz(us);	/* >= 4 */
+	return (e - 3) * LAT_SUB + ((us >> (e - 4)) & (LAT_SUB - 1));
+}
+
+/* The largest value that goes into bucket i */
+static uint32_t lat_top(int i)
+{
+	int e;
+
+	if (i < LAT_SUB) {
+		return i;
+	}
+	e = i / LAT_SUB + 3;
+	return (((uint64_t)(LAT_SUB + i % LAT_SUB) + 1) << (e - 4)) - 1;
+}
+
+/* A frame of bytes went into the output buffer of direction dir */
+void lat_queue(int dir, int bytes, uint32_t stamp)
+{
+	struct latpend *p = &pend[dir];
+
+	p->in += bytes;
+	if (p->n == LAT_PENDING) {
+		return;		/* not timed */
+	}
+	p->ent[(p->head + p->n) % LAT_PENDING].end = p->in;
+	p->ent[(p->head + p->n) % LAT_PENDING].stamp = stamp;
+	p->n++;
+}
+
+/* bytes of the output buffer in direction dir have been written */
+void lat_written(int dir, int bytes)
+{
+	struct latpend *p = &pend[dir];
+	struct stathist *h = &stats->lat[dir];
+	uint32_t t, us;
+
+	p->out += bytes;
+	if (p->n == 0 || (int32_t)(p->out - p->ent[p->head].end) < 0) {
+		return;
+	}
+	t = lat_now();
+	do {
+		us = t - p->ent[p->head].stamp;
+		STAT_ADD(h->bucket[lat_bucket(us)], 1);
+		STAT_ADD(h->sum, us);
+		STAT_MAX(h->max, us);
+		STAT_ADD(h->count, 1);
+		p->head = (p->head + 1) % LAT_PENDING;
+		p->n--;
+	} while (p->n > 0 && (int32_t)(p->out - p->ent[p->head].end) >= 0);
+}
+
+/* The q quantile (0.5 for the median) of h in us, to within 1/LAT_SUB */
+uint32_t lat_quantile(const struct stathist *h, double q)
+{
+	uint64_t n, want;
+	int i;
+
+	if (h->count == 0) {
+		return 0;
+	}
+	want = q * h->count;
+	if (want < q * h->count || want < 1) {	/* round up */
+		want++;
+	}
+	for (i = 0, n = 0; i < LAT_BUCKETS; i++) {
+		if ((n += h->bucket[i]) >= want) {
+			return lat_top(i) < h->max ? lat_top(i) : h->max;
+		}
+	}
+	return h->max;
+}
@@ -0,0 +1,132 @@
+/*
+ * VMnet -- session statistics
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "vmnet.h"
+
+#define STATS_MAGIC	0x766d7374	/* "vmst" */
+#define STATS_VERSION	5
+
+/*
+ * Counters for one direction: DIR_HOST is what the guest sends,
+ * DIR_GUEST what it gets.  Each direction has cache lines of its own.
+ */
+struct statsdir {
+	uint64_t bytes;		/* in the frames relayed */
+	uint64_t frames;
+	uint64_t reads;		/* read() calls on the input side */
+	uint64_t writes;	/* write() calls on the output side */
+	uint64_t partial;	/* writes that did not take it all */
+	uint64_t drops;		/* frames dropped for lack of room */
+	uint64_t queued;	/* bytes waiting now */
+	uint64_t qhigh;		/* most bytes ever waiting */
+	uint64_t blocked;	/* ms the input was held back */
+} __attribute__((aligned(64)));
+
+/*
+ * How long frames spent inside vmnet, in microseconds: from the read()
+ * that brought in their last byte (or from when vmnet made them, for
+ * those from the NAT, the DNS cache or another session) until the
+ * write() that took their last byte.  Buckets are log-linear as in HDR
+ * histograms: exact below LAT_SUB, above that LAT_SUB buckets for each
+ * power of two, so a value is off by at most 1/LAT_SUB.
+ */
+#define LAT_SUB		16
+#define LAT_BUCKETS	((32 - 3) * LAT_SUB)	/* up to 2^32 us */
+
+struct stathist {
+	uint64_t count;
+	uint64_t sum;		/* us */
+	uint64_t max;		/* us */
+	uint64_t bucket[LAT_BUCKETS];
+} __attribute__((aligned(64)));
+
+/*
+ * What relaying cost the CPU, with perf=on (see perf.c): divide by
+ * frames or bytes for the cost per frame or byte.  have says which
+ * counters the machine has, by PERF_* bit; a virtual machine may only
+ * have the software ones.
+ */
+#define PERF_CYCLES	0x01
+#define PERF_INSTR	0x02
+#define PERF_CACHEMISS	0x04
+#define PERF_CTXSW	0x08
+#define PERF_TASKCLOCK	0x10
+#define PERF_KERNEL	0x80	/* the counts include the kernel's part */
+
+struct statsperf {
+	uint64_t cycles;
+	uint64_t instructions;
+	uint64_t cachemisses;
+	uint64_t ctxswitches;
+	uint64_t taskclock;	/* ns on a CPU */
+	uint32_t have;
+} __attribute__((aligned(64)));
+
+/*
+ * The relay loop, see stall.c: passes that took STALL_MS or more, and
+ * whether it is busy right now: busy is the CLOCK_MONOTONIC ms when
+ * the current pass began, 0 while it waits in select(), and phase what
+ * it is doing (ST_* in stall.h).
+ */
+struct statsloop {
+	uint64_t stalls;
+	uint64_t stallmax;	/* ms */
+	uint64_t busy;
+	uint64_t phase;
+} __attribute__((aligned(64)));
+
+/* The segment, VMNET_STATS.<pid>, written by that vmnet only */
+struct vmstats {
+	uint32_t magic;
+	uint32_t version;
+	pid_t pid;
+	int unit;		/* sl%d, -1 in user mode */
+	in_addr_t remote;
+	in_addr_t local;
+	int flags;		/* CFG_* */
+	uint32_t start;		/* time() the session started */
+	char username[32];
+	uint64_t wakeups;	/* select() returns */
+	struct statsdir dir[2];
+	struct stathist lat[2];	/* by direction, like dir */
+	struct statsperf perf;
+	struct statsloop loop;
+};
+
+extern struct vmstats *stats;
+
+/* single writer: plain relaxed stores, no locked instructions */
+#define STAT_ADD(field, n) \
+	__atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define STAT_MAX(field, v) \
+	do { if ((v) > (field)) \
+		__atomic_store_n(&(field), (v), __ATOMIC_RELAXED); } while (0)
+
+int stats_open(slipconn *sc);
+void stats_resume(pid_t old);
+void stats_close(void);
+void stats_blocked(int dir, int blocked);
+int stats_collect(struct vmstats **out);
+
+void lat_init(void);
+uint32_t lat_now(void);
+void lat_arrive(int dir);
+uint32_t lat_arrived(int dir);
+void lat_queue(int dir, int bytes, uint32_t stamp);
+void lat_written(int dir, int bytes);
+uint32_t lat_quantile(const struct stathist *h, double q);
+
+#endif
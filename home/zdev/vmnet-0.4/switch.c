@@ -0,0 +1,233 @@
+/*
+ * VMnet -- guest to guest switching
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Sessions with the "switch" option hand packets for each other's
+ * guests over directly, instead of feeding them through the SLIP line
+ * discipline, the host IP stack and another SLIP interface.  Each such
+ * session binds a datagram socket in VMNET_RUNDIR (root only, so nobody
+ * else can inject packets) and receives its peers' frames on it.
+ * The frames themselves are in the shared packet pool, only buffer
+ * indexes travel over the sockets.
+ *
+ * Sessions can be put on separate VLANs (the "vlan" option): the VLAN
+ * is part of every forwarding table key, and frames, broadcasts
+ * included, only ever go to peers on the same VLAN.  So several guest
+ * networks, even with overlapping addresses, share one set of tables
+ * without seeing each other.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "pkt.h"
+#include "shm.h"
+#include "switch.h"
+
+static void switch_addr(struct sockaddr_un *sun, int slot)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	snprintf(sun->sun_path, sizeof(sun->sun_path), "%s/sw.%d",
+		VMNET_RUNDIR, slot);
+}
+
+int switch_open(slipconn *sc)
+{
+	struct sockaddr_un sun;
+	int fd, size = 256*1024;
+
+	sc->swfd = -1;
+	if (!(sc->flags & CFG_SWITCH) || sc->slot < 0) {
+		return -1;
+	}
+	if (mkdir(VMNET_RUNDIR, 0700) < 0 && errno != EEXIST) {
+		perror("vmnet: mkdir " VMNET_RUNDIR);
+		return -1;
+	}
+	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		perror("vmnet: switch socket");
+		return -1;
+	}
+	switch_addr(&sun, sc->slot);
+	unlink(sun.sun_path);	/* left over from a dead session */
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		perror("vmnet: bind switch socket");
+		close(fd);
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	sc->swfd = fd;
+	return fd;
+}
+
+void switch_close(slipconn *sc)
+{
+	struct sockaddr_un sun;
+
+	if (sc->swfd < 0) {
+		return;
+	}
+	switch_addr(&sun, sc->slot);
+	unlink(sun.sun_path);
+	close(sc->swfd);
+	sc->swfd = -1;
+}
+
+/* Queue a pooled frame to a peer session, passing only its index */
+static void switch_send(slipconn *sc, struct pkt *p, int peer)
+{
+	struct sockaddr_un sun;
+	uint32_t idx = PKT_INDEX(&shm->pool, p);
+
+	if (!pkt_hold(p, peer)) {
+		return;
+	}
+	/* if the peer is busy or gone, drop it like a full interface queue */
+	switch_addr(&sun, peer);
+	if (sendto(sc->swfd, &idx, sizeof(idx), MSG_DONTWAIT,
+	    (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		pkt_release(&shm->pool, p, peer);
+		sess_drop(sc, DIR_HOST);
+	}
+}
+
+/* Is this a live session that switches with us, on our VLAN? */
+static int switch_peer(slipconn *sc, int peer)
+{
+	struct vmsess *s = &shm->sess[peer];
+
+	return peer != sc->slot
+		&& __atomic_load_n(&s->pid, __ATOMIC_ACQUIRE) != 0
+		&& (s->flags & CFG_SWITCH) && s->vlan == sc->vlan;
+}
+
+/*
+ * Hand a broadcast or multicast frame to every interested peer.  There
+ * is one copy of the frame, in the pool, however many peers get it.
+ */
+static void switch_flood(slipconn *sc, unsigned char *frame, int len,
+	in_addr_t dst)
+{
+	struct mcgroup *g = NULL;
+	struct pkt *p;
+	uint32_t w, set[SESS_WORDS];
+	int i, b;
+
+	for (i = 0; i < SESS_WORDS; i++) {
+		set[i] = ~0U;
+	}
+	if (MCAST(dst) && !MCAST_LOCAL(dst)) {
+		if ((g = mcast_find(&shm->mcast, dst)) == NULL) {
+			return;		/* no guest is interested */
+		}
+		for (i = 0; i < SESS_WORDS; i++) {
+			set[i] = __atomic_load_n(&g->members[i],
+				__ATOMIC_ACQUIRE);
+		}
+		/* the entry went to another group while we looked */
+		if (__atomic_load_n(&g->group, __ATOMIC_ACQUIRE) != dst) {
+			return;
+		}
+	}
+	if ((p = pkt_alloc(&shm->pool, sc->slot)) == NULL) {
+		sess_drop(sc, DIR_HOST);
+		return;
+	}
+	memcpy(p->data, frame, len);
+	p->src = sc->slot;
+	p->len = len;
+
+	for (i = 0; i < SESS_WORDS; i++) {
+		for (w = set[i]; w; w &= w - 1) {
+			b = i*32 + __builtin_ctz(w);
+			if (b < MAXSESS && switch_peer(sc, b)) {
+				switch_send(sc, p, b);
+			}
+		}
+	}
+	pkt_release(&shm->pool, p, sc->slot);
+}
+
+/*
+ * Look at a frame coming from our guest.  Learns its source address, if
+ * it is in the session's subnet=, and sends it straight to the peer
+ * session if the destination belongs to one.  Broadcasts and
+ * multicasts go to the interested peers and to the host.  Returns 1 if
+ * the frame was taken care of (sent or dropped), 0 if it should go to
+ * the host as usual.
+ */
+int switch_frame(slipconn *sc, unsigned char *frame, int len)
+{
+	in_addr_t src, dst;
+	struct pkt *p;
+	int peer;
+
+	if (sc->swfd < 0 || len < 20 || (frame[0] >> 4) != 4) {
+		return 0;
+	}
+	memcpy(&src, frame + 12, sizeof(src));
+	memcpy(&dst, frame + 16, sizeof(dst));
+
+	/* only what the config entry routes behind this guest */
+	if (src != sc->remote && sc->netmask != 0
+	 && (src & sc->netmask) == sc->net) {
+		fwd_learn(&shm->fwd, FWD_KEY(FWD_T_IP4, sc->vlan, src),
+			FWD_VAL(sc->slot, shm->sess[sc->slot].gen), now);
+	}
+
+	if (MCAST(dst) || dst == INADDR_BROADCAST) {
+		mcast_snoop(&shm->mcast, sc->slot, frame, len, now);
+		switch_flood(sc, frame, len, dst);
+		return 0;
+	}
+
+	peer = sess_byval(fwd_lookup(&shm->fwd,
+			FWD_KEY(FWD_T_IP4, sc->vlan, dst), now));
+	if (peer < 0 || !switch_peer(sc, peer)) {
+		return 0;
+	}
+	if ((p = pkt_alloc(&shm->pool, sc->slot)) == NULL) {
+		sess_drop(sc, DIR_HOST);
+		return 1;
+	}
+	memcpy(p->data, frame, len);
+	p->src = sc->slot;
+	p->len = len;
+	switch_send(sc, p, peer);
+	pkt_release(&shm->pool, p, sc->slot);
+	return 1;
+}
+
+/*
+ * Receive a frame from a peer session.  Returns NULL if there is none;
+ * otherwise the caller must pkt_release() it when done.
+ */
+struct pkt *switch_recv(slipconn *sc)
+{
+	struct pkt *p;
+	uint32_t idx;
+
+	while (recv(sc->swfd, &idx, sizeof(idx), MSG_DONTWAIT)
+			== sizeof(idx)) {
+		if (idx >= POOL_SIZE) {
+			continue;
+		}
+		p = &shm->pool.pkt[idx];
+		if (pkt_held(p, sc->slot)) {
+			return p;
+		}
+	}
+	return NULL;
+}
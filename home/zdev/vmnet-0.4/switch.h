@@ -0,0 +1,21 @@
+/*
+ * VMnet -- guest to guest switching
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef SWITCH_H
+#define SWITCH_H
+
+#include "pkt.h"
+#include "vmnet.h"
+
+int switch_open(slipconn *sc);
+void switch_close(slipconn *sc);
+int switch_frame(slipconn *sc, unsigned char *frame, int len);
+struct pkt *switch_recv(slipconn *sc);
+
+#endif
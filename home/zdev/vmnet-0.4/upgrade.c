@@ -0,0 +1,544 @@
+/*
+ * VMnet -- live upgrade
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Sending vmnet a SIGUSR2 replaces it by the binary installed as
+ * VMNET_BINARY, without taking the SLIP interface down:
+ *
+ *  - the old vmnet forks and executes the new binary as "vmnet -R 3",
+ *    with nothing but stderr and one end of a socketpair on fd 3;
+ *  - it sends its session state, the data it still had buffered or
+ *    queued, and its file descriptors (stdin, stdout, the pty pair,
+ *    the switch socket and the proxy ARP socket) over the socket, the
+ *    descriptors with SCM_RIGHTS;
+ *  - the new vmnet takes over the session slot in the shared segment
+ *    and answers with one byte, then takes over the old one's counters
+ *    (stats.c);
+ *  - the old vmnet exits quietly, without slip_stop(), and the new one
+ *    carries on relaying.
+ *
+ * If anything goes wrong before the answer, the new process gives the
+ * slot back and exits, and the old one continues as if nothing
+ * happened.  If no answer comes within 5 seconds, the old vmnet kills
+ * the new one and takes the slot back itself.
+ *
+ * Note that the new vmnet has a different process id, so the emulator
+ * sees its child exit.  It does not need to care: the pipes stay open.
+ *
+ * The state is sent field by field in struct handoff, so slipconn and
+ * friends are free to change between versions; HANDOFF_VERSION only
+ * has to change with struct handoff itself.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "arp.h"
+#include "dns.h"
+#include "flow.h"
+#include "log.h"
+#include "buf.h"
+#include "shm.h"
+#include "stats.h"
+#include "upgrade.h"
+
+#define HANDOFF_NFDS	6
+
+struct handoff {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	int32_t unit;
+	int32_t oldldisc;
+	int32_t slot;
+	int32_t flags;
+	int32_t vlan;
+	int32_t weight;
+	uint32_t rate[2];
+	uint32_t burst[2];
+	uint32_t prioflags;
+	uint32_t prioratio;
+	uint32_t priosmall;
+	uint32_t nports;
+	uint32_t port[PRIO_PORTS];
+	int32_t nfds;
+	int32_t swfd;		/* index in the fds passed, -1 if none */
+	int32_t arpfd;		/* likewise */
+	uint32_t remote;
+	uint32_t local;
+	uint32_t net;
+	uint32_t netmask;
+	char username[128];
+	char remoteip[64];
+	char localip[64];
+	char script[256];
+	char arpif[16];
+	char logto[128];
+	char flowto[128];
+	int32_t flows;
+	int32_t buflen[4];
+	int32_t declen[2];
+	int32_t decesc[2];
+	int32_t dectoolong[2];
+	int32_t nqueued[2];	/* frames queued, by DIR_*, see qframe */
+};
+
+/* what precedes each queued frame */
+struct qframe {
+	uint16_t band;
+	uint16_t cls;
+	uint16_t len;
+};
+
+static int writeall(int fd, const void *p, int len)
+{
+	int r;
+
+	while (len > 0) {
+		r = write(fd, p, len);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			return -1;
+		}
+		p = (const char *)p + r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int readall(int fd, void *p, int len)
+{
+	int r;
+
+	while (len > 0) {
+		r = read(fd, p, len);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			return -1;
+		}
+		p = (char *)p + r;
+		len -= r;
+	}
+	return 0;
+}
+
+/* Send the frames of a queue, by band and class, in queue order */
+static int send_queue(int fd, struct drr *d)
+{
+	struct drrclass *c;
+	struct qframe q;
+	uint16_t e;
+	int b, i, j;
+
+	for (b = 0; d != NULL && b < DRR_BANDS; b++) {
+		for (i = 0; i < DRR_CLASSES; i++) {
+			c = &d->cls[b][i];
+			e = c->head;
+			for (j = 0; j < c->count; j++) {
+				q.band = b;
+				q.cls = i;
+				q.len = d->ent[e].len;
+				if (writeall(fd, &q, sizeof(q)) < 0
+				 || writeall(fd, d->ent[e].frame, q.len) < 0) {
+					return -1;
+				}
+				e = d->ent[e].next;
+			}
+		}
+	}
+	return 0;
+}
+
+static int send_state(int fd, slipconn *sc, struct relaystate *rs)
+{
+	struct handoff h;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(HANDOFF_NFDS * sizeof(int))];
+	int fds[HANDOFF_NFDS];
+	int i, n;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = HANDOFF_MAGIC;
+	h.version = HANDOFF_VERSION;
+	h.pid = getpid();
+	h.unit = sc->unit;
+	h.oldldisc = sc->oldldisc;
+	h.slot = sc->slot;
+	h.flags = sc->flags;
+	h.vlan = sc->vlan;
+	h.weight = sc->weight;
+	h.prioflags = sc->prio.flags;
+	h.prioratio = sc->prio.ratio;
+	h.priosmall = sc->prio.small;
+	h.nports = sc->prio.nports;
+	memcpy(h.port, sc->prio.port, sizeof(h.port));
+	for (i = 0; i < 2; i++) {
+		h.rate[i] = sc->limit[i].rate;
+		h.burst[i] = sc->limit[i].burst;
+	}
+	h.remote = sc->remote;
+	h.local = sc->local;
+	h.net = sc->net;
+	h.netmask = sc->netmask;
+	strncpy(h.username, sc->username, sizeof(h.username)-1);
+	inet_ntop(AF_INET, &sc->remote, h.remoteip, sizeof(h.remoteip));
+	inet_ntop(AF_INET, &sc->local, h.localip, sizeof(h.localip));
+	strncpy(h.script, sc->script, sizeof(h.script)-1);
+	strncpy(h.arpif, sc->arpif, sizeof(h.arpif)-1);
+	strncpy(h.logto, sc->logto, sizeof(h.logto)-1);
+	strncpy(h.flowto, sc->flowto, sizeof(h.flowto)-1);
+	h.flows = sc->flows;
+	for (i = 0; i < 4; i++) {
+		bufroom(rs->buf[i]);
+		h.buflen[i] = rs->buf[i]->len;
+	}
+	for (i = 0; i < 2; i++) {
+		h.declen[i] = rs->dec[i]->len > 0 ? rs->dec[i]->len : 0;
+		h.decesc[i] = rs->dec[i]->esc;
+		h.dectoolong[i] = rs->dec[i]->toolong;
+	}
+	for (i = 0; i < 2; i++) {
+		h.nqueued[i] = rs->q[i] != NULL ? rs->q[i]->frames : 0;
+	}
+
+	n = 0;
+	fds[n++] = 0;
+	fds[n++] = 1;
+	fds[n++] = sc->masterfd;
+	fds[n++] = sc->slavefd;
+	h.swfd = h.arpfd = -1;
+	if (sc->swfd >= 0) {
+		h.swfd = n;
+		fds[n++] = sc->swfd;
+	}
+	if (sc->arpfd >= 0) {
+		h.arpfd = n;
+		fds[n++] = sc->arpfd;
+	}
+	h.nfds = n;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &h;
+	iov.iov_len = sizeof(h);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+
+	if ((n = sendmsg(fd, &msg, 0)) < 0) {
+		return -1;
+	}
+	if (writeall(fd, (char *)&h + n, sizeof(h) - n) < 0) {
+		return -1;
+	}
+	for (i = 0; i < 4; i++) {
+		if (writeall(fd, rs->buf[i]->ptr, h.buflen[i]) < 0) {
+			return -1;
+		}
+	}
+	for (i = 0; i < 2; i++) {
+		if (writeall(fd, rs->dec[i]->frame, h.declen[i]) < 0) {
+			return -1;
+		}
+	}
+	for (i = 0; i < 2; i++) {
+		if (send_queue(fd, rs->q[i]) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Old side: start the new binary and hand everything over.  Only
+ * returns if the upgrade failed.
+ */
+void upgrade_start(slipconn *sc, struct relaystate *rs)
+{
+	struct pollfd pfd;
+	int sv[2], i;
+	pid_t pid;
+	char ack;
+	unsigned char *frame;
+	uint32_t stamp;
+	int len;
+
+	if (sc->flags & CFG_NAT) {
+		/* the NAT's sockets and state do not move */
+		logmsg(LM_UPGRADE, "user mode", 0, 0, 0);
+		return;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		logmsg(LM_UPGRADE, "socketpair", 0, 0, errno);
+		return;
+	}
+	pid = fork();
+	if (pid < 0) {
+		logmsg(LM_UPGRADE, "fork", 0, 0, errno);
+		close(sv[0]);
+		close(sv[1]);
+		return;
+	}
+	if (pid == 0) {
+		/* keep only stderr, and the socket on HANDOFF_FD */
+		dup2(sv[1], HANDOFF_FD);
+		close(0);
+		close(1);
+		close_range(HANDOFF_FD + 1, ~0U, 0);
+		execl(VMNET_BINARY, "vmnet", "-R", "3", (char *)NULL);
+		perror("vmnet: upgrade exec " VMNET_BINARY);
+		_exit(127);
+	}
+	close(sv[1]);
+
+	if (send_state(sv[0], sc, rs) == 0) {
+		pfd.fd = sv[0];
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 5000) == 1 && read(sv[0], &ack, 1) == 1) {
+			/* the new vmnet owns the session now */
+			for (i = 0; i < 4; i++) {
+				bufdrop(rs->buf[i]);
+			}
+			for (i = 0; i < 2; i++) {
+				if (rs->dec[i]->frame != NULL) {
+					framebuf_put(rs->dec[i]->frame);
+				}
+			}
+			for (i = 0; i < 2; i++) {
+				while (rs->q[i] != NULL && (frame =
+				    drr_dequeue(rs->q[i], 0, &len, &stamp))
+						!= NULL) {
+					framebuf_put(frame);
+				}
+			}
+			flow_close();
+			log_close();
+			_exit(0);
+		}
+	}
+	logmsg(LM_UPGRADE, "no handoff", 0, 0, 0);
+	close(sv[0]);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	/* it may have got as far as taking over the slot */
+	sess_handback(sc, pid, getpid());
+}
+
+/* Queue the frames the old vmnet had queued in direction dir */
+static int recv_queue(int fd, struct relaystate *rs, struct handoff *h,
+	int dir)
+{
+	struct qframe q;
+	unsigned char *frame;
+	int i, weight;
+
+	if (h->nqueued[dir] < 0 || h->nqueued[dir] > DRR_FRAMES) {
+		return -1;
+	}
+	if (h->nqueued[dir] > 0 && (rs->q[dir] = drr_new()) == NULL) {
+		return -1;
+	}
+	for (i = 0; i < h->nqueued[dir]; i++) {
+		if (readall(fd, &q, sizeof(q)) < 0 || q.band >= DRR_BANDS
+		 || q.cls >= DRR_CLASSES || q.len > SLIP_MAXFRAME) {
+			return -1;
+		}
+		frame = framebuf_get();
+		if (readall(fd, frame, q.len) < 0) {
+			return -1;
+		}
+		if (dir == DIR_HOST) {
+			weight = 1;
+		} else if (q.cls == DRR_HOST) {
+			weight = h->weight;
+		} else {
+			weight = shm != NULL ? shm->sess[q.cls].weight : 1;
+		}
+		if (drr_enqueue(rs->q[dir], q.band, q.cls, weight, frame,
+				q.len, lat_now()) < 0) {
+			framebuf_put(frame);
+		}
+	}
+	return 0;
+}
+
+static int recv_state(int fd, slipconn *sc, struct relaystate *rs,
+	struct handoff *h)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(HANDOFF_NFDS * sizeof(int))];
+	int fds[HANDOFF_NFDS];
+	int i, n, nfds = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = h;
+	iov.iov_len = sizeof(*h);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if ((n = recvmsg(fd, &msg, 0)) <= 0) {
+		return -1;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET
+		 && cmsg->cmsg_type == SCM_RIGHTS) {
+			nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+		}
+	}
+	if (readall(fd, (char *)h + n, sizeof(*h) - n) < 0
+	 || h->magic != HANDOFF_MAGIC || h->version != HANDOFF_VERSION
+	 || h->nfds != nfds || nfds < 4
+	 || h->swfd >= nfds || h->arpfd >= nfds) {
+		return -1;
+	}
+
+	for (i = 0; i < 4; i++) {
+		if (h->buflen[i] < 0 || h->buflen[i] > BUF_SIZE) {
+			return -1;
+		}
+		if (h->buflen[i] > 0
+		 && readall(fd, bufget(rs->buf[i]), h->buflen[i]) < 0) {
+			return -1;
+		}
+		rs->buf[i]->len = h->buflen[i];
+	}
+	for (i = 0; i < 2; i++) {
+		if (h->declen[i] < 0 || h->declen[i] > SLIP_MAXFRAME) {
+			return -1;
+		}
+		if (h->declen[i] > 0) {
+			rs->dec[i]->frame = framebuf_get();
+			if (readall(fd, rs->dec[i]->frame, h->declen[i]) < 0) {
+				return -1;
+			}
+		}
+		rs->dec[i]->len = h->declen[i];
+		rs->dec[i]->esc = h->decesc[i];
+		rs->dec[i]->toolong = h->dectoolong[i];
+	}
+
+	if (recv_queue(fd, rs, h, DIR_HOST) < 0
+	 || recv_queue(fd, rs, h, DIR_GUEST) < 0) {
+		return -1;
+	}
+
+	/* our stdin and stdout are closed, so these land on 0 and 1 */
+	dup2(fds[0], 0);
+	dup2(fds[1], 1);
+	for (i = 0; i < 2; i++) {
+		if (fds[i] > 1) {
+			close(fds[i]);
+		}
+	}
+	sc->masterfd = fds[2];
+	sc->slavefd = fds[3];
+	sc->swfd = h->swfd >= 4 ? fds[h->swfd] : -1;
+	sc->arpfd = h->arpfd >= 4 ? fds[h->arpfd] : -1;
+
+	sc->unit = h->unit;
+	sc->oldldisc = h->oldldisc;
+	sc->slot = h->slot;
+	sc->flags = h->flags;
+	sc->vlan = h->vlan;
+	sc->weight = h->weight;
+	sc->prio.flags = h->prioflags;
+	sc->prio.ratio = h->prioratio;
+	sc->prio.small = h->priosmall;
+	sc->prio.nports = h->nports < PRIO_PORTS ? h->nports : PRIO_PORTS;
+	memcpy(sc->prio.port, h->port, sizeof(sc->prio.port));
+	for (i = 0; i < 2; i++) {
+		bucket_init(&sc->limit[i], h->rate[i], h->burst[i]);
+	}
+	sc->remote = h->remote;
+	sc->local = h->local;
+	sc->net = h->net;
+	sc->netmask = h->netmask;
+	h->username[sizeof(h->username)-1] = '\0';
+	h->script[sizeof(h->script)-1] = '\0';
+	h->arpif[sizeof(h->arpif)-1] = '\0';
+	h->logto[sizeof(h->logto)-1] = '\0';
+	h->flowto[sizeof(h->flowto)-1] = '\0';
+	sc->username = intern(h->username);
+	sc->script = intern(h->script);
+	sc->arpif = intern(h->arpif);
+	sc->logto = intern(h->logto);
+	sc->flowto = intern(h->flowto);
+	sc->flows = h->flows;
+	return 0;
+}
+
+/*
+ * New side, "vmnet -R fd": take over from the vmnet that started us.
+ * Since the state includes the script to run as root, we only accept
+ * it from a root process that is our parent.
+ */
+void upgrade_resume(slipconn *sc, struct relaystate *rs, int fd)
+{
+	struct handoff h;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	char ack = 1;
+	int counting;
+
+	if (getuid() != 0
+	 || getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0
+	 || cred.uid != 0 || cred.pid != getppid()) {
+		fprintf(stderr, "vmnet: -R is for vmnet's own use\n");
+		exit(1);
+	}
+	shm_attach();
+	if (recv_state(fd, sc, rs, &h) < 0) {
+		fprintf(stderr, "vmnet: bad upgrade state\n");
+		exit(1);
+	}
+	sess_resume(sc, h.pid);
+	if (sc->slot < 0 && sc->swfd >= 0) {
+		/* the socket is still bound to the old slot's name */
+		close(sc->swfd);
+		sc->swfd = -1;
+	}
+	arp_resume(sc);
+	dns_open(sc);	/* queries still out are lost, the guest retries */
+	counting = stats_open(sc) == 0;
+	/* what is still in the output buffers is timed from now on */
+	lat_queue(DIR_HOST, rs->buf[3]->len, lat_now());
+	lat_queue(DIR_GUEST, rs->buf[1]->len, lat_now());
+
+	if (write(fd, &ack, 1) != 1) {
+		/* the old vmnet carries on */
+		sess_handback(sc, getpid(), h.pid);
+		stats_close();
+		exit(1);
+	}
+	close(fd);
+	if (counting) {
+		stats_resume(h.pid);
+	}
+}
@@ -0,0 +1,33 @@
+/*
+ * VMnet -- live upgrade
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include "buf.h"
+#include "drr.h"
+#include "slip.h"
+#include "vmnet.h"
+
+#define HANDOFF_MAGIC	0x766d6866	/* "vmhf" */
+#define HANDOFF_VERSION	9
+#define HANDOFF_FD	3	/* where the new vmnet finds the socket */
+
+/* the relay state that moves to the new process along with the fds */
+struct relaystate {
+	struct buf *buf[4];		/* gin, gout, hin, hout */
+	struct slipdec *dec[2];		/* gdec, hdec */
+	struct drr *q[2];		/* queued frames by DIR_*, or NULL */
+	unsigned int qused[2];		/* now, when q[] last held frames */
+};
+
+void upgrade_start(slipconn *sc, struct relaystate *rs);
+void upgrade_resume(slipconn *sc, struct relaystate *rs, int fd);
+
+#endif
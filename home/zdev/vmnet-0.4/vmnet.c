@@ -55,42 +55,56 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 #include <sys/ioctl.h>
 #include <sys/select.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
+#include "arp.h"
+#include "buf.h"
+#include "capture.h"
 #include "config.h"
-
-struct buf {
-	int len;
-	char *ptr;
-	char data[16*1024];
-};
-
-typedef struct slipconnection {
-	int masterfd;
-	int slavefd;
-	int unit;
-	int oldldisc;
-	char username[128];
-	char remoteip[64];
-	char localip[64];
-	char script[256];
-} slipconn;
-
-typedef struct {
-	char username[128];
-	char remoteip[64];
-	char localip[64];
-	char script[256];
-} cfgentry;
+#include "dns.h"
+#include "drr.h"
+#include "flight.h"
+#include "flow.h"
+#include "log.h"
+#include "metrics.h"
+#include "nat.h"
+#include "perf.h"
+#include "stats.h"
+#include "prio.h"
+#include "probes.h"
+#include "vmnet.h"
+#include "shm.h"
+#include "slip.h"
+#include "stall.h"
+#include "switch.h"
+#include "upgrade.h"
 
 int go = 1;
+int upgrade = 0;
+int capture = 0;
+unsigned int now;
+unsigned int nowms;
 
 void sig_catch(int sig)
 {
-	/* just die gently on any signal... */
+	FLIGHT(FL_SIGNAL, 0, sig, 0);
+	if (sig == SIGUSR2) {
+		upgrade = 1;
+		return;
+	}
+	if (sig == SIGUSR1) {
+		capture = 1;
+		return;
+	}
+	/* just die gently on any other signal... */
 	go = 0;
 }
 
@@ -110,6 +124,8 @@ void sig_setup()
 	sigaction(SIGINT, &sa, 0);
 	sigaction(SIGTERM, &sa, 0);
 	sigaction(SIGQUIT, &sa, 0);
+	sigaction(SIGUSR1, &sa, 0);
+	sigaction(SIGUSR2, &sa, 0);
 }
 
 /* Read one line of data, no buffering */
@@ -127,40 +143,218 @@ int readline(int fd, char *buf, int len)
 	return n;
 }
 
+/*
+ * The name of a dump file: fmt with the directory for it and id.  As
+ * root that is VMNET_RUNDIR, where nobody else can put anything in
+ * our way; a user mode vmnet has to make do with DUMP_USERDIR.
+ */
+void dumppath(char *buf, int len, const char *fmt, int id)
+{
+	const char *dir = DUMP_USERDIR;
+
+	if (geteuid() == 0
+	 && (mkdir(VMNET_RUNDIR, 0700) == 0 || errno == EEXIST)) {
+		dir = VMNET_RUNDIR;
+	}
+	snprintf(buf, len, fmt, dir, id);
+}
+
+/*
+ * Create a dump file, readable by us only.  Never through a symlink,
+ * and never one that somebody else created first: whatever is there
+ * (left over from an earlier process with our pid, or put there to
+ * catch us) is removed, and if something is back by the next try, we
+ * give up.  Safe in a signal handler.
+ */
+int dumpopen(const char *path)
+{
+	int fd, i;
+
+	for (i = 0; i < 2; i++) {
+		fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC,
+			0600);
+		if (fd >= 0 || errno != EEXIST) {
+			return fd;
+		}
+		unlink(path);
+	}
+	return -1;
+}
+
+/* "ADDR/BITS", for subnet= */
+static int subnet_parse(const char *s, in_addr_t *net, in_addr_t *mask)
+{
+	char addr[INET_ADDRSTRLEN];
+	const char *slash = strchr(s, '/');
+	struct in_addr a;
+	int bits;
+
+	if (slash == NULL || slash - s >= (int)sizeof(addr)) {
+		return -1;
+	}
+	memcpy(addr, s, slash - s);
+	addr[slash - s] = '\0';
+	bits = atoi(slash + 1);
+	if (bits < 1 || bits > 32 || inet_pton(AF_INET, addr, &a) != 1) {
+		return -1;
+	}
+	*mask = htonl(0xffffffffU << (32 - bits));
+	*net = a.s_addr & *mask;
+	return 0;
+}
+
+/* Parse the options following the command field of a config entry */
+void cfgoptions(cfgentry *cfg, char *p)
+{
+	char *opt, *val;
+	int dir, n;
+
+	for (opt = strtok(p, " \t\n"); opt; opt = strtok(NULL, " \t\n")) {
+		val = strchr(opt, '=');
+		if (val) {
+			*val++ = '\0';
+		}
+		if (!strcmp(opt, "switch")) {
+			if (val == NULL || !strcmp(val, "on")) {
+				cfg->flags |= CFG_SWITCH;
+			}
+		} else if (!strcmp(opt, "dns")) {
+			if (val == NULL || !strcmp(val, "on")) {
+				cfg->flags |= CFG_DNS;
+			}
+		} else if (!strcmp(opt, "perf")) {
+			if (val == NULL || !strcmp(val, "on")) {
+				cfg->flags |= CFG_PERF;
+			}
+		} else if (!strcmp(opt, "proxyarp") && val != NULL) {
+			if (strlen(val) >= sizeof(cfg->arpif)) {
+				fprintf(stderr, "Bad interface '%s' in %s\n",
+					val, CONFIG_FILE);
+			} else {
+				strcpy(cfg->arpif, val);
+			}
+		} else if (!strcmp(opt, "log") && val != NULL) {
+			if (logtarget(val) < 0
+			 || strlen(val) >= sizeof(cfg->logto)) {
+				fprintf(stderr, "Bad log '%s' in %s\n",
+					val, CONFIG_FILE);
+			} else {
+				strcpy(cfg->logto, val);
+			}
+		} else if (!strcmp(opt, "flows") && val != NULL) {
+			if (flow_parse(val, &cfg->flows, cfg->flowto,
+					sizeof(cfg->flowto)) < 0) {
+				fprintf(stderr, "Bad flows '%s' in %s\n",
+					val, CONFIG_FILE);
+				cfg->flows = 0;
+			}
+		} else if (!strcmp(opt, "subnet") && val != NULL) {
+			if (subnet_parse(val, &cfg->net, &cfg->netmask) < 0) {
+				fprintf(stderr, "Bad subnet '%s' in %s\n",
+					val, CONFIG_FILE);
+			}
+		} else if (!strcmp(opt, "vlan") && val != NULL) {
+			cfg->vlan = atoi(val);
+			if (cfg->vlan < 1 || cfg->vlan > 4094) {
+				fprintf(stderr, "Bad vlan '%s' in %s\n",
+					val, CONFIG_FILE);
+				cfg->vlan = 0;
+			}
+		} else if (!strcmp(opt, "weight") && val != NULL) {
+			cfg->weight = atoi(val);
+			if (cfg->weight < 1 || cfg->weight > DRR_MAXWEIGHT) {
+				fprintf(stderr, "Bad weight '%s' in %s\n",
+					val, CONFIG_FILE);
+				cfg->weight = 1;
+			}
+		} else if (!strcmp(opt, "prio") && val != NULL) {
+			if (prio_parse(&cfg->prio, val) < 0) {
+				fprintf(stderr, "Bad prio rules '%s' in %s\n",
+					val, CONFIG_FILE);
+			}
+		} else if (!strcmp(opt, "prioratio") && val != NULL) {
+			n = atoi(val);
+			if (n < 0 || n > 255) {
+				fprintf(stderr, "Bad prioratio '%s' in %s\n",
+					val, CONFIG_FILE);
+			} else {
+				cfg->prio.ratio = n;
+			}
+		} else if ((!strcmp(opt, "txrate") || !strcmp(opt, "rxrate"))
+			&& val != NULL) {
+			dir = opt[0] == 't' ? DIR_HOST : DIR_GUEST;
+			if (rate_parse(val, &cfg->rate[dir], &cfg->burst[dir])
+					< 0) {
+				fprintf(stderr, "Bad rate '%s' in %s\n",
+					val, CONFIG_FILE);
+				cfg->rate[dir] = 0;
+			}
+		} else {
+			fprintf(stderr, "Unknown option '%s' in %s\n",
+				opt, CONFIG_FILE);
+		}
+	}
+}
+
+static FILE *cfgfp = NULL;
+
 cfgentry *getcfgentry(cfgentry *cfg)
 {
-	static FILE *fp = NULL;
 	char linebuffer[1024];
-	int r;
+	int r, n;
 
-	if (fp == NULL) {
-		fp = fopen(CONFIG_FILE, "r");
-		if (fp == NULL) {
+	if (cfgfp == NULL) {
+		cfgfp = fopen(CONFIG_FILE, "r");
+		if (cfgfp == NULL) {
 			perror("Cannot open configuration file:");
 			exit(1);
 		}
 	}
 
 	while (1) {
-		if (fgets(linebuffer, sizeof(linebuffer), fp) == NULL) {
-			fclose(fp);
-			fp = NULL;
+		if (fgets(linebuffer, sizeof(linebuffer), cfgfp) == NULL) {
+			endcfgentry();
 			return NULL;
 		}
 		cfg->script[0] = '\0';
-		r = sscanf(linebuffer, "%127s %63s %63s %255s\n", cfg->username,
-			cfg->remoteip, cfg->localip, cfg->script);
+		cfg->arpif[0] = '\0';
+		cfg->logto[0] = '\0';
+		cfg->flowto[0] = '\0';
+		cfg->flags = 0;
+		cfg->flows = 0;
+		cfg->vlan = 0;
+		cfg->weight = 1;
+		cfg->net = cfg->netmask = 0;
+		memset(cfg->rate, 0, sizeof(cfg->rate));
+		memset(cfg->burst, 0, sizeof(cfg->burst));
+		prio_default(&cfg->prio);
+		n = 0;
+		r = sscanf(linebuffer, "%127s %63s %63s %255s%n", cfg->username,
+			cfg->remoteip, cfg->localip, cfg->script, &n);
 		if (r >= 3 && cfg->username[0] != '#') {
+			if (r == 4 && n > 0) {
+				cfgoptions(cfg, linebuffer + n);
+			}
 			return cfg;
 		}
 	}
 }
 
+/* Stop reading the config file, the next getcfgentry() starts over */
+void endcfgentry(void)
+{
+	if (cfgfp != NULL) {
+		fclose(cfgfp);
+		cfgfp = NULL;
+	}
+}
+
 cfgentry *getcfgbyid(cfgentry *cfg, char *username, char *remoteip)
 {
 	while (getcfgentry(cfg) != NULL) {
 		if (!strcmp(username, cfg->username)
 		 && !strcmp(remoteip, cfg->remoteip)) {
+			endcfgentry();
 			return cfg;
 		}
 	}
@@ -172,21 +366,116 @@ void login(slipconn *sc)
 	int n;
 	struct passwd *pw;
 	cfgentry cfg;
+	char remoteip[64];
+
+	sc->slot = -1;
+	sc->swfd = -1;
+	sc->arpfd = -1;
 
 	pw = getpwuid(getuid());
-	strncpy(sc->username, pw->pw_name, sizeof(sc->username)-1);
 
-	n = readline(0, sc->remoteip, sizeof(sc->remoteip));
-	sc->remoteip[n-1] = '\0';	/* strip newline */
+	n = readline(0, remoteip, sizeof(remoteip));
+	remoteip[n > 0 ? n-1 : 0] = '\0';	/* strip newline */
 
-	if (getcfgbyid(&cfg, sc->username, sc->remoteip) == NULL) {
+	if (getcfgbyid(&cfg, pw->pw_name, remoteip) == NULL) {
 		fprintf(stderr,
 			"Remote IP address '%s' not found for user '%s'\n",
-			sc->remoteip, sc->username);
+			remoteip, pw->pw_name);
 		exit(1);
 	}
-	strncpy(sc->localip, cfg.localip, sizeof(sc->localip));
-	strncpy(sc->script, cfg.script, sizeof(sc->script));
+	if (inet_pton(AF_INET, cfg.remoteip, &sc->remote) != 1
+	 || inet_pton(AF_INET, cfg.localip, &sc->local) != 1) {
+		fprintf(stderr, "Bad IP address in entry '%s' for user '%s'\n",
+			remoteip, pw->pw_name);
+		exit(1);
+	}
+	sc->flags = cfg.flags;
+	sc->vlan = cfg.vlan;
+	sc->weight = cfg.weight;
+	sc->net = cfg.net;
+	sc->netmask = cfg.netmask;
+	sc->prio = cfg.prio;
+	for (n = 0; n < 2; n++) {
+		bucket_init(&sc->limit[n], cfg.rate[n], cfg.burst[n]);
+	}
+	sc->username = intern(pw->pw_name);
+	sc->script = intern(cfg.script);
+	sc->arpif = intern(cfg.arpif);
+	sc->logto = intern(cfg.logto);
+	sc->flowto = intern(cfg.flowto);
+	sc->flows = cfg.flows;
+}
+
+/*
+ * "vmnet -u": user mode NAT.  No config entry and no privileges: the
+ * guest gets whatever address it asks for, and talks to the world
+ * through our own sockets, see nat.c.  The arguments after -u are
+ * "-p PROTO:[ADDR:]HOSTPORT:GUESTPORT" for ports to forward.
+ */
+void userlogin(slipconn *sc, int argc, char **argv)
+{
+	static char flowto[128];
+	char remoteip[64];
+	int i, n;
+
+	/* a setuid root vmnet drops that for good, first thing */
+	if (setgid(getgid()) < 0 || setuid(getuid()) < 0) {
+		perror("vmnet: setuid");
+		exit(1);
+	}
+	n = readline(0, remoteip, sizeof(remoteip));
+	remoteip[n > 0 ? n-1 : 0] = '\0';	/* strip newline */
+	if (inet_pton(AF_INET, remoteip, &sc->remote) != 1) {
+		fprintf(stderr, "Bad IP address '%s'\n", remoteip);
+		exit(1);
+	}
+	sc->local = INADDR_ANY;
+	sc->masterfd = sc->slavefd = -1;
+	sc->swfd = sc->arpfd = -1;
+	sc->unit = -1;
+	sc->slot = -1;
+	sc->flags = CFG_NAT;
+	sc->vlan = 0;
+	sc->weight = 1;
+	sc->net = sc->netmask = 0;
+	bucket_init(&sc->limit[DIR_HOST], 0, 0);
+	bucket_init(&sc->limit[DIR_GUEST], 0, 0);
+	prio_default(&sc->prio);
+	sc->username = sc->script = sc->arpif = sc->logto = "";
+	sc->flowto = "";
+	sc->flows = 0;
+	nat_open(sc);
+	PROBE2(session_start, sc->unit, sc->remote);
+	for (i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], "-P")) {
+			sc->flags |= CFG_PERF;
+			continue;
+		}
+		if (!strcmp(argv[i], "-l") && i + 1 < argc
+		 && logtarget(argv[i + 1]) == 0) {
+			sc->logto = argv[++i];
+			continue;
+		}
+		if (!strcmp(argv[i], "-F") && i + 1 < argc
+		 && flow_parse(argv[i + 1], &sc->flows, flowto,
+				sizeof(flowto)) == 0) {
+			sc->flowto = flowto;
+			i++;
+			continue;
+		}
+		if (strcmp(argv[i], "-p") || i + 1 == argc) {
+			fprintf(stderr, "usage: vmnet -u [-P] "
+				"[-l stderr|syslog|journal|/path]\n\t[-F "
+				"N[,/path|,addr:port]] [-p "
+				"tcp|udp:[addr:]hostport:guestport]...\n");
+			exit(1);
+		}
+		if (nat_forward(argv[++i]) < 0) {
+			fprintf(stderr, "vmnet: port %s: %s\n", argv[i],
+				strerror(errno));
+			exit(1);
+		}
+	}
 }
 
 int open_pty_pair(int *masterp, int *slavep)
@@ -290,14 +579,17 @@ int slip_setup(slipconn *sc)
 void interface_start(slipconn *sc)
 {
 	char buf[1024];
+	char remoteip[INET_ADDRSTRLEN], localip[INET_ADDRSTRLEN];
 
+	inet_ntop(AF_INET, &sc->remote, remoteip, sizeof(remoteip));
+	inet_ntop(AF_INET, &sc->local, localip, sizeof(localip));
 	sprintf(buf, "%s sl%d %s pointopoint %s netmask 255.255.255.255 mtu 1500",
-		IFCONFIG, sc->unit, sc->localip, sc->remoteip);
+		IFCONFIG, sc->unit, localip, remoteip);
 	if (*sc->script) {
 		sprintf(buf+strlen(buf), " && %s up '%s' '%s'",
-			sc->script, sc->remoteip, sc->localip);
+			sc->script, remoteip, localip);
 	}
-	system(buf);
+	stall_system(buf);
 }
 
 void slip_start(slipconn *sc)
@@ -312,19 +604,22 @@ void slip_start(slipconn *sc)
 	tty_setup(sc);
 	slip_setup(sc);
 	interface_start(sc);
+	PROBE2(session_start, sc->unit, sc->remote);
 }
 
 void interface_stop(slipconn *sc)
 {
 	char buf[1024];
-	int uid;
+	char remoteip[INET_ADDRSTRLEN], localip[INET_ADDRSTRLEN];
 
+	inet_ntop(AF_INET, &sc->remote, remoteip, sizeof(remoteip));
+	inet_ntop(AF_INET, &sc->local, localip, sizeof(localip));
 	sprintf(buf, "%s sl%d down", IFCONFIG, sc->unit);
 	if (*sc->script) {
 		sprintf(buf+strlen(buf), " && %s down '%s' '%s'",
-			sc->script, sc->remoteip, sc->localip);
+			sc->script, remoteip, localip);
 	}
-	system(buf);
+	stall_system(buf);
 }
 
 void slip_release(slipconn *sc)
@@ -339,94 +634,535 @@ void slip_release(slipconn *sc)
 
 void slip_stop(slipconn *sc)
 {
+	struct vmsess *s;
+
+	PROBE2(session_stop, sc->unit, sc->remote);
+	flow_close();
+	log_close();
+	if (sc->flags & CFG_PERF) {
+		perf_close(sc);
+	}
+	if (shm != NULL && sc->slot >= 0) {
+		s = &shm->sess[sc->slot];
+		if (s->qdrops[DIR_HOST] || s->qdrops[DIR_GUEST]) {
+			fprintf(stderr, "vmnet: sl%d dropped %u frames from "
+				"the guest, %u to it\n", sc->unit,
+				s->qdrops[DIR_HOST], s->qdrops[DIR_GUEST]);
+		}
+	}
+	stats_close();
+	if (sc->flags & CFG_NAT) {
+		nat_close();
+		return;
+	}
+	dns_close();
+	arp_close(sc);
+	switch_close(sc);
+	sess_detach(sc);
 	interface_stop(sc);
 	slip_release(sc);
 }
 
-void bufread(slipconn *sc, int fd, struct buf *buf)
+void bufread(slipconn *sc, int fd, struct buf *buf, int dir)
 {
-	buf->len = read(fd, buf->data, sizeof(buf->data));
+	PROBE2(read_entry, dir, fd);
+	buf->len = read(fd, bufget(buf), BUF_SIZE);
+	PROBE3(read_return, dir, fd, buf->len);
+	FLIGHT(FL_READ, dir, buf->len, buf->len < 0 ? errno : 0);
+	STAT_ADD(stats->dir[dir].reads, 1);
 	if (buf->len < 0) {
-		perror("read");
+		logmsg(LM_READ, dir == DIR_HOST ? "guest" : "host", 0, 0,
+			errno);
+		flight_dump("read failed", errno);
 		slip_stop(sc);
 		exit(1);
 	}
+	lat_arrive(dir);
 	buf->ptr = buf->data;
 }
 
-void bufwrite(slipconn *sc, int fd, struct buf *buf)
+void bufwrite(slipconn *sc, int fd, struct buf *buf, int dir)
 {
 	int r;
 
+	PROBE3(write_entry, dir, fd, buf->len);
 	r = write(fd, buf->ptr, buf->len);
+	PROBE3(write_return, dir, fd, r);
+	FLIGHT(FL_WRITE, dir, r, buf->len);
+	STAT_ADD(stats->dir[dir].writes, 1);
 	if (r <= 0) {
-		perror("write");
+		logmsg(LM_WRITE, dir == DIR_HOST ? "host" : "guest", 0, 0,
+			r < 0 ? errno : 0);
+		flight_dump("write failed", r < 0 ? errno : 0);
 		slip_stop(sc);
 		exit(1);
 	}
+	if (r < buf->len) {
+		STAT_ADD(stats->dir[dir].partial, 1);
+	}
+	lat_written(dir, r);
 	buf->len -= r;
 	buf->ptr += r;
 }
 
-int main()
+/*
+ * Decode the next frame waiting in "in".  Returns its length, or 0 if
+ * "in" ran out first.
+ */
+int nextframe(struct buf *in, struct slipdec *dec)
 {
-	fd_set rfds, wfds, readfds, writefds;
-	int n;
-	struct buf stdinbuf, stdoutbuf;
+	int n, flen;
+
+	if (dec->frame == NULL) {
+		dec->frame = framebuf_get();
+	}
+	n = slip_decode(dec, (unsigned char *)in->ptr, in->len, &flen);
+	in->ptr += n;
+	in->len -= n;
+	return flen;
+}
+
+/* Not in the middle of a frame, no need to hold on to its buffer */
+void frameidle(struct slipdec *dec)
+{
+	if (dec->len <= 0 && dec->frame != NULL) {
+		framebuf_put(dec->frame);
+		dec->frame = NULL;
+	}
+}
+
+/* The queue in direction dir, made when there is something to put in it */
+struct drr *queue(struct relaystate *rs, int dir)
+{
+	if (rs->q[dir] == NULL && (rs->q[dir] = drr_new()) == NULL) {
+		logmsg(LM_NOMEM, "a queue", 0, 0, errno);
+		exit(1);
+	}
+	rs->qused[dir] = now;
+	return rs->q[dir];
+}
+
+/* Can source cls (any source, if cls < 0) queue a frame in direction dir? */
+int queueroom(struct relaystate *rs, int dir, int cls)
+{
+	return rs->q[dir] == NULL || drr_room(rs->q[dir], cls);
+}
+
+/*
+ * Queue a frame from source cls in direction dir, in the band its
+ * priority says.  Returns -1 if cls has no room left.
+ */
+int enqueue(slipconn *sc, struct relaystate *rs, int dir, int cls,
+	int weight, unsigned char *frame, int len, uint32_t stamp)
+{
+	int band = prio_band(&sc->prio, frame, len);
+
+	if (drr_enqueue(queue(rs, dir), band, cls, weight, frame, len,
+			stamp) < 0) {
+		return -1;
+	}
+	PROBE4(queue, dir, band, len, rs->q[dir]->frames);
+	FLIGHT(FL_QUEUE, dir, rs->q[dir]->frames, rs->q[dir]->bytes);
+	return 0;
+}
+
+/*
+ * An empty queue that nothing was put in for QUEUE_IDLE seconds need
+ * not be kept around.  Until then it is kept for the next frames: a
+ * drained queue is as good as a new one, and making one (10k) costs
+ * far more than queueing a frame.
+ */
+void queueidle(struct relaystate *rs, int dir)
+{
+	if (rs->q[dir] != NULL && rs->q[dir]->frames == 0
+	 && now - rs->qused[dir] >= QUEUE_IDLE) {
+		drr_free(rs->q[dir]);
+		rs->q[dir] = NULL;
+	}
+}
+
+/*
+ * Decode the frames from the guest, and pass them on to a peer or queue
+ * them for the host, as long as the host's queue has room and the rate
+ * limit allows.  Whatever is left in "in" stays there until the host
+ * has caught up.  The queue takes the decoder's frame buffer, the next
+ * frame gets a fresh one.
+ */
+void relay_guest(slipconn *sc, struct buf *in, struct slipdec *dec,
+	struct relaystate *rs)
+{
+	int flen;
+
+	while (in->len > 0 && queueroom(rs, DIR_HOST, 0)
+	    && bucket_ok(&sc->limit[DIR_HOST])) {
+		if ((flen = nextframe(in, dec)) == 0) {
+			continue;
+		}
+		PROBE2(frame, DIR_HOST, flen);
+		FLIGHT(FL_FRAME, DIR_HOST, flen, 0);
+		CAPTURE(CAP_GUEST, 0, dec->frame, flen);
+		STAT_ADD(stats->dir[DIR_HOST].frames, 1);
+		STAT_ADD(stats->dir[DIR_HOST].bytes, flen);
+		FLOW(DIR_HOST, dec->frame, flen);
+		bucket_take(&sc->limit[DIR_HOST], flen);
+		if (sc->flags & CFG_NAT) {
+			nat_input(sc, dec->frame, flen);
+			continue;
+		}
+		if ((sc->flags & CFG_DNS) && dns_input(sc, dec->frame, flen)) {
+			continue;
+		}
+		if (switch_frame(sc, dec->frame, flen)) {
+			continue;
+		}
+		/* our guest is the only source in this direction */
+		enqueue(sc, rs, DIR_HOST, 0, 1, dec->frame, flen,
+			lat_arrived(DIR_HOST));
+		dec->frame = NULL;
+	}
+	frameidle(dec);
+}
+
+/* Decode the frames from the host and queue them for the guest */
+void relay_host(slipconn *sc, struct buf *in, struct slipdec *dec,
+	struct relaystate *rs)
+{
+	int flen;
+
+	while (in->len > 0 && queueroom(rs, DIR_GUEST, DRR_HOST)) {
+		if ((flen = nextframe(in, dec)) == 0) {
+			continue;
+		}
+		PROBE2(frame, DIR_GUEST, flen);
+		FLIGHT(FL_FRAME, DIR_GUEST, flen, 0);
+		CAPTURE(CAP_HOST, 0, dec->frame, flen);
+		enqueue(sc, rs, DIR_GUEST, DRR_HOST, sc->weight, dec->frame,
+			flen, lat_arrived(DIR_GUEST));
+		dec->frame = NULL;
+	}
+	frameidle(dec);
+}
+
+/* Queue the frames the NAT, or the DNS cache, has for our guest */
+void nat_relay(slipconn *sc, struct relaystate *rs)
+{
+	unsigned char *frame;
+	int len;
+
+	while (queueroom(rs, DIR_GUEST, DRR_HOST)
+	    && (frame = nat_next(&len)) != NULL) {
+		CAPTURE(CAP_HOST, 0, frame, len);
+		enqueue(sc, rs, DIR_GUEST, DRR_HOST, sc->weight, frame, len,
+			lat_now());
+	}
+}
+
+/* Queue the frames that other sessions switched to our guest */
+void switch_input(slipconn *sc, struct relaystate *rs)
+{
+	struct pkt *p;
+	int weight;
+
+	while (queueroom(rs, DIR_GUEST, -1) && (p = switch_recv(sc)) != NULL) {
+		if (p->src < 0 || p->src >= MAXSESS) {
+			pkt_release(&shm->pool, p, sc->slot);
+			continue;
+		}
+		weight = shm->sess[p->src].weight;
+		CAPTURE(CAP_HOST, 0, p->data, p->len);
+		if (enqueue(sc, rs, DIR_GUEST, p->src, weight, p->data,
+		    p->len, lat_now()) < 0) {
+			/* this peer has had its share of the queue */
+			pkt_release(&shm->pool, p, sc->slot);
+			sess_drop(sc, DIR_GUEST);
+		}
+	}
+}
+
+/*
+ * Move queued frames into "out", in priority and fair order.  Only
+ * OUT_QUEUE bytes are let in ahead of the queue, so that a frame for
+ * band 0 that comes along later does not have to wait for all of it.
+ * Frames for the guest are subject to its rate limit.
+ */
+void output(slipconn *sc, struct relaystate *rs, int dir, struct buf *out)
+{
+	unsigned char *frame;
+	uint32_t stamp;
+	int len, n;
+
+	if (rs->q[dir] == NULL) {
+		return;
+	}
+	while (out->len < OUT_QUEUE
+	    && (dir != DIR_GUEST || bucket_ok(&sc->limit[DIR_GUEST]))
+	    && (frame = drr_dequeue(rs->q[dir], sc->prio.ratio, &len,
+			&stamp)) != NULL) {
+		if (dir == DIR_GUEST) {
+			bucket_take(&sc->limit[DIR_GUEST], len);
+			STAT_ADD(stats->dir[DIR_GUEST].frames, 1);
+			STAT_ADD(stats->dir[DIR_GUEST].bytes, len);
+			FLOW(DIR_GUEST, frame, len);
+		}
+		CAPTURE(dir == DIR_GUEST ? CAP_GUEST : CAP_HOST, 1, frame, len);
+		bufroom(out);
+		n = out->len;
+		bufputframe(out, frame, len);
+		lat_queue(dir, out->len - n, stamp);
+		framebuf_put(frame);
+	}
+}
+
+void tick(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	now = ts.tv_sec;
+	nowms = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * How long select() may sleep: forever, unless a rate limit is holding
+ * up data that could go once the bucket has refilled, or an empty
+ * queue is to be let go.
+ */
+struct timeval *timeout(slipconn *sc, struct buf *gin,
+	struct relaystate *rs, struct timeval *tv)
+{
+	int ms = -1, w, dir;
+
+	if (gin->len > 0 && (w = bucket_wait(&sc->limit[DIR_HOST])) > 0) {
+		ms = w;
+	}
+	for (dir = 0; dir < 2; dir++) {
+		if (rs->q[dir] != NULL && rs->q[dir]->frames == 0) {
+			w = (int)(rs->qused[dir] + QUEUE_IDLE - now) * 1000;
+			if (w < 0) {
+				w = 0;
+			}
+			if (ms < 0 || w < ms) {
+				ms = w;
+			}
+		}
+	}
+	if (rs->q[DIR_GUEST] != NULL && rs->q[DIR_GUEST]->frames > 0
+	 && (w = bucket_wait(&sc->limit[DIR_GUEST])) > 0
+	 && (ms < 0 || w < ms)) {
+		ms = w;
+	}
+	if ((sc->flags & CFG_NAT) && (w = nat_wait()) >= 0
+	 && (ms < 0 || w < ms)) {
+		ms = w;
+	}
+	if ((w = flow_wait()) >= 0 && (ms < 0 || w < ms)) {
+		ms = w;
+	}
+	if (ms < 0) {
+		return NULL;
+	}
+	tv->tv_sec = ms / 1000;
+	tv->tv_usec = ms % 1000 * 1000;
+	return tv;
+}
+
+int main(int argc, char **argv)
+{
+	fd_set readfds, writefds;
+	struct timeval tv;
+	int n, maxfd;
+	struct buf gin, gout, hin, hout;	/* from/to guest, from/to host */
+	struct slipdec gdec, hdec;
+	struct relaystate rs;
 	slipconn sc;
 
-	sig_setup();
-	login(&sc);
-	setuid(0);	/* set real uid to 0 for some ifconfig's */
-	slip_start(&sc);
+	bufinit(&gin);
+	bufinit(&gout);
+	bufinit(&hin);
+	bufinit(&hout);
+	slip_init(&gdec);
+	slip_init(&hdec);
+	rs.buf[0] = &gin;
+	rs.buf[1] = &gout;
+	rs.buf[2] = &hin;
+	rs.buf[3] = &hout;
+	rs.dec[0] = &gdec;
+	rs.dec[1] = &hdec;
+	rs.q[DIR_HOST] = NULL;
+	rs.q[DIR_GUEST] = NULL;
+	rs.qused[DIR_HOST] = rs.qused[DIR_GUEST] = 0;
 
-	FD_ZERO(&rfds);
-	FD_SET(sc.masterfd, &rfds);
-	FD_SET(0, &rfds);
-	FD_ZERO(&wfds);
+	sig_setup();
+	lat_init();
+	/* logging in sets up timers and tables (nat.c, shm.c) by it */
+	tick();
+	if (argc == 3 && !strcmp(argv[1], "-R")) {
+		/* we are the new binary of a live upgrade */
+		upgrade_resume(&sc, &rs, atoi(argv[2]));
+	} else if (argc == 3 && !strcmp(argv[1], "-m")) {
+		metrics_serve(argv[2]);
+		return 0;
+	} else if (argc >= 2 && !strcmp(argv[1], "-u")) {
+		userlogin(&sc, argc - 2, argv + 2);
+	} else {
+		shm_attach();
+		login(&sc);
+		setuid(0);	/* set real uid to 0 for some ifconfig's */
+		slip_start(&sc);
+		sess_attach(&sc);
+		switch_open(&sc);
+		arp_open(&sc);
+		dns_open(&sc);
+	}
+	if (stats->magic == 0) {	/* an upgrade has it already */
+		stats_open(&sc);
+	}
+	if (sc.flags & CFG_PERF) {
+		perf_open(&sc);
+	}
+	log_open(&sc);
+	if (sc.flows) {
+		flow_open(&sc);
+	}
+	flight_init(&sc);
+	buf_attach(sc.slot);
+	tick();
 
 	while (go) {
-		readfds = rfds;
-		writefds = wfds;
+		stall_end();
+		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
+		maxfd = 1;
 
-		n = select(sc.masterfd+1, &readfds, &writefds, 0, 0);
+		/* read only what we have room to pass on */
+		if (gin.len == 0) {
+			FD_SET(0, &readfds);
+		}
+		if (sc.masterfd >= 0) {
+			if (hin.len == 0) {
+				FD_SET(sc.masterfd, &readfds);
+			}
+			if (hout.len) {
+				FD_SET(sc.masterfd, &writefds);
+			}
+			if (sc.masterfd > maxfd) {
+				maxfd = sc.masterfd;
+			}
+		}
+		if (sc.swfd >= 0 && queueroom(&rs, DIR_GUEST, -1)) {
+			FD_SET(sc.swfd, &readfds);
+			if (sc.swfd > maxfd) {
+				maxfd = sc.swfd;
+			}
+		}
+		if (sc.arpfd >= 0) {
+			FD_SET(sc.arpfd, &readfds);
+			if (sc.arpfd > maxfd) {
+				maxfd = sc.arpfd;
+			}
+		}
+		if (sc.flags & CFG_NAT) {
+			maxfd = nat_fdset(&readfds, &writefds, maxfd);
+		}
+		if (sc.flags & CFG_DNS) {
+			maxfd = dns_fdset(&readfds, maxfd);
+		}
+		if (gout.len) {
+			FD_SET(1, &writefds);
+		}
+
+		n = select(maxfd+1, &readfds, &writefds, 0,
+			timeout(&sc, &gin, &rs, &tv));
+		tick();
+		stall_begin();
+		FLIGHT(FL_WAKEUP, 0, n, n < 0 ? errno : 0);
+		STAT_ADD(stats->wakeups, 1);
+		if (sc.flags & CFG_PERF) {
+			perf_update();
+		}
+		flow_poll();
+		/* input left over means there was no room to pass it on */
+		stats_blocked(DIR_HOST, gin.len > 0);
+		stats_blocked(DIR_GUEST, hin.len > 0);
+
+		if (upgrade) {
+			upgrade = 0;
+			stall_phase(ST_UPGRADE);
+			upgrade_start(&sc, &rs);
+			continue;
+		}
+		if (capture) {
+			capture = 0;
+			stall_phase(ST_CAPTURE);
+			capture_toggle(&sc);
+		}
 
-		if (n > 0) {
+		if (n >= 0) {
 			if (FD_ISSET(0, &readfds)) {
-				bufread(&sc, 0, &stdinbuf);
-				if (stdinbuf.len == 0) {
+				stall_phase(ST_READGUEST);
+				bufread(&sc, 0, &gin, DIR_HOST);
+				if (gin.len == 0) {
 					/* eof on stdin */
 					slip_stop(&sc);
 					exit(0);
 				}
-				if (stdinbuf.len) {
-					FD_SET(sc.masterfd, &wfds);
-					FD_CLR(0, &rfds);
-				}
 			}
-			if (FD_ISSET(sc.masterfd, &readfds)) {
-				bufread(&sc, sc.masterfd, &stdoutbuf);
-				if (stdoutbuf.len) {
-					FD_SET(1, &wfds);
-					FD_CLR(sc.masterfd, &rfds);
-				}
+			if (sc.masterfd >= 0
+			 && FD_ISSET(sc.masterfd, &readfds)) {
+				stall_phase(ST_READHOST);
+				bufread(&sc, sc.masterfd, &hin, DIR_GUEST);
 			}
-			if (FD_ISSET(sc.masterfd, &writefds)) {
-				bufwrite(&sc, sc.masterfd, &stdinbuf);
-				if (stdinbuf.len == 0) {
-					FD_SET(0, &rfds);
-					FD_CLR(sc.masterfd, &wfds);
-				}
+			if (sc.flags & CFG_NAT) {
+				stall_phase(ST_NAT);
+				nat_poll(&readfds, &writefds);
+			}
+			if (sc.flags & CFG_DNS) {
+				stall_phase(ST_DNS);
+				dns_poll(&readfds);
+			}
+			if (sc.swfd >= 0 && FD_ISSET(sc.swfd, &readfds)) {
+				stall_phase(ST_SWITCH);
+				switch_input(&sc, &rs);
+			}
+			if (sc.arpfd >= 0 && FD_ISSET(sc.arpfd, &readfds)) {
+				stall_phase(ST_ARP);
+				arp_input(&sc);
+			}
+
+			stall_phase(ST_RELAY);
+			relay_guest(&sc, &gin, &gdec, &rs);
+			relay_host(&sc, &hin, &hdec, &rs);
+			nat_relay(&sc, &rs);
+
+			if (sc.masterfd >= 0
+			 && FD_ISSET(sc.masterfd, &writefds)) {
+				stall_phase(ST_WRITEHOST);
+				bufwrite(&sc, sc.masterfd, &hout, DIR_HOST);
 			}
 			if (FD_ISSET(1, &writefds)) {
-				bufwrite(&sc, 1, &stdoutbuf);
-				if (stdoutbuf.len == 0) {
-					FD_SET(sc.masterfd, &rfds);
-					FD_CLR(1, &wfds);
-				}
+				stall_phase(ST_WRITEGUEST);
+				bufwrite(&sc, 1, &gout, DIR_GUEST);
 			}
+			/* after the write, so select() sees anything still queued */
+			stall_phase(ST_OUTPUT);
+			output(&sc, &rs, DIR_HOST, &hout);
+			output(&sc, &rs, DIR_GUEST, &gout);
+
+			/* an idle session holds no buffers */
+			bufidle(&gin);
+			bufidle(&gout);
+			bufidle(&hin);
+			bufidle(&hout);
+			queueidle(&rs, DIR_HOST);
+			queueidle(&rs, DIR_GUEST);
+
+			sess_queued(&sc, gin.len + hout.len
+				+ (rs.q[DIR_HOST] ? rs.q[DIR_HOST]->bytes : 0),
+				gout.len
+				+ (rs.q[DIR_GUEST] ? rs.q[DIR_GUEST]->bytes : 0));
 		}
 	}
+	stall_end();
 	slip_stop(&sc);
 	return 0;
 }
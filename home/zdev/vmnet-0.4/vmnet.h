@@ -0,0 +1,91 @@
+/*
+ * VMnet -- generic Virtual Network facility
+ * Copyright (c) 2000 Willem Konynenberg.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Declarations shared between the vmnet source files.
+ */
+
+#ifndef VMNET_H
+#define VMNET_H
+
+#include <netinet/in.h>
+
+#include "config.h"
+#include "prio.h"
+#include "rate.h"
+
+/* a bit per session slot, for sets of sessions */
+#define SESS_WORDS	((MAXSESS + 31) / 32)
+
+/* directions, as seen from the guest */
+#define DIR_HOST	0	/* from our guest, to the host or a peer */
+#define DIR_GUEST	1	/* to our guest */
+
+/*
+ * Everything vmnet keeps per session.  Kept small on purpose: see
+ * "Memory use" in the README.
+ */
+typedef struct slipconnection {
+	int masterfd;
+	int slavefd;
+	int swfd;		/* switch socket, -1 if not switching */
+	int arpfd;		/* proxy ARP socket, -1 if none */
+	int unit;
+	int oldldisc;
+	int slot;		/* our slot in the shared segment, -1 if none */
+	int flags;		/* CFG_* options from the config entry */
+	int vlan;		/* switching domain, 0 by default */
+	int weight;		/* fair queueing weight, see drr.c */
+	struct bucket limit[2];	/* rate limits by DIR_*, see rate.c */
+	struct prio prio;	/* what goes first, see prio.c */
+	in_addr_t remote;
+	in_addr_t local;
+	in_addr_t net;		/* subnet= behind the guest, see switch.c */
+	in_addr_t netmask;	/* 0 if none */
+	const char *username;	/* interned, see intern() */
+	const char *script;	/* interned, "" if none */
+	const char *arpif;	/* interned, "" if no proxy ARP */
+	const char *logto;	/* interned, "" for stderr, see log.c */
+	const char *flowto;	/* interned, "" for FLOW_FILE, see flow.c */
+	int flows;		/* count 1 in this many frames, 0 for none */
+} slipconn;
+
+/* options that may follow the command field of a config entry */
+#define CFG_SWITCH	0x0001	/* switch=on: relay guest-to-guest directly */
+#define CFG_NAT		0x0002	/* vmnet -u: user mode NAT, no SLIP interface */
+#define CFG_DNS		0x0004	/* dns=on: answer DNS queries to the local ip */
+#define CFG_PERF	0x0008	/* perf=on: count CPU cycles etc., see perf.c */
+
+typedef struct {
+	char username[128];
+	char remoteip[64];
+	char localip[64];
+	char script[256];
+	char arpif[16];
+	char logto[128];
+	char flowto[128];
+	int flags;
+	int flows;
+	int vlan;
+	int weight;
+	in_addr_t net;
+	in_addr_t netmask;
+	uint32_t rate[2];	/* bytes per second by DIR_*, 0 for none */
+	uint32_t burst[2];
+	struct prio prio;
+} cfgentry;
+
+cfgentry *getcfgentry(cfgentry *cfg);
+void endcfgentry(void);
+void dumppath(char *buf, int len, const char *fmt, int id);
+int dumpopen(const char *path);
+
+extern unsigned int now;	/* CLOCK_MONOTONIC seconds, once per loop */
+extern unsigned int nowms;	/* the same in milliseconds, wraps */
+
+#endif
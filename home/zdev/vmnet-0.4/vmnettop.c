@@ -0,0 +1,458 @@
+/*
+ * VMnet -- vmnettop, the sessions at a glance
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Shows every running vmnet session, one per line, with what it did
+ * since the last refresh: throughput and frames per second each way,
+ * bytes queued, frames dropped, the median and 99th percentile of the
+ * time frames spent inside vmnet, and the CPU it took.  The busiest
+ * session comes first.  Like "vmnet -m" it only reads the statistics
+ * segments (stats.c), so it needs no privileges and the sessions do
+ * not notice it; the CPU time comes from /proc.  A session whose relay
+ * loop has been stuck for STALL_MS or more gets a line below, with
+ * what it is stuck in (stall.c).
+ *
+ *	vmnettop [-b] [-d SECONDS] [-n COUNT] [-s b|p|q|d|l|c|n]
+ * -b writes plain text, one report after the other, for a log; -n
+ * stops after COUNT of them.  -s (or the same key while it runs) sorts
+ * by throughput, frames, queued bytes, drops, latency, CPU or name.
+ * q quits.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+
+#include "stall.h"
+#include "stats.h"
+
+/* stats.c keeps the relay loop's clock for vmnet; unused here */
+unsigned int now, nowms;
+
+/* one line of the display */
+struct row {
+	char name[16];		/* slN, or the pid in user mode */
+	char remote[16];
+	double bits[2];		/* per second, by DIR_* */
+	double frames[2];
+	double queued;		/* bytes, now */
+	double drops;		/* per second */
+	double p50, p99;	/* us, both directions, -1 if no frames */
+	double cpu;		/* percent of one CPU */
+	double stuck;		/* ms into the current pass of the loop */
+	int phase;		/* ST_*, what that pass is doing */
+};
+
+static char sortkey = 'b';
+static volatile sig_atomic_t go = 1;
+static struct termios saved;
+static int tty;
+
+static void sig_catch(int sig)
+{
+	go = 0;
+}
+
+static uint64_t coarsems(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static double seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The user and system time of pid so far, in clock ticks; 0 if gone */
+static unsigned long cputicks(pid_t pid)
+{
+	char path[32], buf[512], *p;
+	unsigned long utime, stime;
+	FILE *f;
+	int n;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if ((f = fopen(path, "r")) == NULL) {
+		return 0;
+	}
+	n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n > 0 ? n : 0] = '\0';
+	/* the command may contain anything, even ") " */
+	if ((p = strrchr(buf, ')')) == NULL
+	 || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+		"%lu %lu", &utime, &stime) != 2) {
+		return 0;
+	}
+	return utime + stime;
+}
+
+/* Whether any counter of v is behind old, so v is not old's future */
+static int backwards(const struct vmstats *v, const struct vmstats *old)
+{
+	int dir, i;
+
+	for (dir = 0; dir < 2; dir++) {
+		if (v->dir[dir].bytes < old->dir[dir].bytes
+		 || v->dir[dir].frames < old->dir[dir].frames
+		 || v->dir[dir].drops < old->dir[dir].drops
+		 || v->lat[dir].count < old->lat[dir].count) {
+			return 1;
+		}
+		for (i = 0; i < LAT_BUCKETS; i++) {
+			if (v->lat[dir].bucket[i] < old->lat[dir].bucket[i]) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * The same session in the previous report: same unit, or same pid, and
+ * started at the same time (an upgrade keeps that).  A unit is soon
+ * used again by another session, hence the start time; and should
+ * counters still go backwards, it is taken as a new session too.
+ */
+static struct vmstats *previous(struct vmstats *v, struct vmstats *old,
+	int nold)
+{
+	int i;
+
+	for (i = 0; i < nold; i++) {
+		if ((v->unit >= 0 ? old[i].unit == v->unit
+		    : old[i].pid == v->pid)
+		 && old[i].start == v->start) {
+			return backwards(v, &old[i]) ? NULL : &old[i];
+		}
+	}
+	return NULL;
+}
+
+/* Latency percentiles of the frames relayed since old, both ways */
+static void latency(struct row *r, const struct vmstats *v,
+	const struct vmstats *old)
+{
+	static struct stathist h;
+	int dir, i;
+
+	memset(&h, 0, sizeof(h));
+	for (dir = 0; dir < 2; dir++) {
+		for (i = 0; i < LAT_BUCKETS; i++) {
+			h.bucket[i] += v->lat[dir].bucket[i]
+				- (old ? old->lat[dir].bucket[i] : 0);
+		}
+		h.count += v->lat[dir].count - (old ? old->lat[dir].count : 0);
+		if (v->lat[dir].max > h.max) {
+			h.max = v->lat[dir].max;
+		}
+	}
+	if (h.count == 0) {
+		r->p50 = r->p99 = -1;
+		return;
+	}
+	r->p50 = lat_quantile(&h, 0.5);
+	r->p99 = lat_quantile(&h, 0.99);
+}
+
+static void fill(struct row *r, struct vmstats *v, struct vmstats *old,
+	unsigned long ticks, unsigned long oldticks, double dt)
+{
+	struct in_addr a;
+	int dir;
+
+	if (v->unit >= 0) {
+		snprintf(r->name, sizeof(r->name), "sl%d", v->unit);
+	} else {
+		snprintf(r->name, sizeof(r->name), "%d", (int)v->pid);
+	}
+	a.s_addr = v->remote;
+	inet_ntop(AF_INET, &a, r->remote, sizeof(r->remote));
+	r->queued = v->dir[DIR_HOST].queued + v->dir[DIR_GUEST].queued;
+	r->drops = 0;
+	for (dir = 0; dir < 2; dir++) {
+		r->bits[dir] = old == NULL ? 0
+			: 8.0 * (v->dir[dir].bytes - old->dir[dir].bytes) / dt;
+		r->frames[dir] = old == NULL ? 0
+			: (v->dir[dir].frames - old->dir[dir].frames) / dt;
+		r->drops += old == NULL ? 0
+			: (v->dir[dir].drops - old->dir[dir].drops) / dt;
+	}
+	latency(r, v, old);
+	r->stuck = v->loop.busy && coarsems() > v->loop.busy
+		? coarsems() - v->loop.busy : 0;
+	r->phase = v->loop.phase;
+	/* after an upgrade the ticks are another process's */
+	r->cpu = old == NULL || old->pid != v->pid || ticks < oldticks ? 0
+		: 100.0 * (ticks - oldticks) / sysconf(_SC_CLK_TCK) / dt;
+}
+
+static double sortval(const struct row *r)
+{
+	switch (sortkey) {
+	case 'p':
+		return r->frames[0] + r->frames[1];
+	case 'q':
+		return r->queued;
+	case 'd':
+		return r->drops;
+	case 'l':
+		return r->p99;
+	case 'c':
+		return r->cpu;
+	}
+	return r->bits[0] + r->bits[1];
+}
+
+/* Biggest first, by name for equals (and for -s n) */
+static int compare(const void *a, const void *b)
+{
+	const struct row *x = a, *y = b;
+	double vx = sortval(x), vy = sortval(y);
+
+	if (sortkey != 'n' && vx != vy) {
+		return vx < vy ? 1 : -1;
+	}
+	if (strlen(x->name) != strlen(y->name)) {
+		return strlen(x->name) < strlen(y->name) ? -1 : 1;
+	}
+	return strcmp(x->name, y->name);
+}
+
+/* A number in at most 5 characters: 999, 12.3k, 123k, 1.2M */
+static char *human(char *buf, double v)
+{
+	static const char unit[] = " kMGT";
+	int u = 0;
+
+	while (v >= 999.5 && u < 4) {
+		v /= 1000;
+		u++;
+	}
+	if (u == 0) {
+		snprintf(buf, 8, "%.0f", v);
+	} else {
+		snprintf(buf, 8, v < 9.95 ? "%.1f%c" : "%.0f%c", v, unit[u]);
+	}
+	return buf;
+}
+
+/* Microseconds in at most 5 characters: 850u, 1.2m, 12m, 1.5s */
+static char *duration(char *buf, double us)
+{
+	if (us < 0) {
+		strcpy(buf, "-");
+	} else if (us < 1000) {
+		snprintf(buf, 8, "%.0fu", us);
+	} else if (us < 1e6) {
+		snprintf(buf, 8, us < 9950 ? "%.1fm" : "%.0fm", us / 1e3);
+	} else {
+		snprintf(buf, 8, "%.1fs", us / 1e6);
+	}
+	return buf;
+}
+
+static void report(struct row *r, int n, int lines)
+{
+	static const char *phase[] = STALL_NAMES;
+	char b[8][8], when[16];
+	double total[2] = { 0, 0 };
+	time_t t = time(NULL);
+	int i;
+
+	for (i = 0; i < n; i++) {
+		total[0] += r[i].bits[0];
+		total[1] += r[i].bits[1];
+	}
+	strftime(when, sizeof(when), "%H:%M:%S", localtime(&t));
+	printf("vmnettop %s, %d session%s, %sbit/s from guests, "
+		"%sbit/s to them\n", when, n, n == 1 ? "" : "s",
+		human(b[0], total[0]), human(b[1], total[1]));
+	printf("%-7s %-15s %7s %6s %7s %6s %5s %5s %5s %5s %4s\n",
+		"SESSION", "REMOTE", "TX-BIT", "TX-PPS", "RX-BIT", "RX-PPS",
+		"QUEUE", "DROPS", "P50", "P99", "CPU%");
+	for (i = 0; i < n && (lines <= 0 || i < lines); i++) {
+		printf("%-7s %-15s %7s %6s %7s %6s %5s %5s %5s %5s %4.0f\n",
+			r[i].name, r[i].remote,
+			human(b[0], r[i].bits[DIR_HOST]),
+			human(b[1], r[i].frames[DIR_HOST]),
+			human(b[2], r[i].bits[DIR_GUEST]),
+			human(b[3], r[i].frames[DIR_GUEST]),
+			human(b[4], r[i].queued), human(b[5], r[i].drops),
+			duration(b[6], r[i].p50), duration(b[7], r[i].p99),
+			r[i].cpu);
+	}
+	if (i < n) {
+		printf("(%d more)\n", n - i);
+	}
+	for (i = 0; i < n && (lines <= 0 || i < lines); i++) {
+		if (r[i].stuck >= STALL_MS && r[i].phase >= 0
+		 && r[i].phase < (int)(sizeof(phase) / sizeof(phase[0]))) {
+			printf("%s stuck for %s in %s\n", r[i].name,
+				duration(b[0], r[i].stuck * 1e3),
+				phase[r[i].phase]);
+		}
+	}
+}
+
+static void restore(void)
+{
+	if (tty) {
+		tcsetattr(0, TCSANOW, &saved);
+	}
+}
+
+/* Wait dt seconds, or until a key; handle the key */
+static void waitkey(double dt)
+{
+	struct timeval tv;
+	fd_set fds;
+	char c;
+
+	tv.tv_sec = dt;
+	tv.tv_usec = (dt - tv.tv_sec) * 1e6;
+	FD_ZERO(&fds);
+	if (tty) {
+		FD_SET(0, &fds);
+	}
+	if (select(tty ? 1 : 0, &fds, NULL, NULL, &tv) <= 0
+	 || read(0, &c, 1) != 1) {
+		return;
+	}
+	if (c == 'q') {
+		go = 0;
+	} else if (strchr("bpqdlcn", c) != NULL) {
+		sortkey = c;
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: vmnettop [-b] [-d seconds] [-n count] "
+		"[-s b|p|q|d|l|c|n]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct vmstats *v = NULL, *old = NULL, *p;
+	unsigned long *ticks = NULL, *oldticks = NULL;
+	struct row *rows;
+	struct termios raw;
+	struct winsize ws;
+	struct sigaction sa;
+	double interval = 1, t, last;
+	int n, nold = 0, count = 0, batch = 0, c, i;
+
+	while ((c = getopt(argc, argv, "bd:n:s:")) != -1) {
+		switch (c) {
+		case 'b':
+			batch = 1;
+			break;
+		case 'd':
+			if ((interval = atof(optarg)) < 0.1) {
+				usage();
+			}
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 's':
+			if (strlen(optarg) != 1
+			 || strchr("bpqdlcn", optarg[0]) == NULL) {
+				usage();
+			}
+			sortkey = optarg[0];
+			break;
+		default:
+			usage();
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_catch;
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+	sigaction(SIGHUP, &sa, 0);
+	if (!batch && isatty(0) && tcgetattr(0, &saved) == 0) {
+		raw = saved;
+		raw.c_lflag &= ~(ICANON|ECHO);
+		raw.c_cc[VMIN] = 1;
+		raw.c_cc[VTIME] = 0;
+		tty = tcsetattr(0, TCSANOW, &raw) == 0;
+		atexit(restore);
+	}
+
+	/* a first look, so that even the first report has rates */
+	nold = stats_collect(&old);
+	if ((oldticks = calloc(nold + 1, sizeof(*oldticks))) == NULL) {
+		perror("vmnettop: malloc");
+		exit(1);
+	}
+	for (i = 0; i < nold; i++) {
+		oldticks[i] = cputicks(old[i].pid);
+	}
+	last = seconds();
+	waitkey(interval < 0.5 ? interval : 0.5);
+
+	while (go) {
+		n = stats_collect(&v);
+		t = seconds();
+		rows = calloc(n + 1, sizeof(*rows));
+		ticks = calloc(n + 1, sizeof(*ticks));
+		if (rows == NULL || ticks == NULL) {
+			perror("vmnettop: malloc");
+			exit(1);
+		}
+		for (i = 0; i < n; i++) {
+			ticks[i] = cputicks(v[i].pid);
+			p = previous(&v[i], old, nold);
+			fill(&rows[i], &v[i], p, ticks[i],
+				p ? oldticks[p - old] : 0, t - last);
+		}
+		qsort(rows, n, sizeof(*rows), compare);
+		if (!batch && isatty(1)) {
+			printf("\033[H\033[2J");
+		}
+		if (!batch && ioctl(1, TIOCGWINSZ, &ws) == 0
+		 && ws.ws_row > 3) {
+			report(rows, n, ws.ws_row - 3);
+		} else {
+			report(rows, n, 0);
+		}
+		if (batch) {
+			printf("\n");
+		}
+		fflush(stdout);
+
+		free(rows);
+		free(old);
+		free(oldticks);
+		old = v;
+		oldticks = ticks;
+		nold = n;
+		last = t;
+		if (count > 0 && --count == 0) {
+			break;
+		}
+		waitkey(interval);
+	}
+	return 0;
+}